@@ -83,13 +83,14 @@ static int set_peer(struct wireguard_device *wg, void __user *user_peer, size_t
 		socket_set_peer_endpoint(peer, &endpoint);
 	}
 
+	/* When the update is staged, rather than removing every ipmask and adding them all back, we mark
+	 * the old ones as stale, so that the ones that are re-added are simply revived, and
+	 * routing_table_end_update() in config_set_device() drops the rest along with publishing
+	 * everything else. Otherwise, they're removed straight away, as before. */
 	if (in_peer.replace_ipmasks)
-		routing_table_remove_by_peer(&wg->peer_routing_table, peer);
-	for (i = 0, user_ipmask = user_peer + sizeof(struct wgpeer); i < in_peer.num_ipmasks; ++i, user_ipmask += sizeof(struct wgipmask)) {
+		ret = routing_table_stale_by_peer(&wg->peer_routing_table, peer);
+	for (i = 0, user_ipmask = user_peer + sizeof(struct wgpeer); !ret && i < in_peer.num_ipmasks; ++i, user_ipmask += sizeof(struct wgipmask))
 		ret = set_ipmask(peer, user_ipmask);
-		if (ret)
-			break;
-	}
 
 	if (in_peer.persistent_keepalive_interval != (u16)-1) {
 		const bool send_keepalive = !peer->persistent_keepalive_interval && in_peer.persistent_keepalive_interval && netdev_pub(wg)->flags & IFF_UP;
@@ -126,6 +127,12 @@ int config_set_device(struct wireguard_device *wg, void __user *user_device)
 		goto out;
 	}
 
+	/* Staging copies the whole routing table, so it's only worth it when a good part of it is
+	 * being set. Anything smaller, like a `wg set` of one peer, is applied in place, so that a
+	 * script setting up peers one at a time doesn't copy the table for each of them. */
+	if (in_device.replace_peer_list || in_device.num_peers * 4 >= peer_total_count(wg))
+		routing_table_begin_update(&wg->peer_routing_table);
+
 	if (in_device.port) {
 		ret = set_device_port(wg, in_device.port);
 		if (ret)
@@ -144,6 +151,9 @@ int config_set_device(struct wireguard_device *wg, void __user *user_device)
 		noise_set_static_identity_preshared_key(&wg->static_identity, NULL);
 	else if (memcmp(zeros, in_device.preshared_key, WG_KEY_LEN))
 		noise_set_static_identity_preshared_key(&wg->static_identity, in_device.preshared_key);
+	cookie_checker_precompute_keys(&wg->cookie_checker);
+
+	pubkey_hashtable_reserve(&wg->peer_hashtable, in_device.num_peers);
 
 	for (i = 0, offset = 0, user_peer = user_device + sizeof(struct wgdevice); i < in_device.num_peers; ++i, user_peer += offset) {
 		ret = set_peer(wg, user_peer, &offset);
@@ -152,6 +162,7 @@ int config_set_device(struct wireguard_device *wg, void __user *user_device)
 	}
 
 out:
+	routing_table_end_update(&wg->peer_routing_table);
 	mutex_unlock(&wg->device_update_lock);
 	memzero_explicit(&in_device.private_key, NOISE_PUBLIC_KEY_LEN);
 	return ret;
@@ -220,6 +231,7 @@ static int populate_peer(struct wireguard_peer *peer, void *ctx)
 	struct data_remaining *data = ctx;
 	void __user *upeer = data->data;
 	struct wgpeer out_peer;
+	struct peer_stats stats;
 	struct data_remaining ipmasks_data = { NULL };
 
 	memset(&out_peer, 0, sizeof(struct wgpeer));
@@ -236,8 +248,9 @@ static int populate_peer(struct wireguard_peer *peer, void *ctx)
 		*(struct sockaddr_in6 *)&out_peer.endpoint = peer->endpoint.addr6;
 	read_unlock_bh(&peer->endpoint_lock);
 	out_peer.last_handshake_time = peer->walltime_last_handshake;
-	out_peer.tx_bytes = peer->tx_bytes;
-	out_peer.rx_bytes = peer->rx_bytes;
+	peer_stats_get(peer, &stats);
+	out_peer.rx_bytes = stats.rx_bytes;
+	out_peer.tx_bytes = stats.tx_bytes;
 	out_peer.persistent_keepalive_interval = (u16)(peer->persistent_keepalive_interval / HZ);
 
 	ipmasks_data.out_len = data->out_len;
@@ -307,3 +320,79 @@ out:
 	memzero_explicit(&out_device.private_key, NOISE_PUBLIC_KEY_LEN);
 	return ret;
 }
+
+static int populate_peer_stats(struct wireguard_peer *peer, void *ctx)
+{
+	int ret = 0;
+	struct data_remaining *data = ctx;
+	void __user *upeer = data->data;
+	struct wgpeer_stats out_peer;
+	struct peer_stats stats;
+
+	memset(&out_peer, 0, sizeof(struct wgpeer_stats));
+
+	ret = use_data(data, sizeof(struct wgpeer_stats));
+	if (ret)
+		return ret;
+
+	memcpy(out_peer.public_key, peer->handshake.remote_static, NOISE_PUBLIC_KEY_LEN);
+	peer_stats_get(peer, &stats);
+	out_peer.rx_packets = stats.rx_packets;
+	out_peer.tx_packets = stats.tx_packets;
+	out_peer.rx_dropped_length = stats.rx_dropped_length;
+	out_peer.rx_dropped_source = stats.rx_dropped_source;
+	out_peer.rx_dropped_auth = stats.rx_dropped_auth;
+	out_peer.rx_replayed = stats.rx_replayed;
+	out_peer.tx_dropped = stats.tx_dropped;
+	out_peer.handshake_initiations = stats.handshake_initiations;
+
+	if (copy_to_user(upeer, &out_peer, sizeof(out_peer)))
+		ret = -EFAULT;
+	return ret;
+}
+
+int config_get_stats(struct wireguard_device *wg, void __user *ustats)
+{
+	int ret = 0;
+	struct data_remaining peer_data = { NULL };
+	struct wgdevice_stats out_stats;
+	u64 size;
+
+	memset(&out_stats, 0, sizeof(struct wgdevice_stats));
+
+	mutex_lock(&wg->device_update_lock);
+
+	if (!ustats) {
+		ret = sizeof(struct wgdevice_stats) + peer_total_count(wg) * sizeof(struct wgpeer_stats);
+		goto out;
+	}
+
+	if (copy_from_user(&size, ustats, sizeof(size))) {
+		ret = -EFAULT;
+		goto out;
+	}
+	if (size < sizeof(struct wgdevice_stats)) {
+		ret = -EMSGSIZE;
+		goto out;
+	}
+
+	out_stats.size = size;
+	out_stats.device_stats_size = sizeof(struct wgdevice_stats);
+	out_stats.peer_stats_size = sizeof(struct wgpeer_stats);
+	routing_table_cache_stats(&wg->peer_routing_table, &out_stats.route_cache_hits, &out_stats.route_cache_misses);
+	noise_ephemeral_pool_stats(&wg->ephemeral_pool, &out_stats.ephemeral_pool_depth, &out_stats.ephemeral_pool_hits, &out_stats.ephemeral_pool_misses);
+
+	peer_data.out_len = size - sizeof(struct wgdevice_stats);
+	peer_data.data = ustats + sizeof(struct wgdevice_stats);
+	ret = peer_for_each_unlocked(wg, populate_peer_stats, &peer_data);
+	if (ret)
+		goto out;
+	out_stats.num_peers = peer_data.count;
+
+	if (copy_to_user(ustats, &out_stats, sizeof(out_stats)))
+		ret = -EFAULT;
+
+out:
+	mutex_unlock(&wg->device_update_lock);
+	return ret;
+}
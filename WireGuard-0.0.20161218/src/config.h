@@ -7,5 +7,6 @@ struct wireguard_device;
 
 int config_get_device(struct wireguard_device *wg, void __user *udevice);
 int config_set_device(struct wireguard_device *wg, void __user *udevice);
+int config_get_stats(struct wireguard_device *wg, void __user *ustats);
 
 #endif
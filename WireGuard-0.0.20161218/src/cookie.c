@@ -13,19 +13,21 @@
 
 int cookie_checker_init(struct cookie_checker *checker, struct wireguard_device *wg)
 {
-	int ret = ratelimiter_init(&checker->ratelimiter, wg);
+	int ret = ratelimiter_init(&checker->ratelimiter);
 	if (ret)
 		return ret;
 	init_rwsem(&checker->secret_lock);
 	checker->secret_birthdate = get_jiffies_64();
 	get_random_bytes(checker->secret, NOISE_HASH_LEN);
 	checker->device = wg;
+	cookie_checker_precompute_keys(checker);
 	return 0;
 }
 
 void cookie_checker_uninit(struct cookie_checker *checker)
 {
 	ratelimiter_uninit(&checker->ratelimiter);
+	memzero_explicit(&checker->mac1_state, sizeof(checker->mac1_state));
 }
 
 void cookie_init(struct cookie *cookie)
@@ -34,17 +36,38 @@ void cookie_init(struct cookie *cookie)
 	init_rwsem(&cookie->lock);
 }
 
+/* Everything that goes into mac1 before the message itself. */
+static void mac1_init(struct blake2s_state *state, const u8 pubkey[NOISE_PUBLIC_KEY_LEN], const u8 psk[NOISE_SYMMETRIC_KEY_LEN])
+{
+	if (psk)
+		blake2s_init_key(state, COOKIE_LEN, psk, NOISE_SYMMETRIC_KEY_LEN);
+	else
+		blake2s_init(state, COOKIE_LEN);
+	blake2s_update(state, pubkey, NOISE_PUBLIC_KEY_LEN);
+}
+
+/* Called whenever our private key or psk changes, since everything before the message in
+ * mac1 depends only on those, so it only needs hashing once. The old state is wiped first,
+ * so that nothing hashed from a psk that was just removed lingers in it. */
+void cookie_checker_precompute_keys(struct cookie_checker *checker)
+{
+	down_write(&checker->device->static_identity.lock);
+	memzero_explicit(&checker->mac1_state, sizeof(checker->mac1_state));
+	mac1_init(&checker->mac1_state, checker->device->static_identity.static_public, checker->device->static_identity.has_psk ? checker->device->static_identity.preshared_key : NULL);
+	up_write(&checker->device->static_identity.lock);
+}
+
+static inline size_t mac1_len(size_t len)
+{
+	return len - sizeof(struct message_macs) + offsetof(struct message_macs, mac1);
+}
+
 static void compute_mac1(u8 mac1[COOKIE_LEN], const void *message, size_t len, const u8 pubkey[NOISE_PUBLIC_KEY_LEN], const u8 psk[NOISE_SYMMETRIC_KEY_LEN])
 {
 	struct blake2s_state state;
-	len = len - sizeof(struct message_macs) + offsetof(struct message_macs, mac1);
 
-	if (psk)
-		blake2s_init_key(&state, COOKIE_LEN, psk, NOISE_SYMMETRIC_KEY_LEN);
-	else
-		blake2s_init(&state, COOKIE_LEN);
-	blake2s_update(&state, pubkey, NOISE_PUBLIC_KEY_LEN);
-	blake2s_update(&state, message, len);
+	mac1_init(&state, pubkey, psk);
+	blake2s_update(&state, message, mac1_len(len));
 	blake2s_final(&state, mac1, COOKIE_LEN);
 }
 
@@ -89,24 +112,14 @@ static void make_cookie(u8 cookie[COOKIE_LEN], struct sk_buff *skb, struct cooki
 	put_secret(checker);
 }
 
-enum cookie_mac_state cookie_validate_packet(struct cookie_checker *checker, struct sk_buff *skb, void *data_start, size_t data_len, bool check_cookie)
+/* The rest of cookie_validate_packet, once mac1 is known to be good. */
+static enum cookie_mac_state validate_cookie(struct cookie_checker *checker, struct sk_buff *skb, void *data_start, size_t data_len, bool check_cookie)
 {
 	u8 computed_mac[COOKIE_LEN];
 	u8 cookie[COOKIE_LEN];
 	enum cookie_mac_state ret;
 	struct message_macs *macs = (struct message_macs *)((u8 *)data_start + data_len - sizeof(struct message_macs));
 
-	ret = INVALID_MAC;
-	down_read(&checker->device->static_identity.lock);
-	if (unlikely(!checker->device->static_identity.has_identity)) {
-		up_read(&checker->device->static_identity.lock);
-		goto out;
-	}
-	compute_mac1(computed_mac, data_start, data_len, checker->device->static_identity.static_public, checker->device->static_identity.has_psk ? checker->device->static_identity.preshared_key : NULL);
-	up_read(&checker->device->static_identity.lock);
-	if (crypto_memneq(computed_mac, macs->mac1, COOKIE_LEN))
-		goto out;
-
 	ret = VALID_MAC_BUT_NO_COOKIE;
 
 	if (!check_cookie)
@@ -130,6 +143,72 @@ out:
 	return ret;
 }
 
+enum cookie_mac_state cookie_validate_packet(struct cookie_checker *checker, struct sk_buff *skb, void *data_start, size_t data_len, bool check_cookie)
+{
+	u8 computed_mac[COOKIE_LEN];
+	struct message_macs *macs = (struct message_macs *)((u8 *)data_start + data_len - sizeof(struct message_macs));
+	struct blake2s_state state;
+	bool valid_mac1;
+
+	down_read(&checker->device->static_identity.lock);
+	if (unlikely(!checker->device->static_identity.has_identity)) {
+		up_read(&checker->device->static_identity.lock);
+		return INVALID_MAC;
+	}
+	state = checker->mac1_state;
+	up_read(&checker->device->static_identity.lock);
+	blake2s_update(&state, data_start, mac1_len(data_len));
+	blake2s_final(&state, computed_mac, COOKIE_LEN);
+	valid_mac1 = !crypto_memneq(computed_mac, macs->mac1, COOKIE_LEN);
+	memzero_explicit(computed_mac, COOKIE_LEN);
+	if (!valid_mac1)
+		return INVALID_MAC;
+	return validate_cookie(checker, skb, data_start, data_len, check_cookie);
+}
+
+/* Since all messages of a type have the same length, their mac1s only differ in the message
+ * part, so blake2s_batch can compute several at once, which is most of the work of checking
+ * a flood of them. */
+void cookie_validate_packets(struct cookie_checker *checker, enum cookie_mac_state ret[], struct sk_buff *skb[], void *data_start[], size_t data_len, size_t num, bool check_cookie)
+{
+	enum { BATCH_SIZE = 8 };
+	u8 computed_macs[BATCH_SIZE][COOKIE_LEN];
+	u8 *out[BATCH_SIZE];
+	const u8 *in[BATCH_SIZE];
+	struct blake2s_state state;
+	struct message_macs *macs;
+	size_t i, j, n;
+
+	down_read(&checker->device->static_identity.lock);
+	if (unlikely(!checker->device->static_identity.has_identity)) {
+		up_read(&checker->device->static_identity.lock);
+		for (i = 0; i < num; ++i)
+			ret[i] = INVALID_MAC;
+		return;
+	}
+	state = checker->mac1_state;
+	up_read(&checker->device->static_identity.lock);
+
+	for (i = 0; i < num; i += n) {
+		n = min_t(size_t, num - i, BATCH_SIZE);
+		for (j = 0; j < n; ++j) {
+			out[j] = computed_macs[j];
+			in[j] = data_start[i + j];
+		}
+		blake2s_batch(out, &state, in, mac1_len(data_len), COOKIE_LEN, n);
+		for (j = 0; j < n; ++j) {
+			macs = (struct message_macs *)((u8 *)data_start[i + j] + data_len - sizeof(struct message_macs));
+			if (crypto_memneq(computed_macs[j], macs->mac1, COOKIE_LEN))
+				ret[i + j] = INVALID_MAC;
+			else
+				ret[i + j] = validate_cookie(checker, skb[i + j], data_start[i + j], data_len, check_cookie);
+		}
+	}
+
+	memzero_explicit(computed_macs, sizeof(computed_macs));
+	memzero_explicit(&state, sizeof(state));
+}
+
 void cookie_add_mac_to_packet(void *message, size_t len, struct wireguard_peer *peer)
 {
 	struct message_macs *macs = (struct message_macs *)((u8 *)message + len - sizeof(struct message_macs));
@@ -5,6 +5,7 @@
 
 #include "messages.h"
 #include "ratelimiter.h"
+#include "crypto/blake2s.h"
 #include <linux/rwsem.h>
 
 struct wireguard_peer;
@@ -16,6 +17,9 @@ struct cookie_checker {
 	u64 secret_birthdate;
 	struct rw_semaphore secret_lock;
 	struct ratelimiter ratelimiter;
+	/* The mac1 hash keyed with our own public key and psk, up to where the message begins.
+	 * Protected by the static identity lock of the device. */
+	struct blake2s_state mac1_state;
 	struct wireguard_device *device;
 };
 
@@ -37,9 +41,11 @@ enum cookie_mac_state {
 
 int cookie_checker_init(struct cookie_checker *checker, struct wireguard_device *wg);
 void cookie_checker_uninit(struct cookie_checker *checker);
+void cookie_checker_precompute_keys(struct cookie_checker *checker);
 void cookie_init(struct cookie *cookie);
 
 enum cookie_mac_state cookie_validate_packet(struct cookie_checker *checker, struct sk_buff *skb, void *data_start, size_t data_len, bool check_cookie);
+void cookie_validate_packets(struct cookie_checker *checker, enum cookie_mac_state ret[], struct sk_buff *skb[], void *data_start[], size_t data_len, size_t num, bool check_cookie);
 void cookie_add_mac_to_packet(void *message, size_t len, struct wireguard_peer *peer);
 
 void cookie_message_create(struct message_handshake_cookie *src, struct sk_buff *skb, void *data_start, size_t data_len, __le32 index, struct cookie_checker *checker);
@@ -8,6 +8,36 @@
 #include <linux/types.h>
 #include <linux/string.h>
 #include <linux/kernel.h>
+#include <linux/version.h>
+
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/processor.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+#include <asm/fpu/api.h>
+#include <asm/simd.h>
+#else
+#include <asm/i387.h>
+#endif
+#ifdef CONFIG_AS_SSSE3
+asmlinkage void blake2s_compress_ssse3(struct blake2s_state *state, const u8 *block, size_t nblocks, u32 inc);
+#endif
+#ifdef CONFIG_AS_AVX2
+asmlinkage void blake2s_compress_8way_avx2(u32 h[8][8], const u32 m[16][8], const u32 tf[4]);
+#endif
+static bool blake2s_use_ssse3 = false;
+static bool blake2s_use_avx2 = false;
+/* Taking and giving back the FPU costs about as much as SSSE3 saves on four blocks, so shorter
+ * runs, which is to say every hash the handshake does, are left to the generic code. */
+static size_t blake2s_ssse3_min_blocks = 8;
+void blake2s_fpu_init(void)
+{
+	blake2s_use_ssse3 = boot_cpu_has(X86_FEATURE_SSSE3);
+	blake2s_use_avx2 = boot_cpu_has(X86_FEATURE_AVX) && boot_cpu_has(X86_FEATURE_AVX2);
+}
+#else
+void blake2s_fpu_init(void) { }
+#endif
 
 typedef struct {
 	u8 digest_length;
@@ -107,26 +137,29 @@ void blake2s_init_key(struct blake2s_state *state, const u8 outlen, const void *
 }
 
 __attribute__((optimize("unroll-loops")))
-static inline void blake2s_compress(struct blake2s_state *state, const u8 block[BLAKE2S_BLOCKBYTES])
+static inline void blake2s_compress_generic(struct blake2s_state *state, const u8 *block, size_t nblocks, const u32 inc)
 {
 	u32 m[16];
 	u32 v[16];
 	int i;
 
-	for (i = 0; i < 16; ++i)
-		m[i] = le32_to_cpuvp(block + i * sizeof(m[i]));
+	while (nblocks > 0) {
+		blake2s_increment_counter(state, inc);
 
-	for (i = 0; i < 8; ++i)
-		v[i] = state->h[i];
-
-	v[8] = blake2s_iv[0];
-	v[9] = blake2s_iv[1];
-	v[10] = blake2s_iv[2];
-	v[11] = blake2s_iv[3];
-	v[12] = state->t[0] ^ blake2s_iv[4];
-	v[13] = state->t[1] ^ blake2s_iv[5];
-	v[14] = state->f[0] ^ blake2s_iv[6];
-	v[15] = state->f[1] ^ blake2s_iv[7];
+		for (i = 0; i < 16; ++i)
+			m[i] = le32_to_cpuvp(block + i * sizeof(m[i]));
+
+		for (i = 0; i < 8; ++i)
+			v[i] = state->h[i];
+
+		v[8] = blake2s_iv[0];
+		v[9] = blake2s_iv[1];
+		v[10] = blake2s_iv[2];
+		v[11] = blake2s_iv[3];
+		v[12] = state->t[0] ^ blake2s_iv[4];
+		v[13] = state->t[1] ^ blake2s_iv[5];
+		v[14] = state->f[0] ^ blake2s_iv[6];
+		v[15] = state->f[1] ^ blake2s_iv[7];
 #define G(r,i,a,b,c,d) \
 	do { \
 		a = a + b + m[blake2s_sigma[r][2 * i + 0]]; \
@@ -149,46 +182,66 @@ static inline void blake2s_compress(struct blake2s_state *state, const u8 block[
 	G(r,6,v[ 2],v[ 7],v[ 8],v[13]); \
 	G(r,7,v[ 3],v[ 4],v[ 9],v[14]); \
 } while(0)
-	ROUND(0);
-	ROUND(1);
-	ROUND(2);
-	ROUND(3);
-	ROUND(4);
-	ROUND(5);
-	ROUND(6);
-	ROUND(7);
-	ROUND(8);
-	ROUND(9);
-
-	for (i = 0; i < 8; ++i)
-		state->h[i] = state->h[i] ^ v[i] ^ v[i + 8];
+		ROUND(0);
+		ROUND(1);
+		ROUND(2);
+		ROUND(3);
+		ROUND(4);
+		ROUND(5);
+		ROUND(6);
+		ROUND(7);
+		ROUND(8);
+		ROUND(9);
+
+		for (i = 0; i < 8; ++i)
+			state->h[i] = state->h[i] ^ v[i] ^ v[i + 8];
 #undef G
 #undef ROUND
+
+		block += BLAKE2S_BLOCKBYTES;
+		--nblocks;
+	}
 }
 
+/* Compresses nblocks consecutive blocks, adding inc to the counter before each one. */
+static void blake2s_compress(struct blake2s_state *state, const u8 *block, size_t nblocks, const u32 inc)
+{
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_SSSE3)
+	if (blake2s_use_ssse3 && nblocks >= blake2s_ssse3_min_blocks && irq_fpu_usable()) {
+		kernel_fpu_begin();
+		blake2s_compress_ssse3(state, block, nblocks, inc);
+		kernel_fpu_end();
+		return;
+	}
+#endif
+	blake2s_compress_generic(state, block, nblocks, inc);
+}
+
+/* The last block has to be compressed with the finalization flag set, and it is only known
+ * to be the last one once blake2s_final() is called, so up to a whole block is always left
+ * in the buffer, and everything before it is compressed straight from the input. */
 void blake2s_update(struct blake2s_state *state, const u8 *in, u64 inlen)
 {
-	size_t left, fill;
-	while (inlen > 0) {
-		left = state->buflen;
-		fill = 2 * BLAKE2S_BLOCKBYTES - left;
-
-		if (inlen > fill) {
-			memcpy(state->buf + left, in, fill); // Fill buffer
-			state->buflen += fill;
-			blake2s_increment_counter(state, BLAKE2S_BLOCKBYTES);
-			blake2s_compress(state, state->buf); // Compress
-			memcpy(state->buf, state->buf + BLAKE2S_BLOCKBYTES, BLAKE2S_BLOCKBYTES);// Shift buffer left
-			state->buflen -= BLAKE2S_BLOCKBYTES;
-			in += fill;
-			inlen -= fill;
-		} else { // inlen <= fill
-			memcpy(state->buf + left, in, inlen);
-			state->buflen += inlen; // Be lazy, do not compress
-			in += inlen;
-			inlen -= inlen;
-		}
+	const size_t fill = BLAKE2S_BLOCKBYTES - state->buflen;
+	size_t nblocks;
+
+	if (unlikely(!inlen))
+		return;
+	if (inlen > fill) {
+		memcpy(state->buf + state->buflen, in, fill);
+		blake2s_compress(state, state->buf, 1, BLAKE2S_BLOCKBYTES);
+		state->buflen = 0;
+		in += fill;
+		inlen -= fill;
+	}
+	if (inlen > BLAKE2S_BLOCKBYTES) {
+		nblocks = DIV_ROUND_UP(inlen, BLAKE2S_BLOCKBYTES) - 1;
+		blake2s_compress(state, in, nblocks, BLAKE2S_BLOCKBYTES);
+		in += BLAKE2S_BLOCKBYTES * nblocks;
+		inlen -= BLAKE2S_BLOCKBYTES * nblocks;
 	}
+	memcpy(state->buf + state->buflen, in, inlen);
+	state->buflen += inlen;
 }
 
 __attribute__((optimize("unroll-loops")))
@@ -201,17 +254,9 @@ void blake2s_final(struct blake2s_state *state, u8 *out, u8 outlen)
 	BUG_ON(!out || !outlen || outlen > BLAKE2S_OUTBYTES);
 #endif
 
-	if (state->buflen > BLAKE2S_BLOCKBYTES) {
-		blake2s_increment_counter(state, BLAKE2S_BLOCKBYTES);
-		blake2s_compress(state, state->buf);
-		state->buflen -= BLAKE2S_BLOCKBYTES;
-		memcpy(state->buf, state->buf + BLAKE2S_BLOCKBYTES, state->buflen);
-	}
-
-	blake2s_increment_counter(state, (u32) state->buflen);
 	blake2s_set_lastblock(state);
-	memset(state->buf + state->buflen, 0, 2 * BLAKE2S_BLOCKBYTES - state->buflen); /* Padding */
-	blake2s_compress(state, state->buf);
+	memset(state->buf + state->buflen, 0, BLAKE2S_BLOCKBYTES - state->buflen); /* Padding */
+	blake2s_compress(state, state->buf, 1, state->buflen);
 
 	for (i = 0; i < 8; ++i) /* output full hash to temp buffer */
 		*(__le32 *)(buffer + sizeof(state->h[i]) * i) = cpu_to_le32(state->h[i]);
@@ -240,6 +285,102 @@ void blake2s(u8 *out, const u8 *in, const u8 *key, const u8 outlen, u64 inlen, c
 	blake2s_final(&state, out, outlen);
 }
 
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+/* Copies the block at offset of the concatenation of prefix and in, zero padded. */
+static void blake2s_gather_block(u8 block[BLAKE2S_BLOCKBYTES], const u8 *prefix, size_t prefix_len, const u8 *in, size_t inlen, size_t offset)
+{
+	size_t n = 0;
+
+	memset(block, 0, BLAKE2S_BLOCKBYTES);
+	if (offset < prefix_len) {
+		n = min_t(size_t, prefix_len - offset, BLAKE2S_BLOCKBYTES);
+		memcpy(block, prefix + offset, n);
+	}
+	if (n < BLAKE2S_BLOCKBYTES && offset + n < prefix_len + inlen)
+		memcpy(block + n, in + offset + n - prefix_len, min_t(size_t, BLAKE2S_BLOCKBYTES - n, prefix_len + inlen - offset - n));
+}
+
+/* Finishes eight hashes in the lanes of blake2s_compress_8way_avx2(). Since all of them have
+ * the same length, the counter and the last block flag are the same for each. Whatever is in
+ * the buffer of state is the start of each message. Must be called with the FPU held. */
+static void blake2s_batch_avx2(u8 *out[8], const struct blake2s_state *state, const u8 *in[8], size_t inlen, u8 outlen)
+{
+	u32 h[8][8], m[16][8], tf[4];
+	u8 block[BLAKE2S_BLOCKBYTES];
+	const size_t total = state->buflen + inlen;
+	size_t offset, len, lane, i;
+
+	for (i = 0; i < 8; ++i) {
+		for (lane = 0; lane < 8; ++lane)
+			h[i][lane] = state->h[i];
+	}
+	tf[0] = state->t[0];
+	tf[1] = state->t[1];
+	tf[2] = state->f[0];
+	tf[3] = state->f[1];
+
+	for (offset = 0; offset < total; offset += BLAKE2S_BLOCKBYTES) {
+		len = min_t(size_t, total - offset, BLAKE2S_BLOCKBYTES);
+		for (lane = 0; lane < 8; ++lane) {
+			blake2s_gather_block(block, state->buf, state->buflen, in[lane], inlen, offset);
+			for (i = 0; i < 16; ++i)
+				m[i][lane] = le32_to_cpuvp(block + i * sizeof(u32));
+		}
+		tf[0] += len;
+		tf[1] += tf[0] < len;
+		if (offset + len == total) {
+			tf[2] = -1;
+			if (state->last_node)
+				tf[3] = -1;
+		}
+		blake2s_compress_8way_avx2(h, m, tf);
+	}
+
+	for (lane = 0; lane < 8; ++lane) {
+		for (i = 0; i < 8; ++i)
+			*(__le32 *)(block + sizeof(u32) * i) = cpu_to_le32(h[i][lane]);
+		memcpy(out[lane], block, outlen);
+	}
+
+	memzero_explicit(h, sizeof(h));
+	memzero_explicit(m, sizeof(m));
+	memzero_explicit(block, sizeof(block));
+}
+#endif
+
+void blake2s_batch(u8 *out[], const struct blake2s_state *state, const u8 *in[], u64 inlen, u8 outlen, size_t num)
+{
+	struct blake2s_state copy;
+	size_t i = 0;
+
+#ifdef DEBUG
+	BUG_ON(!outlen || outlen > BLAKE2S_OUTBYTES);
+#endif
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+	if (blake2s_use_avx2 && num >= 8 && inlen) {
+		/* A full buffer is common to every message and followed by more, so it
+		 * can be compressed once up front rather than in every lane. */
+		copy = *state;
+		if (copy.buflen == BLAKE2S_BLOCKBYTES) {
+			blake2s_compress(&copy, copy.buf, 1, BLAKE2S_BLOCKBYTES);
+			copy.buflen = 0;
+		}
+		for (; i + 8 <= num && irq_fpu_usable(); i += 8) {
+			kernel_fpu_begin();
+			blake2s_batch_avx2(out + i, &copy, in + i, inlen, outlen);
+			kernel_fpu_end();
+		}
+	}
+#endif
+	for (; i < num; ++i) {
+		copy = *state;
+		blake2s_update(&copy, in[i], inlen);
+		blake2s_final(&copy, out[i], outlen);
+	}
+	memzero_explicit(&copy, sizeof(copy));
+}
+
 __attribute__((optimize("unroll-loops")))
 void blake2s_hmac(u8 *out, const u8 *in, const u8 *key, const u8 outlen, const u64 inlen, const u64 keylen)
 {
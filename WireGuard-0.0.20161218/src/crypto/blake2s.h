@@ -15,11 +15,13 @@ struct blake2s_state {
 	u32 h[8];
 	u32 t[2];
 	u32 f[2];
-	u8 buf[2 * BLAKE2S_BLOCKBYTES];
+	u8 buf[BLAKE2S_BLOCKBYTES];
 	size_t buflen;
 	u8 last_node;
 };
 
+void blake2s_fpu_init(void);
+
 void blake2s(u8 *out, const u8 *in, const u8 *key, const u8 outlen, const u64 inlen, const u8 keylen);
 
 void blake2s_init(struct blake2s_state *state, const u8 outlen);
@@ -27,6 +29,10 @@ void blake2s_init_key(struct blake2s_state *state, const u8 outlen, const void *
 void blake2s_update(struct blake2s_state *state, const u8 *in, u64 inlen);
 void blake2s_final(struct blake2s_state *state, u8 *out, u8 outlen);
 
+/* Computes out[i] as if by blake2s_update() of in[i] to a copy of state, followed by blake2s_final(),
+ * for num messages that all have the same length, several at a time where the CPU allows it. */
+void blake2s_batch(u8 *out[], const struct blake2s_state *state, const u8 *in[], u64 inlen, u8 outlen, size_t num);
+
 void blake2s_hmac(u8 *out, const u8 *in, const u8 *key, const u8 outlen, const u64 inlen, const u64 keylen);
 
 #ifdef DEBUG
@@ -6,7 +6,9 @@
 #include "chacha20poly1305.h"
 
 #include <linux/kernel.h>
+#include <linux/module.h>
 #include <linux/string.h>
+#include <linux/percpu.h>
 #include <linux/version.h>
 #include <crypto/algapi.h>
 #include <crypto/scatterwalk.h>
@@ -18,23 +20,46 @@
 #ifdef CONFIG_AS_SSSE3
 asmlinkage void chacha20_asm_block_xor_ssse3(u32 *state, u8 *dst, const u8 *src);
 asmlinkage void chacha20_asm_4block_xor_ssse3(u32 *state, u8 *dst, const u8 *src);
+asmlinkage void chacha20poly1305_asm_4block_seal_ssse3(u32 *state, u8 *dst, const u8 *src, unsigned int chunks, u64 *poly1305);
+asmlinkage void chacha20poly1305_asm_4block_open_ssse3(u32 *state, u8 *dst, const u8 *src, unsigned int chunks, u64 *poly1305);
 #endif
 #ifdef CONFIG_AS_AVX2
 asmlinkage void chacha20_asm_8block_xor_avx2(u32 *state, u8 *dst, const u8 *src);
+asmlinkage void chacha20poly1305_asm_8block_seal_avx2(u32 *state, u8 *dst, const u8 *src, unsigned int chunks, u64 *poly1305);
+asmlinkage void chacha20poly1305_asm_8block_open_avx2(u32 *state, u8 *dst, const u8 *src, unsigned int chunks, u64 *poly1305);
+asmlinkage void chacha20_asm_8block_xor_multi_avx2(u32 *state, u8 *dst, const u8 *src, const u32 *lanes);
+#endif
+#ifdef CONFIG_AS_AVX512
+asmlinkage void chacha20_asm_16block_xor_avx512(u32 *state, u8 *dst, const u8 *src);
+asmlinkage void poly1305_asm_8block_avx512(u32 *h, const u8 *src, const u32 *r, unsigned int blocks, const u32 *u);
 #endif
 asmlinkage void poly1305_asm_block_sse2(u32 *h, const u8 *src, const u32 *r, unsigned int blocks);
 asmlinkage void poly1305_asm_2block_sse2(u32 *h, const u8 *src, const u32 *r, unsigned int blocks, const u32 *u);
 #ifdef CONFIG_AS_AVX2
 asmlinkage void poly1305_asm_4block_avx2(u32 *h, const u8 *src, const u32 *r, unsigned int blocks, const u32 *u);
+asmlinkage void poly1305_asm_4lane_avx2(u64 *h, const u8 *const *src, const u64 *r, unsigned int blocks);
 #endif
+static bool chacha20poly1305_use_avx512 = false;
 static bool chacha20poly1305_use_avx2 = false;
 static bool chacha20poly1305_use_ssse3 = false;
 static bool chacha20poly1305_use_sse2 = false;
+
+/* Skylake-SP drops to its lowest frequency license as soon as any core touches the full width of
+ * the zmm registers, which slows down everything else running on the package by more than the
+ * AVX-512 functions gain us, so by default we stick to AVX2 there. Later microarchitectures
+ * throttle far less. A box that does little besides moving packets might still come out ahead,
+ * which the self-test benchmark in a debug build will tell. */
+static bool avx512_on_skylake_sp = false;
+module_param(avx512_on_skylake_sp, bool, 0444);
+MODULE_PARM_DESC(avx512_on_skylake_sp, "Use the AVX-512 ChaCha20 and Poly1305 on Skylake-SP too, despite the package-wide clock penalty (default: no)");
+
 void chacha20poly1305_init(void)
 {
 	chacha20poly1305_use_sse2 = boot_cpu_has(X86_FEATURE_XMM2);
 	chacha20poly1305_use_ssse3 = boot_cpu_has(X86_FEATURE_SSSE3);
 	chacha20poly1305_use_avx2 = boot_cpu_has(X86_FEATURE_AVX) && boot_cpu_has(X86_FEATURE_AVX2);
+	chacha20poly1305_use_avx512 = chacha20poly1305_use_avx2 && boot_cpu_has(X86_FEATURE_AVX512F) &&
+		(avx512_on_skylake_sp || !(boot_cpu_data.x86_vendor == X86_VENDOR_INTEL && boot_cpu_data.x86 == 6 && boot_cpu_data.x86_model == 0x55));
 }
 #else
 void chacha20poly1305_init(void) { }
@@ -166,6 +191,17 @@ static void chacha20_crypt(struct chacha20_ctx *ctx, u8 *dst, const u8 *src, uns
 		goto no_simd;
 
 #ifdef CONFIG_X86_64
+#ifdef CONFIG_AS_AVX512
+	if (chacha20poly1305_use_avx512) {
+		while (bytes >= CHACHA20_BLOCK_SIZE * 16) {
+			chacha20_asm_16block_xor_avx512(ctx->state, dst, src);
+			bytes -= CHACHA20_BLOCK_SIZE * 16;
+			src += CHACHA20_BLOCK_SIZE * 16;
+			dst += CHACHA20_BLOCK_SIZE * 16;
+			ctx->state[12] += 16;
+		}
+	}
+#endif
 #ifdef CONFIG_AS_AVX2
 	if (chacha20poly1305_use_avx2) {
 		while (bytes >= CHACHA20_BLOCK_SIZE * 8) {
@@ -232,12 +268,16 @@ struct poly1305_ctx {
 	bool uset;
 	/* derived keys r^3, r^4 set? */
 	bool wset;
+	/* derived keys r^5 .. r^8 set? */
+	bool zset;
 	/* derived Poly1305 key r^2 */
 	u32 u[5];
 	/* derived Poly1305 key r^3 */
 	u32 r3[5];
 	/* derived Poly1305 key r^4 */
 	u32 r4[5];
+	/* derived Poly1305 keys r^5 .. r^8, which must directly follow r^2 .. r^4 */
+	u32 r5[5], r6[5], r7[5], r8[5];
 };
 
 static void poly1305_init(struct poly1305_ctx *ctx, const u8 key[POLY1305_KEY_SIZE])
@@ -331,6 +371,38 @@ static unsigned int poly1305_simd_blocks(struct poly1305_ctx *ctx, const u8 *src
 {
 	unsigned int blocks;
 
+#ifdef CONFIG_AS_AVX512
+	/* Working out r^5 .. r^8 costs about as much as eight lanes save on anything shorter. */
+	if (chacha20poly1305_use_avx512 && srclen >= POLY1305_BLOCK_SIZE * 64) {
+		if (unlikely(!ctx->zset)) {
+			if (!ctx->wset) {
+				if (!ctx->uset) {
+					memcpy(ctx->u, ctx->r, sizeof(ctx->u));
+					poly1305_simd_mult(ctx->u, ctx->r);
+					ctx->uset = true;
+				}
+				memcpy(ctx->r3, ctx->u, sizeof(ctx->u));
+				poly1305_simd_mult(ctx->r3, ctx->r);
+				memcpy(ctx->r4, ctx->r3, sizeof(ctx->u));
+				poly1305_simd_mult(ctx->r4, ctx->r);
+				ctx->wset = true;
+			}
+			memcpy(ctx->r5, ctx->r4, sizeof(ctx->u));
+			poly1305_simd_mult(ctx->r5, ctx->r);
+			memcpy(ctx->r6, ctx->r5, sizeof(ctx->u));
+			poly1305_simd_mult(ctx->r6, ctx->r);
+			memcpy(ctx->r7, ctx->r6, sizeof(ctx->u));
+			poly1305_simd_mult(ctx->r7, ctx->r);
+			memcpy(ctx->r8, ctx->r7, sizeof(ctx->u));
+			poly1305_simd_mult(ctx->r8, ctx->r);
+			ctx->zset = true;
+		}
+		blocks = srclen / (POLY1305_BLOCK_SIZE * 8);
+		poly1305_asm_8block_avx512(ctx->h, src, ctx->r, blocks, ctx->u);
+		src += POLY1305_BLOCK_SIZE * 8 * blocks;
+		srclen -= POLY1305_BLOCK_SIZE * 8 * blocks;
+	}
+#endif
 #ifdef CONFIG_AS_AVX2
 	if (chacha20poly1305_use_avx2 && srclen >= POLY1305_BLOCK_SIZE * 4) {
 		if (unlikely(!ctx->wset)) {
@@ -472,6 +544,78 @@ static void poly1305_finish(struct poly1305_ctx *ctx, u8 *dst)
 	f = (f >> 32) + h3 + ctx->s[3]; mac[3] = cpu_to_le32(f);
 }
 
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_SSSE3)
+/* Encrypts or decrypts as many whole four-block chunks of src as there are, authenticating the
+ * ciphertext in the same pass, and returns how many bytes that was. The stitched functions keep
+ * Poly1305 in base 2^64, so the accumulator is converted there and back around them.
+ *
+ * They beat running ChaCha20 and Poly1305 one after the other at every length with SSSE3 and with
+ * AVX2, by a quarter at 4096 bytes, but lose to the 16-block AVX-512 ChaCha20 followed by the
+ * eight-lane AVX-512 Poly1305, so from where those kick in they are left to do their thing. */
+static size_t chacha20poly1305_stitched(struct chacha20_ctx *chacha20, struct poly1305_ctx *poly1305, u8 *dst, const u8 *src, size_t len, bool seal, bool have_simd)
+{
+	unsigned int chunks = len / (CHACHA20_BLOCK_SIZE * 4), done = 0;
+	unsigned __int128 h;
+	u64 state[6];
+	u32 h0, h1, h2, h3, h4;
+
+	if (!have_simd || !chacha20poly1305_use_ssse3 || !chunks || poly1305->buflen)
+		return 0;
+#ifdef CONFIG_AS_AVX512
+	if (chacha20poly1305_use_avx512 && len >= CHACHA20_BLOCK_SIZE * 16)
+		return 0;
+#endif
+
+	h0 = poly1305->h[0];
+	h1 = poly1305->h[1];
+	h2 = poly1305->h[2];
+	h3 = poly1305->h[3];
+	h4 = poly1305->h[4];
+	h2 += (h1 >> 26);     h1 = h1 & 0x3ffffff;
+	h3 += (h2 >> 26);     h2 = h2 & 0x3ffffff;
+	h4 += (h3 >> 26);     h3 = h3 & 0x3ffffff;
+	h0 += (h4 >> 26) * 5; h4 = h4 & 0x3ffffff;
+	h1 += (h0 >> 26);     h0 = h0 & 0x3ffffff;
+	h = h0 + ((unsigned __int128)h1 << 26) + ((unsigned __int128)h2 << 52) + ((unsigned __int128)h3 << 78) + ((unsigned __int128)(h4 & 0xffffff) << 104);
+	state[0] = h;
+	state[1] = h >> 64;
+	state[2] = h4 >> 24;
+	state[3] = poly1305->r[0] | ((u64)poly1305->r[1] << 26) | ((u64)poly1305->r[2] << 52);
+	state[4] = (poly1305->r[2] >> 12) | ((u64)poly1305->r[3] << 14) | ((u64)poly1305->r[4] << 40);
+	state[5] = state[4] + (state[4] >> 2);
+
+#ifdef CONFIG_AS_AVX2
+	if (chacha20poly1305_use_avx2 && chunks >= 2) {
+		if (seal)
+			chacha20poly1305_asm_8block_seal_avx2(chacha20->state, dst, src, chunks / 2, state);
+		else
+			chacha20poly1305_asm_8block_open_avx2(chacha20->state, dst, src, chunks / 2, state);
+		done = chunks & ~1U;
+	}
+#endif
+	if (chunks > done) {
+		if (seal)
+			chacha20poly1305_asm_4block_seal_ssse3(chacha20->state, dst + done * CHACHA20_BLOCK_SIZE * 4, src + done * CHACHA20_BLOCK_SIZE * 4, chunks - done, state);
+		else
+			chacha20poly1305_asm_4block_open_ssse3(chacha20->state, dst + done * CHACHA20_BLOCK_SIZE * 4, src + done * CHACHA20_BLOCK_SIZE * 4, chunks - done, state);
+	}
+
+	poly1305->h[0] = state[0] & 0x3ffffff;
+	poly1305->h[1] = (state[0] >> 26) & 0x3ffffff;
+	poly1305->h[2] = ((state[0] >> 52) | (state[1] << 12)) & 0x3ffffff;
+	poly1305->h[3] = (state[1] >> 14) & 0x3ffffff;
+	poly1305->h[4] = (state[1] >> 40) | (state[2] << 24);
+	memzero_explicit(state, sizeof(state));
+	memzero_explicit(&h, sizeof(h));
+	return chunks * CHACHA20_BLOCK_SIZE * 4;
+}
+#else
+static inline size_t chacha20poly1305_stitched(struct chacha20_ctx *chacha20, struct poly1305_ctx *poly1305, u8 *dst, const u8 *src, size_t len, bool seal, bool have_simd)
+{
+	return 0;
+}
+#endif
+
 static const u8 pad0[16] = { 0 };
 
 static struct crypto_alg chacha20_alg = {
@@ -487,16 +631,17 @@ static struct blkcipher_desc chacha20_desc = {
 	.tfm = &chacha20_cipher
 };
 
-bool chacha20poly1305_encrypt(u8 *dst, const u8 *src, const size_t src_len,
-			      const u8 *ad, const size_t ad_len,
-			      const u64 nonce, const u8 key[CHACHA20POLY1305_KEYLEN])
+static void __chacha20poly1305_encrypt(u8 *dst, const u8 *src, const size_t src_len,
+				       const u8 *ad, const size_t ad_len,
+				       const u64 nonce, const u8 key[CHACHA20POLY1305_KEYLEN],
+				       bool have_simd)
 {
 	struct poly1305_ctx poly1305_state;
 	struct chacha20_ctx chacha20_state;
 	u8 block0[CHACHA20_BLOCK_SIZE] = { 0 };
+	size_t stitched;
 	__le64 len;
 	__le64 le_nonce = cpu_to_le64(nonce);
-	bool have_simd = chacha20poly1305_init_simd();
 
 	chacha20_keysetup(&chacha20_state, key, (u8 *)&le_nonce);
 
@@ -507,9 +652,10 @@ bool chacha20poly1305_encrypt(u8 *dst, const u8 *src, const size_t src_len,
 	poly1305_update(&poly1305_state, ad, ad_len, have_simd);
 	poly1305_update(&poly1305_state, pad0, (0x10 - ad_len) & 0xf, have_simd);
 
-	chacha20_crypt(&chacha20_state, dst, src, src_len, have_simd);
+	stitched = chacha20poly1305_stitched(&chacha20_state, &poly1305_state, dst, src, src_len, true, have_simd);
+	chacha20_crypt(&chacha20_state, dst + stitched, src + stitched, src_len - stitched, have_simd);
 
-	poly1305_update(&poly1305_state, dst, src_len, have_simd);
+	poly1305_update(&poly1305_state, dst + stitched, src_len - stitched, have_simd);
 	poly1305_update(&poly1305_state, pad0, (0x10 - src_len) & 0xf, have_simd);
 
 	len = cpu_to_le64(ad_len);
@@ -522,12 +668,157 @@ bool chacha20poly1305_encrypt(u8 *dst, const u8 *src, const size_t src_len,
 
 	memzero_explicit(&poly1305_state, sizeof(poly1305_state));
 	memzero_explicit(&chacha20_state, sizeof(chacha20_state));
+}
 
+bool chacha20poly1305_encrypt(u8 *dst, const u8 *src, const size_t src_len,
+			      const u8 *ad, const size_t ad_len,
+			      const u64 nonce, const u8 key[CHACHA20POLY1305_KEYLEN])
+{
+	bool have_simd = chacha20poly1305_init_simd();
+	__chacha20poly1305_encrypt(dst, src, src_len, ad, ad_len, nonce, key, have_simd);
 	chacha20poly1305_deinit_simd(have_simd);
-
 	return true;
 }
 
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+struct chacha20poly1305_batch_state {
+	u8 poly1305_keys[CHACHA20POLY1305_MAX_BATCH][POLY1305_KEY_SIZE];
+	u8 stream[CHACHA20_BLOCK_SIZE * 8];
+	u32 lanes[4][8];
+	unsigned int lane_entry[8], lane_block[8];
+	struct poly1305_ctx poly1305[4];
+	u64 poly1305_h[5][4], poly1305_r[5][4];
+	const u8 *poly1305_src[4];
+};
+
+/* This is too big for the stack, but it is only used with the FPU held, and so with preemption off. */
+static DEFINE_PER_CPU(struct chacha20poly1305_batch_state, chacha20poly1305_batch_state);
+
+/* Short messages are too short to be worth working out r^2 .. r^4 for, which the single message
+ * functions need to fill their lanes, so we instead give each of up to four entries a lane of its
+ * own, with its own key, for as many whole blocks as all of them have, and finish them one by one. */
+static void chacha20poly1305_batch_poly1305(struct chacha20poly1305_batch_state *s, struct chacha20poly1305_batch_entry *entries,
+					    unsigned int count, u8 keys[][POLY1305_KEY_SIZE])
+{
+	struct poly1305_ctx *ctx = s->poly1305;
+	unsigned int blocks = UINT_MAX, i, l;
+	__le64 len;
+
+	for (l = 0; l < count; ++l) {
+		poly1305_init(&ctx[l], keys[l]);
+		poly1305_update(&ctx[l], entries[l].ad, entries[l].ad_len, true);
+		poly1305_update(&ctx[l], pad0, (0x10 - entries[l].ad_len) & 0xf, true);
+		blocks = min_t(unsigned int, blocks, entries[l].src_len / POLY1305_BLOCK_SIZE);
+	}
+
+	if (count > 1 && blocks) {
+		/* Lanes without an entry just hash the first one again, and get thrown away. */
+		for (l = 0; l < 4; ++l) {
+			s->poly1305_src[l] = entries[l < count ? l : 0].dst;
+			for (i = 0; i < 5; ++i) {
+				s->poly1305_h[i][l] = ctx[l < count ? l : 0].h[i];
+				s->poly1305_r[i][l] = ctx[l < count ? l : 0].r[i];
+			}
+		}
+		poly1305_asm_4lane_avx2(&s->poly1305_h[0][0], s->poly1305_src, &s->poly1305_r[0][0], blocks);
+		for (l = 0; l < count; ++l) {
+			for (i = 0; i < 5; ++i)
+				ctx[l].h[i] = s->poly1305_h[i][l];
+		}
+	} else
+		blocks = 0;
+
+	for (l = 0; l < count; ++l) {
+		poly1305_update(&ctx[l], entries[l].dst + blocks * POLY1305_BLOCK_SIZE, entries[l].src_len - blocks * POLY1305_BLOCK_SIZE, true);
+		poly1305_update(&ctx[l], pad0, (0x10 - entries[l].src_len) & 0xf, true);
+		len = cpu_to_le64(entries[l].ad_len);
+		poly1305_update(&ctx[l], (u8 *)&len, sizeof(len), true);
+		len = cpu_to_le64(entries[l].src_len);
+		poly1305_update(&ctx[l], (u8 *)&len, sizeof(len), true);
+		poly1305_finish(&ctx[l], entries[l].dst + entries[l].src_len);
+	}
+}
+
+/* All entries share a key, so only words 12 to 15 of the ChaCha20 state -- the block
+ * counter and the nonce -- differ from one block to the next. We therefore hand out
+ * (entry, block) pairs in order to the eight lanes of the multi-block AVX2 function,
+ * so that several short packets fill the lanes that a single one would leave idle.
+ * Block 0 of each entry becomes its Poly1305 key; the rest are XORed into the data.
+ * Poly1305 is then computed four entries at a time, over ciphertext that is still hot in cache. */
+static void chacha20poly1305_encrypt_batch_avx2(struct chacha20poly1305_batch_entry *entries, unsigned int count,
+						const u8 key[CHACHA20POLY1305_KEYLEN])
+{
+	struct chacha20poly1305_batch_state *s = this_cpu_ptr(&chacha20poly1305_batch_state);
+	struct chacha20_ctx chacha20_state;
+	unsigned int i = 0, block = 0, lanes_used, l;
+	__le64 le_nonce = 0;
+
+	chacha20_keysetup(&chacha20_state, key, (u8 *)&le_nonce);
+
+	for (;;) {
+		for (lanes_used = 0; lanes_used < 8 && i < count; ++lanes_used) {
+			le_nonce = cpu_to_le64(entries[i].nonce);
+			s->lanes[0][lanes_used] = block;
+			s->lanes[1][lanes_used] = 0;
+			s->lanes[2][lanes_used] = le32_to_cpuvp((u8 *)&le_nonce + 0);
+			s->lanes[3][lanes_used] = le32_to_cpuvp((u8 *)&le_nonce + 4);
+			s->lane_entry[lanes_used] = i;
+			s->lane_block[lanes_used] = block;
+			if (++block > DIV_ROUND_UP(entries[i].src_len, CHACHA20_BLOCK_SIZE)) {
+				block = 0;
+				++i;
+			}
+		}
+		if (!lanes_used)
+			break;
+
+		memset(s->stream, 0, sizeof(s->stream));
+		chacha20_asm_8block_xor_multi_avx2(chacha20_state.state, s->stream, s->stream, &s->lanes[0][0]);
+
+		for (l = 0; l < lanes_used; ++l) {
+			struct chacha20poly1305_batch_entry *entry = &entries[s->lane_entry[l]];
+			size_t offset, bytes;
+
+			if (!s->lane_block[l]) {
+				memcpy(s->poly1305_keys[s->lane_entry[l]], s->stream + l * CHACHA20_BLOCK_SIZE, POLY1305_KEY_SIZE);
+				continue;
+			}
+			offset = (s->lane_block[l] - 1) * CHACHA20_BLOCK_SIZE;
+			bytes = min_t(size_t, CHACHA20_BLOCK_SIZE, entry->src_len - offset);
+			if (entry->dst != entry->src)
+				memcpy(entry->dst + offset, entry->src + offset, bytes);
+			crypto_xor(entry->dst + offset, s->stream + l * CHACHA20_BLOCK_SIZE, bytes);
+		}
+	}
+
+	for (i = 0; i < count; i += 4)
+		chacha20poly1305_batch_poly1305(s, entries + i, min_t(unsigned int, count - i, 4), s->poly1305_keys + i);
+
+	memzero_explicit(&chacha20_state, sizeof(chacha20_state));
+	memzero_explicit(s->poly1305_keys, sizeof(s->poly1305_keys));
+	memzero_explicit(s->stream, sizeof(s->stream));
+	memzero_explicit(s->poly1305, sizeof(s->poly1305));
+	memzero_explicit(s->poly1305_h, sizeof(s->poly1305_h));
+	memzero_explicit(s->poly1305_r, sizeof(s->poly1305_r));
+}
+#endif
+
+void chacha20poly1305_encrypt_batch(struct chacha20poly1305_batch_entry *entries, unsigned int count,
+				    const u8 key[CHACHA20POLY1305_KEYLEN], bool have_simd)
+{
+	unsigned int i;
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+	if (have_simd && chacha20poly1305_use_avx2) {
+		for (i = 0; i < count; i += CHACHA20POLY1305_MAX_BATCH)
+			chacha20poly1305_encrypt_batch_avx2(entries + i, min_t(unsigned int, count - i, CHACHA20POLY1305_MAX_BATCH), key);
+		return;
+	}
+#endif
+	for (i = 0; i < count; ++i)
+		__chacha20poly1305_encrypt(entries[i].dst, entries[i].src, entries[i].src_len, entries[i].ad, entries[i].ad_len, entries[i].nonce, key, have_simd);
+}
+
 bool chacha20poly1305_encrypt_sg(struct scatterlist *dst, struct scatterlist *src, const size_t src_len,
 				 const u8 *ad, const size_t ad_len,
 				 const u64 nonce, const u8 key[CHACHA20POLY1305_KEYLEN],
@@ -555,8 +846,9 @@ bool chacha20poly1305_encrypt_sg(struct scatterlist *dst, struct scatterlist *sr
 		blkcipher_walk_virt_block(&chacha20_desc, &walk, CHACHA20_BLOCK_SIZE);
 		while (walk.nbytes >= CHACHA20_BLOCK_SIZE) {
 			size_t chunk_len = rounddown(walk.nbytes, CHACHA20_BLOCK_SIZE);
-			chacha20_crypt(&chacha20_state, walk.dst.virt.addr, walk.src.virt.addr, chunk_len, have_simd);
-			poly1305_update(&poly1305_state, walk.dst.virt.addr, chunk_len, have_simd);
+			size_t stitched = chacha20poly1305_stitched(&chacha20_state, &poly1305_state, walk.dst.virt.addr, walk.src.virt.addr, chunk_len, true, have_simd);
+			chacha20_crypt(&chacha20_state, walk.dst.virt.addr + stitched, walk.src.virt.addr + stitched, chunk_len - stitched, have_simd);
+			poly1305_update(&poly1305_state, walk.dst.virt.addr + stitched, chunk_len - stitched, have_simd);
 			blkcipher_walk_done(&chacha20_desc, &walk, walk.nbytes % CHACHA20_BLOCK_SIZE);
 		}
 		if (walk.nbytes) {
@@ -669,8 +961,9 @@ bool chacha20poly1305_decrypt_sg(struct scatterlist *dst, struct scatterlist *sr
 		blkcipher_walk_virt_block(&chacha20_desc, &walk, CHACHA20_BLOCK_SIZE);
 		while (walk.nbytes >= CHACHA20_BLOCK_SIZE) {
 			size_t chunk_len = rounddown(walk.nbytes, CHACHA20_BLOCK_SIZE);
-			poly1305_update(&poly1305_state, walk.src.virt.addr, chunk_len, have_simd);
-			chacha20_crypt(&chacha20_state, walk.dst.virt.addr, walk.src.virt.addr, chunk_len, have_simd);
+			size_t stitched = chacha20poly1305_stitched(&chacha20_state, &poly1305_state, walk.dst.virt.addr, walk.src.virt.addr, chunk_len, false, have_simd);
+			poly1305_update(&poly1305_state, walk.src.virt.addr + stitched, chunk_len - stitched, have_simd);
+			chacha20_crypt(&chacha20_state, walk.dst.virt.addr + stitched, walk.src.virt.addr + stitched, chunk_len - stitched, have_simd);
 			blkcipher_walk_done(&chacha20_desc, &walk, walk.nbytes % CHACHA20_BLOCK_SIZE);
 		}
 		if (walk.nbytes) {
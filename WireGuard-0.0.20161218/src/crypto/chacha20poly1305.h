@@ -9,7 +9,19 @@ struct scatterlist;
 
 enum chacha20poly1305_lengths {
 	CHACHA20POLY1305_KEYLEN = 32,
-	CHACHA20POLY1305_AUTHTAGLEN = 16
+	CHACHA20POLY1305_AUTHTAGLEN = 16,
+	CHACHA20POLY1305_MAX_BATCH = 16,
+	CHACHA20POLY1305_MAX_BATCH_LEN = 512
+};
+
+/* The authentication tag is written to dst + src_len, so dst needs room for it. */
+struct chacha20poly1305_batch_entry {
+	u8 *dst;
+	const u8 *src;
+	size_t src_len;
+	const u8 *ad;
+	size_t ad_len;
+	u64 nonce;
 };
 
 void chacha20poly1305_init(void);
@@ -23,6 +35,9 @@ bool chacha20poly1305_encrypt_sg(struct scatterlist *dst, struct scatterlist *sr
 				 const u64 nonce, const u8 key[CHACHA20POLY1305_KEYLEN],
 				 bool have_simd);
 
+void chacha20poly1305_encrypt_batch(struct chacha20poly1305_batch_entry *entries, unsigned int count,
+				    const u8 key[CHACHA20POLY1305_KEYLEN], bool have_simd);
+
 bool chacha20poly1305_decrypt(u8 *dst, const u8 *src, const size_t src_len,
 			      const u8 *ad, const size_t ad_len,
 			      const u64 nonce, const u8 key[CHACHA20POLY1305_KEYLEN]);
@@ -399,7 +399,7 @@ static void crecip(felem out, const felem z)
 	/* 2^255 - 21 */ fmul(out, t0, a);
 }
 
-void curve25519(u8 mypublic[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_POINT_SIZE], const u8 basepoint[CURVE25519_POINT_SIZE])
+static void curve25519_generic(u8 mypublic[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_POINT_SIZE], const u8 basepoint[CURVE25519_POINT_SIZE])
 {
 	limb bp[5], x[5], z[5], zmone[5];
 	u8 e[32];
@@ -1210,7 +1210,7 @@ static void cmult(limb *resultx, limb *resultz, const u8 *n, const limb *q)
 	memcpy(resultz, nqz, sizeof(limb) * 10);
 }
 
-void curve25519(u8 mypublic[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_POINT_SIZE], const u8 basepoint[CURVE25519_POINT_SIZE])
+static void curve25519_generic(u8 mypublic[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_POINT_SIZE], const u8 basepoint[CURVE25519_POINT_SIZE])
 {
 	limb bp[10], x[10], z[11], zmone[10];
 	u8 e[32];
@@ -1374,7 +1374,7 @@ static void cmult(struct other_stack *s, limb *resultx, limb *resultz, const u8
 	memcpy(resultz, nqz, sizeof(limb) * 10);
 }
 
-void curve25519(u8 mypublic[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_POINT_SIZE], const u8 basepoint[CURVE25519_POINT_SIZE])
+static void curve25519_generic(u8 mypublic[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_POINT_SIZE], const u8 basepoint[CURVE25519_POINT_SIZE])
 {
 	struct other_stack *s = kzalloc(sizeof(struct other_stack), GFP_KERNEL);
 	if (unlikely(!s)) {
@@ -1396,6 +1396,287 @@ void curve25519(u8 mypublic[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_P
 #endif
 #endif
 
+#ifdef CONFIG_X86_64
+#include <linux/version.h>
+#include <linux/percpu.h>
+#include <asm/cpufeature.h>
+#include <asm/processor.h>
+#include <asm/unaligned.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+#include <asm/fpu/api.h>
+#include <asm/simd.h>
+#else
+#include <asm/i387.h>
+#endif
+#endif
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_ADX)
+typedef u64 fe64[4];
+
+/* The layout of this must match the offsets at the top of curve25519-x86_64.S. */
+struct ladder_state {
+	fe64 x1, x2, z2, x3, z3;
+	fe64 a, b, c, d, aa, bb, e;
+};
+
+asmlinkage void curve25519_ladder_step_bmi2_adx(struct ladder_state *state);
+asmlinkage void curve25519_fmul_bmi2_adx(fe64 out, const fe64 a, const fe64 b);
+asmlinkage void curve25519_fsqr_times_bmi2_adx(fe64 out, const fe64 a, u64 count);
+
+static bool curve25519_use_bmi2_adx = false;
+
+static __always_inline void fe64_cswap(fe64 a, fe64 b, u64 swap)
+{
+	u64 mask = 0 - swap, x;
+	int i;
+
+	for (i = 0; i < 4; ++i) {
+		x = mask & (a[i] ^ b[i]);
+		a[i] ^= x;
+		b[i] ^= x;
+	}
+}
+
+/* The field elements coming out of the assembly are only reduced modulo 2^256 - 38, so here we
+ * fold in the top bit twice, after which the value is below 2^255, and then subtract p if needed. */
+static void fe64_contract(u8 out[CURVE25519_POINT_SIZE], const fe64 in)
+{
+	u64 t[4], u[4], top, mask;
+	unsigned __int128 c;
+	int i, j;
+
+	memcpy(t, in, sizeof(t));
+	for (j = 0; j < 2; ++j) {
+		top = t[3] >> 63;
+		t[3] &= ~(1ULL << 63);
+		c = (unsigned __int128)top * 19;
+		for (i = 0; i < 4; ++i) {
+			c += t[i];
+			t[i] = (u64)c;
+			c >>= 64;
+		}
+	}
+	c = 19;
+	for (i = 0; i < 4; ++i) {
+		c += t[i];
+		u[i] = (u64)c;
+		c >>= 64;
+	}
+	mask = 0 - (u[3] >> 63);
+	u[3] &= ~(1ULL << 63);
+	for (i = 0; i < 4; ++i)
+		put_unaligned_le64((t[i] & ~mask) | (u[i] & mask), out + i * sizeof(u64));
+
+	memzero_explicit(t, sizeof(t));
+	memzero_explicit(u, sizeof(u));
+}
+
+/* This is the ladder from RFC7748, section 5. Each step is done by curve25519-x86_64.S, which keeps
+ * two carry chains going at once with mulx, adcx, and adox, and the inversion at the end uses the
+ * same addition chain as crecip(). */
+static void curve25519_bmi2_adx(u8 mypublic[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_POINT_SIZE], const u8 basepoint[CURVE25519_POINT_SIZE])
+{
+	struct ladder_state s = { .x2 = { 1 }, .z3 = { 1 } };
+	fe64 a, b, c, t;
+	u64 swap = 0, bit;
+	u8 k[32];
+	int i;
+
+	memcpy(k, secret, 32);
+	normalize_secret(k);
+	for (i = 0; i < 4; ++i)
+		s.x1[i] = get_unaligned_le64(basepoint + i * sizeof(u64));
+	s.x1[3] &= ~(1ULL << 63);
+	memcpy(s.x3, s.x1, sizeof(s.x3));
+
+	for (i = 254; i >= 0; --i) {
+		bit = (k[i >> 3] >> (i & 7)) & 1;
+		swap ^= bit;
+		fe64_cswap(s.x2, s.x3, swap);
+		fe64_cswap(s.z2, s.z3, swap);
+		swap = bit;
+		curve25519_ladder_step_bmi2_adx(&s);
+	}
+	fe64_cswap(s.x2, s.x3, swap);
+	fe64_cswap(s.z2, s.z3, swap);
+
+	/* 2 */ curve25519_fsqr_times_bmi2_adx(a, s.z2, 1);
+	/* 8 */ curve25519_fsqr_times_bmi2_adx(t, a, 2);
+	/* 9 */ curve25519_fmul_bmi2_adx(b, t, s.z2);
+	/* 11 */ curve25519_fmul_bmi2_adx(a, b, a);
+	/* 22 */ curve25519_fsqr_times_bmi2_adx(t, a, 1);
+	/* 2^5 - 2^0 = 31 */ curve25519_fmul_bmi2_adx(b, t, b);
+	/* 2^10 - 2^5 */ curve25519_fsqr_times_bmi2_adx(t, b, 5);
+	/* 2^10 - 2^0 */ curve25519_fmul_bmi2_adx(b, t, b);
+	/* 2^20 - 2^10 */ curve25519_fsqr_times_bmi2_adx(t, b, 10);
+	/* 2^20 - 2^0 */ curve25519_fmul_bmi2_adx(c, t, b);
+	/* 2^40 - 2^20 */ curve25519_fsqr_times_bmi2_adx(t, c, 20);
+	/* 2^40 - 2^0 */ curve25519_fmul_bmi2_adx(t, t, c);
+	/* 2^50 - 2^10 */ curve25519_fsqr_times_bmi2_adx(t, t, 10);
+	/* 2^50 - 2^0 */ curve25519_fmul_bmi2_adx(b, t, b);
+	/* 2^100 - 2^50 */ curve25519_fsqr_times_bmi2_adx(t, b, 50);
+	/* 2^100 - 2^0 */ curve25519_fmul_bmi2_adx(c, t, b);
+	/* 2^200 - 2^100 */ curve25519_fsqr_times_bmi2_adx(t, c, 100);
+	/* 2^200 - 2^0 */ curve25519_fmul_bmi2_adx(t, t, c);
+	/* 2^250 - 2^50 */ curve25519_fsqr_times_bmi2_adx(t, t, 50);
+	/* 2^250 - 2^0 */ curve25519_fmul_bmi2_adx(t, t, b);
+	/* 2^255 - 2^5 */ curve25519_fsqr_times_bmi2_adx(t, t, 5);
+	/* 2^255 - 21 */ curve25519_fmul_bmi2_adx(t, t, a);
+
+	curve25519_fmul_bmi2_adx(t, s.x2, t);
+	fe64_contract(mypublic, t);
+
+	memzero_explicit(k, sizeof(k));
+	memzero_explicit(&s, sizeof(s));
+	memzero_explicit(a, sizeof(a));
+	memzero_explicit(b, sizeof(b));
+	memzero_explicit(c, sizeof(c));
+	memzero_explicit(t, sizeof(t));
+}
+
+#endif
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+typedef u64 fe4[10][4];
+
+/* The layout of this must match the offsets at the top of curve25519-avx2-x86_64.S. */
+struct ladder4_state {
+	fe4 x1, x2, z2, x3, z3;
+	fe4 a, b, c, d, aa, bb, e, g19;
+};
+
+asmlinkage void curve25519_4way_ladder_step_avx2(struct ladder4_state *state, const u64 swap[4]);
+
+static bool curve25519_use_avx2 = false;
+
+/* This is too big for the stack, but it is only used with the FPU held, and so with preemption off. */
+static DEFINE_PER_CPU(struct ladder4_state, curve25519_4way_state);
+
+/* Splits a point, ignoring its top bit, into ten limbs of alternately 26 and 25 bits. */
+static void fe4_expand(fe4 out, int lane, const u8 in[CURVE25519_POINT_SIZE])
+{
+	static const u8 offsets[10] = { 0, 26, 51, 77, 102, 128, 153, 179, 204, 230 };
+	u64 w[4], v;
+	int i, word, shift, width;
+
+	for (i = 0; i < 4; ++i)
+		w[i] = get_unaligned_le64(in + i * sizeof(u64));
+	w[3] &= ~(1ULL << 63);
+	for (i = 0; i < 10; ++i) {
+		width = (i & 1) ? 25 : 26;
+		word = offsets[i] / 64;
+		shift = offsets[i] % 64;
+		v = w[word] >> shift;
+		if (shift + width > 64)
+			v |= w[word + 1] << (64 - shift);
+		out[i][lane] = v & ((1ULL << width) - 1);
+	}
+	memzero_explicit(w, sizeof(w));
+}
+
+/* Gathers one lane into the 51-bit limbs used by the generic code, whose fmul tolerates the extra bits. */
+static void fe4_lane_to_felem(felem out, const fe4 in, int lane)
+{
+	int i;
+
+	for (i = 0; i < 5; ++i)
+		out[i] = in[2 * i][lane] + (in[2 * i + 1][lane] << 26);
+}
+
+/* Four ladders from RFC7748, section 5, at once, one in each lane of curve25519-avx2-x86_64.S. The
+ * inversions at the end are done one at a time by the generic code. Must be called with the FPU held. */
+static void curve25519_4way_avx2(u8 *mypublic[4], const u8 *secret[4], const u8 *basepoint[4])
+{
+	struct ladder4_state *s = this_cpu_ptr(&curve25519_4way_state);
+	u64 swap[4] = { 0 }, mask[4], bit, t;
+	felem x, z, zmone;
+	u8 k[4][32];
+	int i, j, lane;
+
+	memset(s, 0, sizeof(*s));
+	for (lane = 0; lane < 4; ++lane) {
+		memcpy(k[lane], secret[lane], 32);
+		normalize_secret(k[lane]);
+		fe4_expand(s->x1, lane, basepoint[lane]);
+		s->x2[0][lane] = 1;
+		s->z3[0][lane] = 1;
+	}
+	memcpy(s->x3, s->x1, sizeof(s->x3));
+
+	for (i = 254; i >= 0; --i) {
+		for (lane = 0; lane < 4; ++lane) {
+			bit = (k[lane][i >> 3] >> (i & 7)) & 1;
+			mask[lane] = 0 - (swap[lane] ^ bit);
+			swap[lane] = bit;
+		}
+		curve25519_4way_ladder_step_avx2(s, mask);
+	}
+
+	for (lane = 0; lane < 4; ++lane) {
+		mask[lane] = 0 - swap[lane];
+		for (j = 0; j < 10; ++j) {
+			t = mask[lane] & (s->x2[j][lane] ^ s->x3[j][lane]);
+			s->x2[j][lane] ^= t;
+			s->x3[j][lane] ^= t;
+			t = mask[lane] & (s->z2[j][lane] ^ s->z3[j][lane]);
+			s->z2[j][lane] ^= t;
+			s->z3[j][lane] ^= t;
+		}
+		fe4_lane_to_felem(x, s->x2, lane);
+		fe4_lane_to_felem(z, s->z2, lane);
+		crecip(zmone, z);
+		fmul(z, x, zmone);
+		fcontract(mypublic[lane], z);
+	}
+
+	memzero_explicit(s, sizeof(*s));
+	memzero_explicit(k, sizeof(k));
+	memzero_explicit(mask, sizeof(mask));
+	memzero_explicit(swap, sizeof(swap));
+	memzero_explicit(x, sizeof(x));
+	memzero_explicit(z, sizeof(z));
+	memzero_explicit(zmone, sizeof(zmone));
+}
+#endif
+
+void curve25519_init(void)
+{
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_ADX)
+	curve25519_use_bmi2_adx = boot_cpu_has(X86_FEATURE_BMI2) && boot_cpu_has(X86_FEATURE_ADX);
+#endif
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+	curve25519_use_avx2 = boot_cpu_has(X86_FEATURE_AVX) && boot_cpu_has(X86_FEATURE_AVX2);
+#endif
+}
+
+void curve25519(u8 mypublic[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_POINT_SIZE], const u8 basepoint[CURVE25519_POINT_SIZE])
+{
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_ADX)
+	if (curve25519_use_bmi2_adx) {
+		curve25519_bmi2_adx(mypublic, secret, basepoint);
+		return;
+	}
+#endif
+	curve25519_generic(mypublic, secret, basepoint);
+}
+
+void curve25519_batch(u8 *mypublic[], const u8 *secret[], const u8 *basepoint[], size_t num)
+{
+	size_t i = 0;
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+	if (curve25519_use_avx2) {
+		for (; i + 4 <= num && irq_fpu_usable(); i += 4) {
+			kernel_fpu_begin();
+			curve25519_4way_avx2(mypublic + i, secret + i, basepoint + i);
+			kernel_fpu_end();
+		}
+	}
+#endif
+	for (; i < num; ++i)
+		curve25519(mypublic[i], secret[i], basepoint[i]);
+}
+
 void curve25519_generate_secret(u8 secret[CURVE25519_POINT_SIZE])
 {
 	get_random_bytes(secret, CURVE25519_POINT_SIZE);
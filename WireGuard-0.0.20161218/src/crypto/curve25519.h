@@ -9,7 +9,10 @@ enum curve25519_lengths {
 	CURVE25519_POINT_SIZE = 32
 };
 
+void curve25519_init(void);
 void curve25519(u8 mypublic[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_POINT_SIZE], const u8 basepoint[CURVE25519_POINT_SIZE]);
+/* Computes mypublic[i] = curve25519(secret[i], basepoint[i]) for each i, several at a time where the CPU allows it. */
+void curve25519_batch(u8 *mypublic[], const u8 *secret[], const u8 *basepoint[], size_t num);
 void curve25519_generate_secret(u8 secret[CURVE25519_POINT_SIZE]);
 void curve25519_generate_public(u8 pub[CURVE25519_POINT_SIZE], const u8 secret[CURVE25519_POINT_SIZE]);
 
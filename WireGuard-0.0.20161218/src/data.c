@@ -18,86 +18,111 @@
 struct encryption_skb_cb {
 	u8 ds;
 	u8 num_frags;
+	u16 num_segs;
 	unsigned int plaintext_len, trailer_len;
 	struct sk_buff *trailer;
 	u64 nonce;
 };
 
-struct encryption_ctx {
-	struct padata_priv padata;
+struct crypt_ctx {
+	struct list_head per_peer_head;
+	struct list_head per_device_head;
 	struct sk_buff_head queue;
-	packet_create_data_callback_t callback;
+	union {
+		packet_create_data_callback_t create_callback;
+		packet_consume_data_callback_t consume_callback;
+	};
 	struct wireguard_peer *peer;
 	struct noise_keypair *keypair;
-};
-
-struct decryption_ctx {
-	struct padata_priv padata;
-	struct sk_buff *skb;
-	packet_consume_data_callback_t callback;
-	struct noise_keypair *keypair;
 	struct endpoint endpoint;
-	u64 nonce;
-	int ret;
-	u8 num_frags;
+	atomic_t is_finished;
 };
 
 #ifdef CONFIG_WIREGUARD_PARALLEL
-static struct kmem_cache *encryption_ctx_cache;
-static struct kmem_cache *decryption_ctx_cache;
+static struct kmem_cache *crypt_ctx_cache;
 
 int packet_init_data_caches(void)
 {
 	BUILD_BUG_ON(sizeof(struct encryption_skb_cb) > sizeof(((struct sk_buff *)0)->cb));
-	encryption_ctx_cache = kmem_cache_create("wireguard_encryption_ctx", sizeof(struct encryption_ctx), 0, 0, NULL);
-	if (!encryption_ctx_cache)
-		return -ENOMEM;
-	decryption_ctx_cache = kmem_cache_create("wireguard_decryption_ctx", sizeof(struct decryption_ctx), 0, 0, NULL);
-	if (!decryption_ctx_cache) {
-		kmem_cache_destroy(encryption_ctx_cache);
+	crypt_ctx_cache = kmem_cache_create("wireguard_crypt_ctx", sizeof(struct crypt_ctx), 0, 0, NULL);
+	if (!crypt_ctx_cache)
 		return -ENOMEM;
-	}
 	return 0;
 }
 
 void packet_deinit_data_caches(void)
 {
-	kmem_cache_destroy(encryption_ctx_cache);
-	kmem_cache_destroy(decryption_ctx_cache);
+	kmem_cache_destroy(crypt_ctx_cache);
 }
 #endif
 
-/* This is RFC6479, a replay detection bitmap algorithm that avoids bitshifts */
+/* This is RFC6479, a replay detection bitmap algorithm that avoids bitshifts.
+ *
+ * It takes no lock, since every CPU finishing a peer's packets comes through here. The
+ * head only moves forward, by compare-and-swap. Rather than clearing the words that the
+ * head passes over, every word is tagged with the block of nonces that its bits are for,
+ * and the first nonce of a newer block to arrive replaces the word outright. Bits and tag
+ * change together, so a slow CPU can never set a bit for a block that has moved on, and
+ * nobody has to wait for anybody else. A word that has moved on to a later block means
+ * the nonce has also fallen out of the window, since the head was moved first. */
 static inline bool counter_validate(union noise_counter *counter, u64 their_counter)
 {
-	bool ret = false;
-	unsigned long index, index_current, top, i;
-	spin_lock_bh(&counter->receive.lock);
+	u64 current_counter, old_counter, block, bit, word, old_word, new_word;
+	atomic64_t *backtrack;
+	u32 tag;
 
-	if (unlikely(counter->receive.counter >= REJECT_AFTER_MESSAGES + 1 || their_counter >= REJECT_AFTER_MESSAGES))
-		goto out;
+	if (unlikely(their_counter >= REJECT_AFTER_MESSAGES))
+		return false;
 
 	++their_counter;
 
-	if (unlikely((COUNTER_WINDOW_SIZE + their_counter) < counter->receive.counter))
-		goto out;
+	current_counter = atomic64_read(&counter->receive.counter);
+	for (;;) {
+		if (unlikely(current_counter >= REJECT_AFTER_MESSAGES + 1))
+			return false;
 
-	index = their_counter >> ilog2(COUNTER_REDUNDANT_BITS);
+		if (unlikely((COUNTER_WINDOW_SIZE + their_counter) < current_counter))
+			return false;
 
-	if (likely(their_counter > counter->receive.counter)) {
-		index_current = counter->receive.counter >> ilog2(COUNTER_REDUNDANT_BITS);
-		top = min_t(unsigned long, index - index_current, COUNTER_BITS_TOTAL / BITS_PER_LONG);
-		for (i = 1; i <= top; ++i)
-			counter->receive.backtrack[(i + index_current) & ((COUNTER_BITS_TOTAL / BITS_PER_LONG) - 1)] = 0;
-		counter->receive.counter = their_counter;
+		if (likely(their_counter <= current_counter))
+			break;
+
+		old_counter = atomic64_cmpxchg(&counter->receive.counter, current_counter, their_counter);
+		if (old_counter == current_counter)
+			break;
+		current_counter = old_counter;
 	}
 
-	index &= (COUNTER_BITS_TOTAL / BITS_PER_LONG) - 1;
-	ret = !test_and_set_bit(their_counter & (COUNTER_REDUNDANT_BITS - 1), &counter->receive.backtrack[index]);
+	block = their_counter >> ilog2(COUNTER_REDUNDANT_BITS);
+	bit = 1ULL << (their_counter & (COUNTER_REDUNDANT_BITS - 1));
+	backtrack = &counter->receive.backtrack[block & ((COUNTER_BITS_TOTAL / COUNTER_REDUNDANT_BITS) - 1)];
+	word = atomic64_read(backtrack);
+	/* The head is read below after the word, as it was written before it. A failed
+	 * atomic64_cmpxchg is a full barrier, which takes care of that for later rounds. */
+	smp_rmb();
+	for (;;) {
+		/* Only the low 32 bits of the block fit in the tag. A tag for a later block than
+		 * ours can be at most as far ahead as the head, which was moved before the tag was
+		 * written, so anything further ahead than that is really a stale one that wrapped.
+		 * A word without any bits set, such as a fresh one, is never for a later block. */
+		tag = word >> 32;
+		if (likely(tag == (u32)block)) {
+			if (word & bit)
+				return false;
+			new_word = word | bit;
+		} else if (unlikely((u32)word && (u32)(tag - (u32)block) <= ((u64)atomic64_read(&counter->receive.counter) >> ilog2(COUNTER_REDUNDANT_BITS)) - block))
+			return false;
+		else
+			new_word = (block << 32) | bit;
+		old_word = atomic64_cmpxchg(backtrack, word, new_word);
+		if (likely(old_word == word))
+			break;
+		word = old_word;
+	}
 
-out:
-	spin_unlock_bh(&counter->receive.lock);
-	return ret;
+	/* Losing a race to a word that went on to a block 2^32 ahead is only possible once the
+	 * head has left us far behind, which this catches. */
+	return (COUNTER_WINDOW_SIZE + their_counter) >= (u64)atomic64_read(&counter->receive.counter);
 }
 #include "selftest/counter.h"
 
@@ -134,11 +159,12 @@ static inline void skb_reset(struct sk_buff *skb)
 	skb_probe_transport_header(skb, 0);
 }
 
-static inline void skb_encrypt(struct sk_buff *skb, struct noise_keypair *keypair, bool have_simd)
+static inline void skb_encrypt(struct sk_buff *skb, struct noise_keypair *keypair, struct chacha20poly1305_batch_entry *batch, unsigned int *batched, bool have_simd)
 {
 	struct encryption_skb_cb *cb = (struct encryption_skb_cb *)skb->cb;
 	struct scatterlist sg[cb->num_frags]; /* This should be bound to at most 128 by the caller. */
 	struct message_data *header;
+	struct chacha20poly1305_batch_entry *entry;
 
 	/* We have to remember to add the checksum to the innerpacket, in case the receiver forwards it. */
 	if (likely(!skb_checksum_setup(skb, true)))
@@ -151,6 +177,20 @@ static inline void skb_encrypt(struct sk_buff *skb, struct noise_keypair *keypai
 	header->counter = cpu_to_le64(cb->nonce);
 	pskb_put(skb, cb->trailer, cb->trailer_len);
 
+	/* Small linear packets get encrypted together by the caller, so that they can share the
+	 * SIMD lanes. From eight ChaCha20 blocks on, a single packet fills the lanes by itself,
+	 * and the stitched functions that it then gets are faster than batching. */
+	if (cb->num_frags == 1 && !skb_is_nonlinear(skb) && cb->plaintext_len < CHACHA20POLY1305_MAX_BATCH_LEN) {
+		entry = &batch[(*batched)++];
+		entry->dst = skb->data + sizeof(struct message_data);
+		entry->src = entry->dst;
+		entry->src_len = cb->plaintext_len;
+		entry->ad = NULL;
+		entry->ad_len = 0;
+		entry->nonce = cb->nonce;
+		return;
+	}
+
 	/* Now we can encrypt the scattergather segments */
 	sg_init_table(sg, cb->num_frags);
 	skb_to_sgvec(skb, sg, sizeof(struct message_data), noise_encrypted_len(cb->plaintext_len));
@@ -164,7 +204,7 @@ static inline bool skb_decrypt(struct sk_buff *skb, u8 num_frags, u64 nonce, str
 	if (unlikely(!key))
 		return false;
 
-	if (unlikely(!key->is_valid || time_is_before_eq_jiffies64(key->birthdate + REJECT_AFTER_TIME) || key->counter.receive.counter >= REJECT_AFTER_MESSAGES)) {
+	if (unlikely(!key->is_valid || time_is_before_eq_jiffies64(key->birthdate + REJECT_AFTER_TIME) || atomic64_read(&key->counter.receive.counter) >= REJECT_AFTER_MESSAGES)) {
 		key->is_valid = false;
 		return false;
 	}
@@ -178,7 +218,7 @@ static inline bool skb_decrypt(struct sk_buff *skb, u8 num_frags, u64 nonce, str
 	return pskb_trim(skb, skb->len - noise_encrypted_len(0)) == 0;
 }
 
-static inline bool get_encryption_nonce(u64 *nonce, struct noise_symmetric_key *key)
+static inline bool get_encryption_nonces(u64 *nonce, unsigned int count, struct noise_symmetric_key *key)
 {
 	if (unlikely(!key))
 		return false;
@@ -188,8 +228,8 @@ static inline bool get_encryption_nonce(u64 *nonce, struct noise_symmetric_key *
 		return false;
 	}
 
-	*nonce = atomic64_inc_return(&key->counter.counter) - 1;
-	if (*nonce >= REJECT_AFTER_MESSAGES) {
+	*nonce = atomic64_add_return(count, &key->counter.counter) - count;
+	if (*nonce + count - 1 >= REJECT_AFTER_MESSAGES) {
 		key->is_valid = false;
 		return false;
 	}
@@ -197,56 +237,213 @@ static inline bool get_encryption_nonce(u64 *nonce, struct noise_symmetric_key *
 	return true;
 }
 
+static struct sk_buff *skb_encrypt_segment(struct sk_buff *seg, u64 nonce, u8 ds, struct noise_keypair *keypair, bool have_simd)
+{
+	struct scatterlist src[2], dst;
+	unsigned int padding_len, plaintext_len;
+	struct message_data *header;
+	struct sk_buff *out;
+
+	if (unlikely(skb_linearize(seg)))
+		return NULL;
+
+	if (likely(!skb_checksum_setup(seg, true)))
+		skb_checksum_help(seg);
+
+	padding_len = skb_padding(seg);
+	plaintext_len = seg->len + padding_len;
+
+	out = alloc_skb(DATA_PACKET_HEAD_ROOM + noise_encrypted_len(plaintext_len), GFP_ATOMIC);
+	if (unlikely(!out))
+		return NULL;
+	skb_reserve(out, DATA_PACKET_HEAD_ROOM);
+	skb_put(out, noise_encrypted_len(plaintext_len));
+
+	/* The padding is zeroed directly in the output buffer and encrypted in place from
+	 * there, so that the segment itself never needs to grow. */
+	memset(out->data + seg->len, 0, padding_len);
+	sg_init_table(src, padding_len ? 2 : 1);
+	sg_set_buf(&src[0], seg->data, seg->len);
+	if (padding_len)
+		sg_set_buf(&src[1], out->data + seg->len, padding_len);
+	sg_init_one(&dst, out->data, noise_encrypted_len(plaintext_len));
+	chacha20poly1305_encrypt_sg(&dst, src, plaintext_len, NULL, 0, nonce, keypair->sending.key, have_simd);
+
+	header = (struct message_data *)skb_push(out, sizeof(struct message_data));
+	header->header.type = cpu_to_le32(MESSAGE_DATA);
+	header->key_idx = keypair->remote_index;
+	header->counter = cpu_to_le64(nonce);
+
+	skb_reset(out);
+	((struct encryption_skb_cb *)out->cb)->ds = ds;
+	return out;
+}
+
+/* GSO super-packets are only segmented here, after they have their nonces, and each
+ * segment is encrypted into a freshly allocated skb of exactly the right size, which
+ * then takes the place of the super-packet in the queue. */
+static void skb_encrypt_gso(struct sk_buff_head *queue, struct sk_buff *skb, struct noise_keypair *keypair, bool have_simd)
+{
+	struct encryption_skb_cb *cb = (struct encryption_skb_cb *)skb->cb;
+	struct sk_buff *segs, *next, *out, *prev = skb;
+	/* skb_gso_segment uses part of skb->cb, so we copy out what we need first. */
+	u64 nonce = cb->nonce;
+	unsigned int i = 0, num_segs = cb->num_segs;
+	u8 ds = cb->ds;
+
+	segs = skb_gso_segment(skb, 0);
+	if (unlikely(IS_ERR_OR_NULL(segs)))
+		goto out;
+
+	for (; segs; segs = next) {
+		next = segs->next;
+		segs->next = segs->prev = NULL;
+		out = NULL;
+		/* If it somehow turns into more segments than we reserved nonces for, we drop the rest. */
+		if (likely(i < num_segs))
+			out = skb_encrypt_segment(segs, nonce + i++, ds, keypair, have_simd);
+		consume_skb(segs);
+		if (unlikely(!out))
+			continue;
+		__skb_queue_after(queue, prev, out);
+		prev = out;
+	}
+
+out:
+	__skb_unlink(skb, queue);
+	consume_skb(skb);
+}
+
 static inline void queue_encrypt_reset(struct sk_buff_head *queue, struct noise_keypair *keypair)
 {
-	struct sk_buff *skb;
+	struct chacha20poly1305_batch_entry batch[CHACHA20POLY1305_MAX_BATCH];
+	unsigned int batched = 0;
+	struct sk_buff *skb, *tmp;
 	bool have_simd = chacha20poly1305_init_simd();
-	skb_queue_walk(queue, skb) {
-		skb_encrypt(skb, keypair, have_simd);
+	skb_queue_walk_safe(queue, skb, tmp) {
+		if (skb_is_gso(skb)) {
+			skb_encrypt_gso(queue, skb, keypair, have_simd);
+			continue;
+		}
+		skb_encrypt(skb, keypair, batch, &batched, have_simd);
 		skb_reset(skb);
+		if (batched == CHACHA20POLY1305_MAX_BATCH) {
+			chacha20poly1305_encrypt_batch(batch, batched, keypair->sending.key, have_simd);
+			batched = 0;
+		}
 	}
+	if (batched)
+		chacha20poly1305_encrypt_batch(batch, batched, keypair->sending.key, have_simd);
 	chacha20poly1305_deinit_simd(have_simd);
 	noise_keypair_put(keypair);
 }
 
 #ifdef CONFIG_WIREGUARD_PARALLEL
-static void do_encryption(struct padata_priv *padata)
+static inline int choose_cpu(int *next)
 {
-	struct encryption_ctx *ctx = container_of(padata, struct encryption_ctx, padata);
+	int cpu = READ_ONCE(*next);
 
-	queue_encrypt_reset(&ctx->queue, ctx->keypair);
-	padata_do_serial(padata);
+	if (cpu >= nr_cpu_ids || !cpu_online(cpu))
+		cpu = cpumask_first(cpu_online_mask);
+	WRITE_ONCE(*next, cpumask_next(cpu, cpu_online_mask));
+	return cpu;
 }
 
-static void finish_encryption(struct padata_priv *padata)
+static inline bool queue_enqueue_per_peer(struct crypt_queue *queue, struct crypt_ctx *ctx, unsigned int limit)
 {
-	struct encryption_ctx *ctx = container_of(padata, struct encryption_ctx, padata);
+	bool ret = false;
 
-	ctx->callback(&ctx->queue, ctx->peer);
-	atomic_dec(&ctx->peer->parallel_encryption_inflight);
-	peer_put(ctx->peer);
-	kmem_cache_free(encryption_ctx_cache, ctx);
+	spin_lock_bh(&queue->lock);
+	if (likely(queue->len < limit)) {
+		list_add_tail(&ctx->per_peer_head, &queue->list);
+		++queue->len;
+		ret = true;
+	}
+	spin_unlock_bh(&queue->lock);
+	return ret;
+}
+
+static inline void queue_enqueue_per_device(struct workqueue_struct *wq, struct crypt_queue *queue, struct crypt_ctx *ctx)
+{
+	int cpu;
+
+	spin_lock_bh(&queue->lock);
+	list_add_tail(&ctx->per_device_head, &queue->list);
+	++queue->len;
+	spin_unlock_bh(&queue->lock);
+
+	/* Any worker can take any job off the device queue, so we just kick the next online CPU. */
+	cpu = choose_cpu(&queue->next_cpu);
+	queue_work_on(cpu, wq, &per_cpu_ptr(queue->worker, cpu)->work);
 }
 
-static inline int start_encryption(struct padata_instance *padata, struct padata_priv *priv, int cb_cpu)
+static inline struct crypt_ctx *queue_dequeue_per_device(struct crypt_queue *queue)
 {
-	memset(priv, 0, sizeof(struct padata_priv));
-	priv->parallel = do_encryption;
-	priv->serial = finish_encryption;
-	return padata_do_parallel(padata, priv, cb_cpu);
+	struct crypt_ctx *ctx;
+
+	spin_lock_bh(&queue->lock);
+	ctx = list_first_entry_or_null(&queue->list, struct crypt_ctx, per_device_head);
+	if (likely(ctx)) {
+		list_del(&ctx->per_device_head);
+		--queue->len;
+	}
+	spin_unlock_bh(&queue->lock);
+	return ctx;
+}
+
+/* This marks ctx as done and then hands off, in order, every finished job at the head of
+ * the peer's queue. Only one CPU delivers from a given peer queue at a time. If somebody
+ * else is already doing it, they're guaranteed to see our job before they stop, because
+ * they check the head again under the lock before clearing the draining flag. */
+static void queue_finish_per_peer(struct crypt_queue *queue, struct crypt_ctx *ctx, void (*deliver)(struct crypt_ctx *))
+{
+	/* As soon as is_finished is set, another CPU may deliver and free ctx, dropping the
+	 * peer reference it holds, so we hold our own for as long as we touch the queue. */
+	struct wireguard_peer *peer = peer_rcu_get(ctx->peer);
+
+	smp_wmb();
+	atomic_set(&ctx->is_finished, true);
+
+	local_bh_disable();
+	spin_lock(&queue->lock);
+	if (queue->draining)
+		goto out;
+	queue->draining = true;
+	for (;;) {
+		ctx = list_first_entry_or_null(&queue->list, struct crypt_ctx, per_peer_head);
+		if (!ctx || !atomic_read(&ctx->is_finished))
+			break;
+		list_del(&ctx->per_peer_head);
+		--queue->len;
+		spin_unlock(&queue->lock);
+		smp_rmb();
+		deliver(ctx);
+		spin_lock(&queue->lock);
+	}
+	queue->draining = false;
+out:
+	spin_unlock(&queue->lock);
+	local_bh_enable();
+	peer_put(peer);
 }
 
-static inline unsigned int choose_cpu(__le32 key)
+static void deliver_encryption(struct crypt_ctx *ctx)
 {
-	unsigned int cpu_index, cpu, cb_cpu;
+	ctx->create_callback(&ctx->queue, ctx->peer);
+	peer_put(ctx->peer);
+	kmem_cache_free(crypt_ctx_cache, ctx);
+}
 
-	/* This ensures that packets encrypted to the same key are sent in-order. */
-	cpu_index = ((__force unsigned int)key) % cpumask_weight(cpu_online_mask);
-	cb_cpu = cpumask_first(cpu_online_mask);
-	for (cpu = 0; cpu < cpu_index; ++cpu)
-		cb_cpu = cpumask_next(cb_cpu, cpu_online_mask);
+static void encrypt_worker(struct work_struct *work)
+{
+	struct crypt_queue *queue = container_of(work, struct crypt_worker, work)->queue;
+	struct crypt_ctx *ctx;
 
-	return cb_cpu;
+	while ((ctx = queue_dequeue_per_device(queue)) != NULL) {
+		queue_encrypt_reset(&ctx->queue, ctx->keypair);
+		queue_finish_per_peer(&ctx->peer->tx_queue, ctx, deliver_encryption);
+		cond_resched();
+	}
 }
 #endif
 
@@ -266,7 +463,18 @@ int packet_create_data(struct sk_buff_head *queue, struct wireguard_peer *peer,
 		struct encryption_skb_cb *cb = (struct encryption_skb_cb *)skb->cb;
 		unsigned int padding_len, num_frags;
 
-		if (unlikely(!get_encryption_nonce(&cb->nonce, &keypair->sending)))
+		if (skb_is_gso(skb)) {
+			/* Super-packets are segmented, padded, and encrypted later, in one go, so
+			 * here we only reserve a nonce for each segment they'll be turned into. */
+			cb->num_segs = skb_shinfo(skb)->gso_segs;
+			if (unlikely(!get_encryption_nonces(&cb->nonce, cb->num_segs, &keypair->sending)))
+				goto err;
+			cb->ds = ip_tunnel_ecn_encap(0, ip_hdr(skb), skb);
+			ret = -EPIPE;
+			continue;
+		}
+
+		if (unlikely(!get_encryption_nonces(&cb->nonce, 1, &keypair->sending)))
 			goto err;
 
 		padding_len = skb_padding(skb);
@@ -304,29 +512,30 @@ int packet_create_data(struct sk_buff_head *queue, struct wireguard_peer *peer,
 	}
 
 #ifdef CONFIG_WIREGUARD_PARALLEL
-	if ((skb_queue_len(queue) > 1 || queue->next->len > 256 || atomic_read(&peer->parallel_encryption_inflight) > 0) && cpumask_weight(cpu_online_mask) > 1) {
-		unsigned int cpu = choose_cpu(keypair->remote_index);
-		struct encryption_ctx *ctx = kmem_cache_alloc(encryption_ctx_cache, GFP_ATOMIC);
+	/* Once anything for this peer is in flight, everything after it must go through the
+	 * peer's queue too, or it would overtake what's already there. */
+	if ((skb_queue_len(queue) > 1 || queue->next->len > 256 || READ_ONCE(peer->tx_queue.len) > 0) && cpumask_weight(cpu_online_mask) > 1) {
+		struct wireguard_device *wg = peer->device;
+		struct crypt_ctx *ctx = kmem_cache_alloc(crypt_ctx_cache, GFP_ATOMIC);
 		if (!ctx)
 			goto serial_encrypt;
 		skb_queue_head_init(&ctx->queue);
 		skb_queue_splice_init(queue, &ctx->queue);
-		ctx->callback = callback;
+		ctx->create_callback = callback;
 		ctx->keypair = keypair;
+		atomic_set(&ctx->is_finished, false);
 		ctx->peer = peer_rcu_get(peer);
 		ret = -EBUSY;
 		if (unlikely(!ctx->peer))
 			goto err_parallel;
-		atomic_inc(&peer->parallel_encryption_inflight);
-		ret = start_encryption(peer->device->parallel_send, &ctx->padata, cpu);
-		if (unlikely(ret < 0)) {
-			atomic_dec(&peer->parallel_encryption_inflight);
+		if (unlikely(!queue_enqueue_per_peer(&peer->tx_queue, ctx, MAX_QUEUED_OUTGOING_PACKETS))) {
 			peer_put(ctx->peer);
 err_parallel:
 			skb_queue_splice(&ctx->queue, queue);
-			kmem_cache_free(encryption_ctx_cache, ctx);
+			kmem_cache_free(crypt_ctx_cache, ctx);
 			goto err;
 		}
+		queue_enqueue_per_device(wg->parallelqueue, &wg->encrypt_queue, ctx);
 	} else
 serial_encrypt:
 #endif
@@ -344,144 +553,294 @@ err_rcu:
 	return ret;
 }
 
-static void begin_decrypt_packet(struct decryption_ctx *ctx)
+static void begin_decrypt_packets(struct crypt_ctx *ctx)
 {
-	if (unlikely(!skb_decrypt(ctx->skb, ctx->num_frags, ctx->nonce, &ctx->keypair->receiving)))
-		goto err;
+	struct sk_buff *skb, *tmp;
+
+	skb_queue_walk_safe(&ctx->queue, skb, tmp) {
+		if (unlikely(!skb_decrypt(skb, PACKET_CB(skb)->num_frags, PACKET_CB(skb)->nonce, &ctx->keypair->receiving))) {
+			__skb_unlink(skb, &ctx->queue);
+			kfree_skb(skb);
+			peer_stats_add(ctx->peer, rx_dropped_auth, 1);
+			continue;
+		}
+		skb_reset(skb);
+	}
+}
 
-	skb_reset(ctx->skb);
-	ctx->ret = 0;
-	return;
+static void finish_decrypt_packets(struct crypt_ctx *ctx)
+{
+	struct sk_buff *skb;
+	bool used_new_key;
+
+	while ((skb = __skb_dequeue(&ctx->queue)) != NULL) {
+		if (unlikely(!counter_validate(&ctx->keypair->receiving.counter, PACKET_CB(skb)->nonce))) {
+			net_dbg_ratelimited("Packet has invalid nonce %Lu (max %Lu)\n", PACKET_CB(skb)->nonce, (u64)atomic64_read(&ctx->keypair->receiving.counter.receive.counter));
+			peer_stats_add(ctx->peer, rx_replayed, 1);
+			ctx->consume_callback(skb, NULL, NULL, false, -ERANGE);
+			continue;
+		}
+		used_new_key = noise_received_with_keypair(&ctx->peer->keypairs, ctx->keypair);
+		/* The callback takes ownership of a reference, and we give each packet its own. */
+		ctx->consume_callback(skb, peer_rcu_get(ctx->peer), &ctx->endpoint, used_new_key, 0);
+	}
+	noise_keypair_put(ctx->keypair);
+	peer_put(ctx->peer);
+}
 
-err:
-	ctx->ret = -ENOKEY;
-	peer_put(ctx->keypair->entry.peer);
+#ifdef CONFIG_WIREGUARD_PARALLEL
+static void deliver_decryption(struct crypt_ctx *ctx)
+{
+	finish_decrypt_packets(ctx);
+	kmem_cache_free(crypt_ctx_cache, ctx);
 }
 
-static void finish_decrypt_packet(struct decryption_ctx *ctx)
+static void decrypt_worker(struct work_struct *work)
 {
-	struct noise_keypairs *keypairs;
-	bool used_new_key = false;
-	int ret = ctx->ret;
-	if (ret)
-		goto err;
+	struct crypt_queue *queue = container_of(work, struct crypt_worker, work)->queue;
+	struct crypt_ctx *ctx;
 
-	keypairs = &ctx->keypair->entry.peer->keypairs;
-	ret = counter_validate(&ctx->keypair->receiving.counter, ctx->nonce) ? 0 : -ERANGE;
+	while ((ctx = queue_dequeue_per_device(queue)) != NULL) {
+		begin_decrypt_packets(ctx);
+		queue_finish_per_peer(&ctx->peer->rx_queue, ctx, deliver_decryption);
+		cond_resched();
+	}
+}
 
-	if (likely(!ret))
-		used_new_key = noise_received_with_keypair(&ctx->keypair->entry.peer->keypairs, ctx->keypair);
-	else {
-		net_dbg_ratelimited("Packet has invalid nonce %Lu (max %Lu)\n", ctx->nonce, ctx->keypair->receiving.counter.receive.counter);
-		peer_put(ctx->keypair->entry.peer);
-		goto err;
+void packet_queue_init(struct crypt_queue *queue)
+{
+	INIT_LIST_HEAD(&queue->list);
+	spin_lock_init(&queue->lock);
+	queue->len = 0;
+	queue->draining = false;
+	queue->worker = NULL;
+	queue->next_cpu = 0;
+}
+
+static int device_queue_init(struct crypt_queue *queue, work_func_t function)
+{
+	int cpu;
+
+	packet_queue_init(queue);
+	queue->worker = alloc_percpu(struct crypt_worker);
+	if (!queue->worker)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		per_cpu_ptr(queue->worker, cpu)->queue = queue;
+		INIT_WORK(&per_cpu_ptr(queue->worker, cpu)->work, function);
 	}
+	return 0;
+}
 
-	noise_keypair_put(ctx->keypair);
-	ctx->callback(ctx->skb, ctx->keypair->entry.peer, &ctx->endpoint, used_new_key, 0);
-	return;
+int packet_init_device_queues(struct wireguard_device *wg)
+{
+	int ret;
 
-err:
-	noise_keypair_put(ctx->keypair);
-	ctx->callback(ctx->skb, NULL, NULL, false, ret);
+	ret = device_queue_init(&wg->encrypt_queue, encrypt_worker);
+	if (ret < 0)
+		return ret;
+	ret = device_queue_init(&wg->decrypt_queue, decrypt_worker);
+	if (ret < 0) {
+		free_percpu(wg->encrypt_queue.worker);
+		return ret;
+	}
+	return 0;
 }
 
-#ifdef CONFIG_WIREGUARD_PARALLEL
-static void do_decryption(struct padata_priv *padata)
+void packet_uninit_device_queues(struct wireguard_device *wg)
 {
-	struct decryption_ctx *ctx = container_of(padata, struct decryption_ctx, padata);
-	begin_decrypt_packet(ctx);
-	padata_do_serial(padata);
+	free_percpu(wg->encrypt_queue.worker);
+	free_percpu(wg->decrypt_queue.worker);
 }
+#endif
 
-static void finish_decryption(struct padata_priv *padata)
+/* Cuts skb into gso_size pieces and queues them. skb_split hands the page fragments past the
+ * cut over to the next piece instead of copying them, so only whatever of the linear area lies
+ * past the cut is copied. */
+static int split_piece(struct sk_buff *skb, unsigned int seg_len, u8 ds, struct sk_buff_head *queue)
 {
-	struct decryption_ctx *ctx = container_of(padata, struct decryption_ctx, padata);
-	finish_decrypt_packet(ctx);
-	kmem_cache_free(decryption_ctx_cache, ctx);
+	struct sk_buff *rest;
+
+	for (;;) {
+		PACKET_CB(skb)->ds = ds;
+		if (skb->len <= seg_len) {
+			__skb_queue_tail(queue, skb);
+			return 0;
+		}
+		if (unlikely(skb_unclone(skb, GFP_ATOMIC)))
+			break;
+		rest = alloc_skb(skb_headlen(skb) > seg_len ? skb_headlen(skb) - seg_len : 0, GFP_ATOMIC);
+		if (unlikely(!rest))
+			break;
+		skb_split(skb, rest, seg_len);
+		__skb_queue_tail(queue, skb);
+		skb = rest;
+	}
+	kfree_skb(skb);
+	return -ENOMEM;
 }
 
-static inline int start_decryption(struct padata_instance *padata, struct padata_priv *priv, int cb_cpu)
+/* A GRO train is a run of data messages from the same source and key index that were
+ * coalesced by gro_receive() in socket.c. Every message but the last is exactly gso_size
+ * bytes, and depending on the driver, the messages after the first were either merged
+ * into the page fragments of the first skb or chained onto its frag_list, whole. So we
+ * take the frag_list apart and split each of the pieces, which shares the data of the
+ * train rather than copying it message by message. This takes over skb, which must have
+ * something past offset. */
+static int split_train(struct sk_buff *skb, size_t offset, struct sk_buff_head *queue)
 {
-	priv->parallel = do_decryption;
-	priv->serial = finish_decryption;
-	return padata_do_parallel(padata, priv, cb_cpu);
+	unsigned int seg_len = skb_shinfo(skb)->gso_size;
+	u8 ds = PACKET_CB(skb)->ds;
+	struct sk_buff *list, *next;
+	int ret;
+
+	if (unlikely(skb_unclone(skb, GFP_ATOMIC) || !pskb_may_pull(skb, offset))) {
+		kfree_skb(skb);
+		return -ENOMEM;
+	}
+	__skb_pull(skb, offset);
+	skb_shinfo(skb)->gso_size = 0;
+	skb_shinfo(skb)->gso_segs = 0;
+	skb_shinfo(skb)->gso_type = 0;
+	skb->encapsulation = 0;
+
+	list = skb_shinfo(skb)->frag_list;
+	skb_shinfo(skb)->frag_list = NULL;
+	for (next = list; next; next = next->next) {
+		skb->len -= next->len;
+		skb->data_len -= next->len;
+		skb->truesize -= next->truesize;
+	}
+
+	ret = split_piece(skb, seg_len, ds, queue);
+	for (; list; list = next) {
+		next = list->next;
+		list->next = NULL;
+		if (unlikely(ret < 0)) {
+			kfree_skb(list);
+			continue;
+		}
+		/* Unsharing the train above may have left a reference to each of these with its clone. */
+		list = skb_share_check(list, GFP_ATOMIC);
+		if (unlikely(!list)) {
+			ret = -ENOMEM;
+			continue;
+		}
+		ret = split_piece(list, seg_len, ds, queue);
+	}
+	return ret;
+}
+
+static int prepare_data_message(struct sk_buff *skb, __le32 *idx)
+{
+	struct message_data *header;
+	struct sk_buff *trailer;
+	int ret;
+
+	if (unlikely(!pskb_may_pull(skb, sizeof(struct message_data))))
+		return -ENOMEM;
+
+	header = (struct message_data *)skb->data;
+	*idx = header->key_idx;
+	PACKET_CB(skb)->nonce = le64_to_cpu(header->counter);
+	skb_pull(skb, sizeof(struct message_data));
+
+	ret = skb_cow_data(skb, 0, &trailer);
+	if (unlikely(ret < 0))
+		return ret;
+	if (unlikely(ret > 128))
+		return -ENOMEM;
+	PACKET_CB(skb)->num_frags = ret;
+	return 0;
 }
-#endif
 
 void packet_consume_data(struct sk_buff *skb, size_t offset, struct wireguard_device *wg, packet_consume_data_callback_t callback)
 {
 	int ret;
 	struct endpoint endpoint;
-	unsigned int num_frags;
-	struct sk_buff *trailer;
-	struct message_data *header;
+	struct sk_buff_head queue;
+	struct sk_buff *message, *tmp;
 	struct noise_keypair *keypair;
-	u64 nonce;
-	__le32 idx;
+	__le32 idx, message_idx;
+
+	__skb_queue_head_init(&queue);
 
 	ret = socket_endpoint_from_skb(&endpoint, skb);
 	if (unlikely(ret < 0))
 		goto err;
 
-	ret = -ENOMEM;
-	if (unlikely(!pskb_may_pull(skb, offset + sizeof(struct message_data))))
-		goto err;
-
-	header = (struct message_data *)(skb->data + offset);
-	offset += sizeof(struct message_data);
-	skb_pull(skb, offset);
-
-	idx = header->key_idx;
-	nonce = le64_to_cpu(header->counter);
+	if (skb_is_gso(skb)) {
+		/* A train with nothing after its offset leaves no message to look at below. */
+		ret = -EINVAL;
+		if (unlikely(skb->len <= offset || !skb_shinfo(skb)->gso_size))
+			goto err;
+		ret = split_train(skb, offset, &queue);
+		if (unlikely(ret < 0))
+			goto err_queue;
+	} else {
+		ret = -ENOMEM;
+		if (unlikely(!pskb_may_pull(skb, offset)))
+			goto err;
+		skb_pull(skb, offset);
+		__skb_queue_tail(&queue, skb);
+	}
 
-	ret = skb_cow_data(skb, 0, &trailer);
+	/* Everything in a train shares a key index, but we still check each header, and we
+	 * only look up the keypair once, using the first one. */
+	ret = prepare_data_message(skb_peek(&queue), &idx);
 	if (unlikely(ret < 0))
-		goto err;
-	num_frags = ret;
-	ret = -ENOMEM;
-	if (unlikely(num_frags > 128))
-		goto err;
+		goto err_queue;
+	skb_queue_walk_safe(&queue, message, tmp) {
+		if (message == skb_peek(&queue))
+			continue;
+		if (unlikely(prepare_data_message(message, &message_idx) < 0 || message_idx != idx)) {
+			__skb_unlink(message, &queue);
+			kfree_skb(message);
+		}
+	}
+
 	ret = -EINVAL;
 	rcu_read_lock();
 	keypair = noise_keypair_get((struct noise_keypair *)index_hashtable_lookup(&wg->index_hashtable, INDEX_HASHTABLE_KEYPAIR, idx));
 	rcu_read_unlock();
 	if (unlikely(!keypair))
-		goto err;
+		goto err_queue;
 #ifdef CONFIG_WIREGUARD_PARALLEL
 	if (cpumask_weight(cpu_online_mask) > 1) {
-		unsigned int cpu = choose_cpu(idx);
-		struct decryption_ctx *ctx;
+		struct crypt_ctx *ctx;
 
 		ret = -ENOMEM;
-		ctx = kmem_cache_alloc(decryption_ctx_cache, GFP_ATOMIC);
+		ctx = kmem_cache_alloc(crypt_ctx_cache, GFP_ATOMIC);
 		if (unlikely(!ctx))
 			goto err_peer;
 
-		ctx->skb = skb;
+		__skb_queue_head_init(&ctx->queue);
+		skb_queue_splice_init(&queue, &ctx->queue);
 		ctx->keypair = keypair;
-		ctx->callback = callback;
-		ctx->nonce = nonce;
-		ctx->num_frags = num_frags;
+		ctx->peer = keypair->entry.peer;
+		ctx->consume_callback = callback;
 		ctx->endpoint = endpoint;
-		ret = start_decryption(wg->parallel_receive, &ctx->padata, cpu);
-		if (unlikely(ret)) {
-			kmem_cache_free(decryption_ctx_cache, ctx);
+		atomic_set(&ctx->is_finished, false);
+		ret = -EBUSY;
+		if (unlikely(!queue_enqueue_per_peer(&ctx->peer->rx_queue, ctx, MAX_QUEUED_INCOMING_PACKETS))) {
+			skb_queue_splice_init(&ctx->queue, &queue);
+			kmem_cache_free(crypt_ctx_cache, ctx);
 			goto err_peer;
 		}
+		queue_enqueue_per_device(wg->parallelqueue, &wg->decrypt_queue, ctx);
 	} else
 #endif
 	{
-		struct decryption_ctx ctx = {
-			.skb = skb,
+		struct crypt_ctx ctx = {
 			.keypair = keypair,
-			.callback = callback,
-			.nonce = nonce,
-			.num_frags = num_frags,
+			.peer = keypair->entry.peer,
+			.consume_callback = callback,
 			.endpoint = endpoint
 		};
-		begin_decrypt_packet(&ctx);
-		finish_decrypt_packet(&ctx);
+		__skb_queue_head_init(&ctx.queue);
+		skb_queue_splice_init(&queue, &ctx.queue);
+		begin_decrypt_packets(&ctx);
+		finish_decrypt_packets(&ctx);
 	}
 	return;
 
@@ -490,6 +849,10 @@ err_peer:
 	peer_put(keypair->entry.peer);
 	noise_keypair_put(keypair);
 #endif
+err_queue:
+	while ((message = __skb_dequeue(&queue)) != NULL)
+		callback(message, NULL, NULL, false, ret);
+	return;
 err:
 	callback(skb, NULL, NULL, false, ret);
 }
@@ -46,6 +46,7 @@ static int open(struct net_device *dev)
 	if (ret < 0)
 		return ret;
 	peer_for_each(wg, open_peer, NULL);
+	noise_ephemeral_pool_refill(&wg->ephemeral_pool);
 	return 0;
 }
 
@@ -53,8 +54,7 @@ static int clear_noise_peer(struct wireguard_peer *peer, void *data)
 {
 	noise_handshake_clear(&peer->handshake);
 	noise_keypairs_clear(&peer->keypairs);
-	if (peer->timer_kill_ephemerals.data)
-		del_timer(&peer->timer_kill_ephemerals);
+	timers_keys_cleared(peer);
 	return 0;
 }
 
@@ -63,8 +63,13 @@ static int suspending_clear_noise_peers(struct notifier_block *nb, unsigned long
 {
 	struct wireguard_device *wg = container_of(nb, struct wireguard_device, clear_peers_on_suspend);
 	if (action == PM_HIBERNATION_PREPARE || action == PM_SUSPEND_PREPARE) {
+		noise_ephemeral_pool_suspend(&wg->ephemeral_pool);
 		peer_for_each(wg, clear_noise_peer, NULL);
 		rcu_barrier();
+	} else if (action == PM_POST_HIBERNATION || action == PM_POST_SUSPEND) {
+		noise_ephemeral_pool_resume(&wg->ephemeral_pool);
+		if (netdev_pub(wg)->flags & IFF_UP)
+			noise_ephemeral_pool_refill(&wg->ephemeral_pool);
 	}
 	return 0;
 }
@@ -81,7 +86,7 @@ static int stop(struct net_device *dev)
 {
 	struct wireguard_device *wg = netdev_priv(dev);
 	peer_for_each(wg, stop_peer, NULL);
-	skb_queue_purge(&wg->incoming_handshakes);
+	packet_purge_handshake_queues(wg);
 	socket_uninit(wg);
 	return 0;
 }
@@ -148,7 +153,9 @@ static netdev_tx_t xmit(struct sk_buff *skb, struct net_device *dev)
 	while (skb_queue_len(&peer->tx_packet_queue) > MAX_QUEUED_OUTGOING_PACKETS)
 		dev_kfree_skb(skb_dequeue(&peer->tx_packet_queue));
 
-	if (!skb_is_gso(skb))
+	/* GSO super-packets are kept whole and segmented by the encryption worker, unless
+	 * they come from an untrusted source, in which case we can't rely on gso_segs. */
+	if (!skb_is_gso(skb) || (skb_shinfo(skb)->gso_segs && !(skb_shinfo(skb)->gso_type & SKB_GSO_DODGY)))
 		skb->next = NULL;
 	else {
 		struct sk_buff *segs = skb_gso_segment(skb, 0);
@@ -199,6 +206,8 @@ static int ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 		return config_get_device(wg, ifr->ifr_ifru.ifru_data);
 	case WG_SET_DEVICE:
 		return config_set_device(wg, ifr->ifr_ifru.ifru_data);
+	case WG_GET_STATS:
+		return config_get_stats(wg, ifr->ifr_ifru.ifru_data);
 	}
 	return -EINVAL;
 }
@@ -217,16 +226,24 @@ static void destruct(struct net_device *dev)
 
 	mutex_lock(&wg->device_update_lock);
 	peer_remove_all(wg);
+	/* peer_remove_all waits for the last peer to be freed, but that peer's RCU callback might
+	 * still be on its way out of wake_up, and this module's code must outlive it too. */
+	rcu_barrier();
 	wg->incoming_port = 0;
+	timers_uninit_device(wg);
 	destroy_workqueue(wg->workqueue);
+	destroy_workqueue(wg->handshake_receive_wq);
 #ifdef CONFIG_WIREGUARD_PARALLEL
-	padata_free(wg->parallel_send);
-	padata_free(wg->parallel_receive);
 	destroy_workqueue(wg->parallelqueue);
+	packet_uninit_device_queues(wg);
 #endif
 	routing_table_free(&wg->peer_routing_table);
+	index_hashtable_uninit(&wg->index_hashtable);
+	pubkey_hashtable_uninit(&wg->peer_hashtable);
+	gro_cells_destroy(&wg->gro_cells);
 	memzero_explicit(&wg->static_identity, sizeof(struct noise_static_identity));
-	skb_queue_purge(&wg->incoming_handshakes);
+	noise_ephemeral_pool_uninit(&wg->ephemeral_pool);
+	packet_uninit_handshake_queues(wg);
 	socket_uninit(wg);
 	cookie_checker_uninit(&wg->cookie_checker);
 #ifdef CONFIG_PM_SLEEP
@@ -280,72 +297,98 @@ static int newlink(struct net *src_net, struct net_device *dev, struct nlattr *t
 	init_rwsem(&wg->static_identity.lock);
 	mutex_init(&wg->socket_update_lock);
 	mutex_init(&wg->device_update_lock);
-	skb_queue_head_init(&wg->incoming_handshakes);
-	INIT_WORK(&wg->incoming_handshakes_work, packet_process_queued_handshake_packets);
-	pubkey_hashtable_init(&wg->peer_hashtable);
-	index_hashtable_init(&wg->index_hashtable);
-	routing_table_init(&wg->peer_routing_table);
+	noise_ephemeral_pool_init(&wg->ephemeral_pool);
 	INIT_LIST_HEAD(&wg->peer_list);
+	atomic_set(&wg->peers_alive, 0);
+	init_waitqueue_head(&wg->peers_freed);
+	timers_init_device(wg);
 
 	dev->tstats = netdev_alloc_pcpu_stats(struct pcpu_sw_netstats);
 	if (!dev->tstats)
 		goto error_1;
 
-	wg->workqueue = alloc_workqueue(KBUILD_MODNAME "-%s", WQ_UNBOUND | WQ_FREEZABLE, 0, dev->name);
-	if (!wg->workqueue)
+	if (pubkey_hashtable_init(&wg->peer_hashtable) < 0)
 		goto error_2;
 
-#ifdef CONFIG_WIREGUARD_PARALLEL
-	wg->parallelqueue = alloc_workqueue(KBUILD_MODNAME "-crypt-%s", WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 1, dev->name);
-	if (!wg->parallelqueue)
+	if (index_hashtable_init(&wg->index_hashtable) < 0)
 		goto error_3;
 
-	wg->parallel_send = padata_alloc_possible(wg->parallelqueue);
-	if (!wg->parallel_send)
+	if (routing_table_init(&wg->peer_routing_table) < 0)
 		goto error_4;
-	padata_start(wg->parallel_send);
 
-	wg->parallel_receive = padata_alloc_possible(wg->parallelqueue);
-	if (!wg->parallel_receive)
+	ret = gro_cells_init(&wg->gro_cells, dev);
+	if (ret < 0)
 		goto error_5;
-	padata_start(wg->parallel_receive);
+
+	ret = -ENOMEM;
+	wg->workqueue = alloc_workqueue(KBUILD_MODNAME "-%s", WQ_UNBOUND | WQ_FREEZABLE, 0, dev->name);
+	if (!wg->workqueue)
+		goto error_6;
+
+	wg->handshake_receive_wq = alloc_workqueue(KBUILD_MODNAME "-handshake-%s", WQ_CPU_INTENSIVE | WQ_FREEZABLE, 0, dev->name);
+	if (!wg->handshake_receive_wq)
+		goto error_7;
+
+	ret = packet_init_handshake_queues(wg);
+	if (ret < 0)
+		goto error_8;
+
+#ifdef CONFIG_WIREGUARD_PARALLEL
+	ret = -ENOMEM;
+	wg->parallelqueue = alloc_workqueue(KBUILD_MODNAME "-crypt-%s", WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 1, dev->name);
+	if (!wg->parallelqueue)
+		goto error_9;
+
+	ret = packet_init_device_queues(wg);
+	if (ret < 0)
+		goto error_10;
 #endif
 
 	ret = cookie_checker_init(&wg->cookie_checker, wg);
 	if (ret < 0)
-		goto error_6;
+		goto error_11;
 
 #ifdef CONFIG_PM_SLEEP
 	wg->clear_peers_on_suspend.notifier_call = suspending_clear_noise_peers;
 	ret = register_pm_notifier(&wg->clear_peers_on_suspend);
 	if (ret < 0)
-		goto error_7;
+		goto error_12;
 #endif
 
 	ret = register_netdevice(dev);
 	if (ret < 0)
-		goto error_8;
+		goto error_13;
 
 	pr_debug("Device %s has been created\n", dev->name);
 
 	return 0;
 
-error_8:
+error_13:
 #ifdef CONFIG_PM_SLEEP
 	unregister_pm_notifier(&wg->clear_peers_on_suspend);
-error_7:
+error_12:
 #endif
 	cookie_checker_uninit(&wg->cookie_checker);
-error_6:
+error_11:
 #ifdef CONFIG_WIREGUARD_PARALLEL
-	padata_free(wg->parallel_receive);
-error_5:
-	padata_free(wg->parallel_send);
-error_4:
+	packet_uninit_device_queues(wg);
+error_10:
 	destroy_workqueue(wg->parallelqueue);
-error_3:
+error_9:
 #endif
+	packet_uninit_handshake_queues(wg);
+error_8:
+	destroy_workqueue(wg->handshake_receive_wq);
+error_7:
 	destroy_workqueue(wg->workqueue);
+error_6:
+	gro_cells_destroy(&wg->gro_cells);
+error_5:
+	routing_table_free(&wg->peer_routing_table);
+error_4:
+	index_hashtable_uninit(&wg->index_hashtable);
+error_3:
+	pubkey_hashtable_uninit(&wg->peer_hashtable);
 error_2:
 	free_percpu(dev->tstats);
 error_1:
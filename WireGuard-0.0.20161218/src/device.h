@@ -7,30 +7,41 @@
 #include "routingtable.h"
 #include "hashtables.h"
 #include "cookie.h"
+#include "packets.h"
+#include "timers.h"
 
 #include <linux/types.h>
 #include <linux/netdevice.h>
 #include <linux/workqueue.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
 #include <linux/net.h>
-#include <linux/padata.h>
 #include <linux/notifier.h>
+#include <net/gro_cells.h>
 
 struct wireguard_device {
 	struct sock __rcu *sock4, *sock6;
 	u16 incoming_port;
 	struct net *creating_net;
 	struct workqueue_struct *workqueue;
+	struct workqueue_struct *handshake_receive_wq;
+#ifdef CONFIG_WIREGUARD_PARALLEL
 	struct workqueue_struct *parallelqueue;
-	struct padata_instance *parallel_send, *parallel_receive;
+	struct crypt_queue encrypt_queue, decrypt_queue;
+#endif
 	struct noise_static_identity static_identity;
-	struct sk_buff_head incoming_handshakes;
-	struct work_struct incoming_handshakes_work;
+	struct noise_ephemeral_pool ephemeral_pool;
+	struct gro_cells gro_cells;
+	struct handshake_worker __percpu *incoming_handshakes;
+	atomic_t incoming_handshake_count;
 	struct cookie_checker cookie_checker;
 	struct pubkey_hashtable peer_hashtable;
 	struct index_hashtable index_hashtable;
 	struct routing_table peer_routing_table;
 	struct list_head peer_list;
+	atomic_t peers_alive;
+	wait_queue_head_t peers_freed;
+	struct timer_wheel timer_wheel;
 	struct mutex device_update_lock;
 	struct mutex socket_update_lock;
 #ifdef CONFIG_PM_SLEEP
@@ -5,33 +5,147 @@
 #include "noise.h"
 #include "crypto/siphash.h"
 
-#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/random.h>
 
-static inline struct hlist_head *pubkey_bucket(struct pubkey_hashtable *table, const u8 pubkey[NOISE_PUBLIC_KEY_LEN])
+static struct hashtable_buckets *hashtable_buckets_alloc(unsigned int bits, unsigned int node)
+{
+	size_t size = sizeof(struct hashtable_buckets) + (sizeof(struct hlist_head) << bits);
+	struct hashtable_buckets *buckets = kzalloc(size, GFP_KERNEL | __GFP_NOWARN);
+
+	if (!buckets)
+		buckets = vzalloc(size);
+	if (!buckets)
+		return NULL;
+	buckets->mask = (1U << bits) - 1;
+	buckets->node = node;
+	return buckets;
+}
+
+/* We aim for a load factor between 1/8 and 1 entry per bucket, growing only on insertion
+ * and shrinking only on removal, so that a table sized up front for a bulk insertion
+ * doesn't shrink back down as it is being filled. */
+static inline bool hashtable_wants_grow(struct hashtable_buckets *buckets, unsigned int entries, unsigned int max_bits)
+{
+	return entries > buckets->mask + 1 && buckets->mask + 1 < (1U << max_bits);
+}
+
+static inline bool hashtable_wants_shrink(struct hashtable_buckets *buckets, unsigned int entries, unsigned int min_bits)
+{
+	return entries < (buckets->mask + 1) / 8 && buckets->mask + 1 > (1U << min_bits);
+}
+
+static inline unsigned int hashtable_bits_for(unsigned int entries, unsigned int min_bits, unsigned int max_bits)
+{
+	return clamp_t(unsigned int, fls(entries), min_bits, max_bits);
+}
+
+#define hashtable_for_each_rcu(node, buckets, hash) \
+	for (node = rcu_dereference_raw(hlist_first_rcu(&(buckets)->heads[(hash) & (buckets)->mask])); node; node = rcu_dereference_raw(hlist_next_rcu(node)))
+
+enum { PUBKEY_HASHTABLE_MIN_BITS = 8, PUBKEY_HASHTABLE_MAX_BITS = 20 };
+
+static inline struct wireguard_peer *pubkey_entry(struct hlist_node *node, unsigned int which)
+{
+	return container_of(node - which, struct wireguard_peer, pubkey_hash[0]);
+}
+
+static inline u32 pubkey_hash(struct pubkey_hashtable *table, const u8 pubkey[NOISE_PUBLIC_KEY_LEN])
 {
 	/* siphash gives us a secure 64bit number based on a random key. Since the bits are
 	 * uniformly distributed, we can then mask off to get the bits we need. */
-	return &table->hashtable[siphash(pubkey, NOISE_PUBLIC_KEY_LEN, table->key) & (HASH_SIZE(table->hashtable) - 1)];
+	return siphash(pubkey, NOISE_PUBLIC_KEY_LEN, table->key);
 }
 
-void pubkey_hashtable_init(struct pubkey_hashtable *table)
+/* Writers all hold the mutex, which lets us resize synchronously, and wait for readers
+ * of the old buckets to finish before their nodes can be reused by the next resize. */
+static void pubkey_hashtable_resize(struct pubkey_hashtable *table, unsigned int entries)
 {
+	struct hashtable_buckets *old_buckets, *new_buckets;
+	struct wireguard_peer *peer;
+	struct hlist_node *node;
+	unsigned int bits, i;
+
+	old_buckets = rcu_dereference_protected(table->buckets, lockdep_is_held(&table->lock));
+	bits = hashtable_bits_for(entries, PUBKEY_HASHTABLE_MIN_BITS, PUBKEY_HASHTABLE_MAX_BITS);
+	if (old_buckets->mask + 1 == 1U << bits)
+		return;
+
+	new_buckets = hashtable_buckets_alloc(bits, !old_buckets->node);
+	if (!new_buckets)
+		return; /* Longer chains are still correct, so we just try again next time. */
+
+	for (i = 0; i <= old_buckets->mask; ++i) {
+		hlist_for_each(node, &old_buckets->heads[i]) {
+			peer = pubkey_entry(node, old_buckets->node);
+			hlist_add_head_rcu(&peer->pubkey_hash[new_buckets->node], &new_buckets->heads[pubkey_hash(table, peer->handshake.remote_static) & new_buckets->mask]);
+			node->pprev = NULL;
+		}
+	}
+	rcu_assign_pointer(table->buckets, new_buckets);
+
+	synchronize_rcu();
+	kvfree(old_buckets);
+}
+
+int pubkey_hashtable_init(struct pubkey_hashtable *table)
+{
+	struct hashtable_buckets *buckets = hashtable_buckets_alloc(PUBKEY_HASHTABLE_MIN_BITS, 0);
+
+	if (!buckets)
+		return -ENOMEM;
+	RCU_INIT_POINTER(table->buckets, buckets);
 	get_random_bytes(table->key, sizeof(table->key));
-	hash_init(table->hashtable);
 	mutex_init(&table->lock);
+	table->entries = 0;
+	return 0;
+}
+
+void pubkey_hashtable_uninit(struct pubkey_hashtable *table)
+{
+	kvfree(rcu_dereference_protected(table->buckets, true));
+}
+
+/* Sizes the table up front for count more peers, so that adding a large list of them
+ * doesn't go through a resize and a grace period at every doubling. */
+void pubkey_hashtable_reserve(struct pubkey_hashtable *table, unsigned int count)
+{
+	struct hashtable_buckets *buckets;
+
+	mutex_lock(&table->lock);
+	buckets = rcu_dereference_protected(table->buckets, lockdep_is_held(&table->lock));
+	count = min_t(unsigned int, count, 1U << PUBKEY_HASHTABLE_MAX_BITS);
+	if (hashtable_wants_grow(buckets, table->entries + count, PUBKEY_HASHTABLE_MAX_BITS))
+		pubkey_hashtable_resize(table, table->entries + count);
+	mutex_unlock(&table->lock);
 }
 
 void pubkey_hashtable_add(struct pubkey_hashtable *table, struct wireguard_peer *peer)
 {
+	struct hashtable_buckets *buckets;
+
 	mutex_lock(&table->lock);
-	hlist_add_head_rcu(&peer->pubkey_hash, pubkey_bucket(table, peer->handshake.remote_static));
+	buckets = rcu_dereference_protected(table->buckets, lockdep_is_held(&table->lock));
+	hlist_add_head_rcu(&peer->pubkey_hash[buckets->node], &buckets->heads[pubkey_hash(table, peer->handshake.remote_static) & buckets->mask]);
+	if (hashtable_wants_grow(buckets, ++table->entries, PUBKEY_HASHTABLE_MAX_BITS))
+		pubkey_hashtable_resize(table, table->entries);
 	mutex_unlock(&table->lock);
 }
 
 void pubkey_hashtable_remove(struct pubkey_hashtable *table, struct wireguard_peer *peer)
 {
+	struct hashtable_buckets *buckets;
+
 	mutex_lock(&table->lock);
-	hlist_del_init_rcu(&peer->pubkey_hash);
+	buckets = rcu_dereference_protected(table->buckets, lockdep_is_held(&table->lock));
+	if (!hlist_unhashed(&peer->pubkey_hash[buckets->node])) {
+		hlist_del_init_rcu(&peer->pubkey_hash[buckets->node]);
+		if (hashtable_wants_shrink(buckets, --table->entries, PUBKEY_HASHTABLE_MIN_BITS))
+			pubkey_hashtable_resize(table, table->entries);
+	}
 	mutex_unlock(&table->lock);
 }
 
@@ -39,8 +153,13 @@ void pubkey_hashtable_remove(struct pubkey_hashtable *table, struct wireguard_pe
 struct wireguard_peer *pubkey_hashtable_lookup(struct pubkey_hashtable *table, const u8 pubkey[NOISE_PUBLIC_KEY_LEN])
 {
 	struct wireguard_peer *iter_peer, *peer = NULL;
+	struct hashtable_buckets *buckets;
+	struct hlist_node *node;
+
 	rcu_read_lock();
-	hlist_for_each_entry_rcu(iter_peer, pubkey_bucket(table, pubkey), pubkey_hash) {
+	buckets = rcu_dereference(table->buckets);
+	hashtable_for_each_rcu(node, buckets, pubkey_hash(table, pubkey)) {
+		iter_peer = pubkey_entry(node, buckets->node);
 		if (!memcmp(pubkey, iter_peer->handshake.remote_static, NOISE_PUBLIC_KEY_LEN)) {
 			peer = iter_peer;
 			break;
@@ -51,51 +170,153 @@ struct wireguard_peer *pubkey_hashtable_lookup(struct pubkey_hashtable *table, c
 	return peer;
 }
 
-static inline struct hlist_head *index_bucket(struct index_hashtable *table, const __le32 index)
+enum { INDEX_HASHTABLE_MIN_BITS = 10, INDEX_HASHTABLE_MAX_BITS = 20, INDEX_HASHTABLE_RESIZE_CHUNK = 256 };
+
+static inline struct index_hashtable_entry *index_entry(struct hlist_node *node, unsigned int which)
 {
-	/* Since the indices are random and thus all bits are uniformly distributed,
-	 * we can find its bucket simply by masking. */
-	return &table->hashtable[(__force u32)index & (HASH_SIZE(table->hashtable) - 1)];
+	return container_of(node - which, struct index_hashtable_entry, index_hash[0]);
+}
+
+/* While a resize is under way, entries in the buckets it has already gone through are
+ * linked into the new buckets too, and so must be added there and removed from there. */
+static inline struct hashtable_buckets *index_resize_buckets(struct index_hashtable *table, struct hashtable_buckets *buckets, __le32 index)
+{
+	if (table->resize_buckets && ((__force u32)index & buckets->mask) < table->resize_pos)
+		return table->resize_buckets;
+	return NULL;
+}
+
+static void index_hashtable_resize(struct work_struct *work)
+{
+	struct index_hashtable *table = container_of(work, struct index_hashtable, resize_work);
+	struct hashtable_buckets *old_buckets, *new_buckets;
+	struct index_hashtable_entry *entry;
+	struct hlist_node *node;
+	unsigned int bits, i, end;
+
+	/* Only this work item ever replaces the buckets, so they can't change under us while unlocked. */
+	spin_lock_bh(&table->lock);
+	old_buckets = rcu_dereference_protected(table->buckets, lockdep_is_held(&table->lock));
+	bits = hashtable_bits_for(table->entries, INDEX_HASHTABLE_MIN_BITS, INDEX_HASHTABLE_MAX_BITS);
+	spin_unlock_bh(&table->lock);
+	if (old_buckets->mask + 1 == 1U << bits)
+		return;
+
+	new_buckets = hashtable_buckets_alloc(bits, !old_buckets->node);
+	if (!new_buckets)
+		return;
+
+	spin_lock_bh(&table->lock);
+	table->resize_buckets = new_buckets;
+	table->resize_pos = 0;
+	spin_unlock_bh(&table->lock);
+
+	/* With a million entries, linking them all in at once would keep the lock, and with it
+	 * bottom halves on this CPU and every handshake on the others, for milliseconds. */
+	for (i = 0; i <= old_buckets->mask; i = end) {
+		end = min(i + INDEX_HASHTABLE_RESIZE_CHUNK, old_buckets->mask + 1);
+		spin_lock_bh(&table->lock);
+		for (; i < end; ++i) {
+			hlist_for_each(node, &old_buckets->heads[i]) {
+				entry = index_entry(node, old_buckets->node);
+				hlist_add_head_rcu(&entry->index_hash[new_buckets->node], &new_buckets->heads[(__force u32)entry->index & new_buckets->mask]);
+			}
+		}
+		table->resize_pos = end;
+		spin_unlock_bh(&table->lock);
+		cond_resched();
+	}
+
+	/* Readers of the old chains only follow next, which nothing changes from now on. */
+	spin_lock_bh(&table->lock);
+	rcu_assign_pointer(table->buckets, new_buckets);
+	table->resize_buckets = NULL;
+	if (hashtable_wants_grow(new_buckets, table->entries, INDEX_HASHTABLE_MAX_BITS) || hashtable_wants_shrink(new_buckets, table->entries, INDEX_HASHTABLE_MIN_BITS))
+		schedule_work(&table->resize_work);
+	spin_unlock_bh(&table->lock);
+
+	synchronize_rcu();
+	kvfree(old_buckets);
 }
 
-void index_hashtable_init(struct index_hashtable *table)
+int index_hashtable_init(struct index_hashtable *table)
 {
+	struct hashtable_buckets *buckets = hashtable_buckets_alloc(INDEX_HASHTABLE_MIN_BITS, 0);
+
+	if (!buckets)
+		return -ENOMEM;
+	RCU_INIT_POINTER(table->buckets, buckets);
+	table->resize_buckets = NULL;
+	table->resize_pos = 0;
 	get_random_bytes(table->key, sizeof(table->key));
-	hash_init(table->hashtable);
 	spin_lock_init(&table->lock);
+	table->entries = 0;
+	INIT_WORK(&table->resize_work, index_hashtable_resize);
+	return 0;
+}
+
+void index_hashtable_uninit(struct index_hashtable *table)
+{
+	cancel_work_sync(&table->resize_work);
+	kvfree(rcu_dereference_protected(table->buckets, true));
+}
+
+/* Whether an entry is in the table is kept in hashed rather than read off its nodes, as
+ * the nodes that a resize left behind in the old buckets are never unlinked. */
+static void __index_hashtable_remove(struct index_hashtable *table, struct hashtable_buckets *buckets, struct index_hashtable_entry *entry)
+{
+	struct hashtable_buckets *resize_buckets;
+
+	if (!entry->hashed)
+		return;
+	resize_buckets = index_resize_buckets(table, buckets, entry->index);
+	hlist_del_rcu(&entry->index_hash[buckets->node]);
+	if (resize_buckets)
+		hlist_del_rcu(&entry->index_hash[resize_buckets->node]);
+	entry->hashed = false;
+	--table->entries;
 }
 
 __le32 index_hashtable_insert(struct index_hashtable *table, struct index_hashtable_entry *entry)
 {
-	struct index_hashtable_entry *existing_entry;
+	struct hashtable_buckets *buckets, *resize_buckets;
+	struct hlist_node *node;
 	u32 counter = get_random_int();
 
-	spin_lock(&table->lock);
-	hlist_del_init_rcu(&entry->index_hash);
-	spin_unlock(&table->lock);
+	spin_lock_bh(&table->lock);
+	__index_hashtable_remove(table, rcu_dereference_protected(table->buckets, lockdep_is_held(&table->lock)), entry);
+	spin_unlock_bh(&table->lock);
 
 	rcu_read_lock();
 
 search_unused_slot:
 	/* First we try to find an unused slot, randomly, while unlocked. */
 	entry->index = (__force __le32)siphash_2u32(get_random_int(), counter++, table->key);
-	hlist_for_each_entry_rcu(existing_entry, index_bucket(table, entry->index), index_hash) {
-		if (existing_entry->index == entry->index)
+	buckets = rcu_dereference(table->buckets);
+	hashtable_for_each_rcu(node, buckets, (__force u32)entry->index) {
+		if (index_entry(node, buckets->node)->index == entry->index)
 			goto search_unused_slot; /* If it's already in use, we continue searching. */
 	}
 
 	/* Once we've found an unused slot, we lock it, and then double-check
-	 * that nobody else stole it from us. */
-	spin_lock(&table->lock);
-	hlist_for_each_entry_rcu(existing_entry, index_bucket(table, entry->index), index_hash) {
-		if (existing_entry->index == entry->index) {
-			spin_unlock(&table->lock);
+	 * that nobody else stole it from us, possibly in a newly resized table. */
+	spin_lock_bh(&table->lock);
+	buckets = rcu_dereference_protected(table->buckets, lockdep_is_held(&table->lock));
+	hashtable_for_each_rcu(node, buckets, (__force u32)entry->index) {
+		if (index_entry(node, buckets->node)->index == entry->index) {
+			spin_unlock_bh(&table->lock);
 			goto search_unused_slot; /* If it was stolen, we start over. */
 		}
 	}
 	/* Otherwise, we know we have it exclusively (since we're locked), so we insert. */
-	hlist_add_head_rcu(&entry->index_hash, index_bucket(table, entry->index));
-	spin_unlock(&table->lock);
+	hlist_add_head_rcu(&entry->index_hash[buckets->node], &buckets->heads[(__force u32)entry->index & buckets->mask]);
+	resize_buckets = index_resize_buckets(table, buckets, entry->index);
+	if (resize_buckets)
+		hlist_add_head_rcu(&entry->index_hash[resize_buckets->node], &resize_buckets->heads[(__force u32)entry->index & resize_buckets->mask]);
+	entry->hashed = true;
+	if (hashtable_wants_grow(buckets, ++table->entries, INDEX_HASHTABLE_MAX_BITS))
+		schedule_work(&table->resize_work);
+	spin_unlock_bh(&table->lock);
 
 	rcu_read_unlock();
 
@@ -104,26 +325,43 @@ search_unused_slot:
 
 void index_hashtable_replace(struct index_hashtable *table, struct index_hashtable_entry *old, struct index_hashtable_entry *new)
 {
-	spin_lock(&table->lock);
+	struct hashtable_buckets *buckets, *resize_buckets;
+
+	spin_lock_bh(&table->lock);
+	buckets = rcu_dereference_protected(table->buckets, lockdep_is_held(&table->lock));
 	new->index = old->index;
-	hlist_replace_rcu(&old->index_hash, &new->index_hash);
-	INIT_HLIST_NODE(&old->index_hash);
-	spin_unlock(&table->lock);
+	resize_buckets = index_resize_buckets(table, buckets, old->index);
+	hlist_replace_rcu(&old->index_hash[buckets->node], &new->index_hash[buckets->node]);
+	if (resize_buckets)
+		hlist_replace_rcu(&old->index_hash[resize_buckets->node], &new->index_hash[resize_buckets->node]);
+	new->hashed = old->hashed;
+	old->hashed = false;
+	spin_unlock_bh(&table->lock);
 }
 
 void index_hashtable_remove(struct index_hashtable *table, struct index_hashtable_entry *entry)
 {
-	spin_lock(&table->lock);
-	hlist_del_init_rcu(&entry->index_hash);
-	spin_unlock(&table->lock);
+	struct hashtable_buckets *buckets;
+
+	spin_lock_bh(&table->lock);
+	buckets = rcu_dereference_protected(table->buckets, lockdep_is_held(&table->lock));
+	__index_hashtable_remove(table, buckets, entry);
+	if (hashtable_wants_shrink(buckets, table->entries, INDEX_HASHTABLE_MIN_BITS))
+		schedule_work(&table->resize_work);
+	spin_unlock_bh(&table->lock);
 }
 
 /* Returns a strong reference to a entry->peer */
 struct index_hashtable_entry *index_hashtable_lookup(struct index_hashtable *table, const enum index_hashtable_type type_mask, const __le32 index)
 {
 	struct index_hashtable_entry *iter_entry, *entry = NULL;
+	struct hashtable_buckets *buckets;
+	struct hlist_node *node;
+
 	rcu_read_lock();
-	hlist_for_each_entry_rcu(iter_entry, index_bucket(table, index), index_hash) {
+	buckets = rcu_dereference(table->buckets);
+	hashtable_for_each_rcu(node, buckets, (__force u32)index) {
+		iter_entry = index_entry(node, buckets->node);
 		if (iter_entry->index == index && (iter_entry->type & type_mask)) {
 			entry = iter_entry;
 			break;
@@ -137,3 +375,5 @@ struct index_hashtable_entry *index_hashtable_lookup(struct index_hashtable *tab
 	rcu_read_unlock();
 	return entry;
 }
+
+#include "selftest/hashtables.h"
@@ -6,26 +6,45 @@
 #include "messages.h"
 #include "crypto/siphash.h"
 
-#include <linux/hashtable.h>
+#include <linux/rculist.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 struct wireguard_peer;
 
+/* A bucket array that can be replaced under RCU. Entries have two hlist_nodes, and
+ * node says which one chains them through these buckets, so that a resize can link
+ * every entry into a new array without touching the chains readers may be walking. */
+struct hashtable_buckets {
+	unsigned int mask;
+	unsigned int node;
+	struct hlist_head heads[];
+};
+
 struct pubkey_hashtable {
-	DECLARE_HASHTABLE(hashtable, 8);
+	struct hashtable_buckets __rcu *buckets;
 	siphash_key_t key;
 	struct mutex lock;
+	unsigned int entries;
 };
 
-void pubkey_hashtable_init(struct pubkey_hashtable *table);
+int pubkey_hashtable_init(struct pubkey_hashtable *table);
+void pubkey_hashtable_uninit(struct pubkey_hashtable *table);
+void pubkey_hashtable_reserve(struct pubkey_hashtable *table, unsigned int count);
 void pubkey_hashtable_add(struct pubkey_hashtable *table, struct wireguard_peer *peer);
 void pubkey_hashtable_remove(struct pubkey_hashtable *table, struct wireguard_peer *peer);
 struct wireguard_peer *pubkey_hashtable_lookup(struct pubkey_hashtable *table, const u8 pubkey[NOISE_PUBLIC_KEY_LEN]);
 
+/* The lock is taken with bottom halves off, as keypairs are removed from the receive path. */
 struct index_hashtable {
-	DECLARE_HASHTABLE(hashtable, 10);
+	struct hashtable_buckets __rcu *buckets;
+	struct hashtable_buckets *resize_buckets;
+	unsigned int resize_pos;
 	siphash_key_t key;
 	spinlock_t lock;
+	unsigned int entries;
+	struct work_struct resize_work;
 };
 
 enum index_hashtable_type {
@@ -35,14 +54,20 @@ enum index_hashtable_type {
 
 struct index_hashtable_entry {
 	struct wireguard_peer *peer;
-	struct hlist_node index_hash;
+	struct hlist_node index_hash[2];
 	enum index_hashtable_type type;
 	__le32 index;
+	bool hashed;
 };
-void index_hashtable_init(struct index_hashtable *table);
+int index_hashtable_init(struct index_hashtable *table);
+void index_hashtable_uninit(struct index_hashtable *table);
 __le32 index_hashtable_insert(struct index_hashtable *table, struct index_hashtable_entry *entry);
 void index_hashtable_replace(struct index_hashtable *table, struct index_hashtable_entry *old, struct index_hashtable_entry *new);
 void index_hashtable_remove(struct index_hashtable *table, struct index_hashtable_entry *entry);
 struct index_hashtable_entry *index_hashtable_lookup(struct index_hashtable *table, const enum index_hashtable_type type_mask, const __le32 index);
 
+#ifdef DEBUG
+bool index_hashtable_selftest(void);
+#endif
+
 #endif
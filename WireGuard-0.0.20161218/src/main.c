@@ -18,21 +18,21 @@ static int __init mod_init(void)
 {
 	int ret;
 
+	/* The SIMD implementations are selected first so that the self-tests exercise them. */
+	chacha20poly1305_init();
+	blake2s_fpu_init();
+	curve25519_init();
+
 #ifdef DEBUG
-	if (!routing_table_selftest() || !packet_counter_selftest() || !curve25519_selftest() || !chacha20poly1305_selftest() || !blake2s_selftest() || !siphash_selftest())
+	if (!routing_table_selftest() || !index_hashtable_selftest() || !packet_counter_selftest() || !ratelimiter_selftest() || !curve25519_selftest() || !chacha20poly1305_selftest() || !blake2s_selftest() || !siphash_selftest())
 		return -ENOTRECOVERABLE;
 #endif
-	chacha20poly1305_init();
 	noise_init();
 
-	ret = ratelimiter_module_init();
-	if (ret < 0)
-		return ret;
-
 #ifdef CONFIG_WIREGUARD_PARALLEL
 	ret = packet_init_data_caches();
 	if (ret < 0)
-		goto err_packet;
+		return ret;
 #endif
 
 	ret = device_init();
@@ -47,9 +47,7 @@ static int __init mod_init(void)
 err_device:
 #ifdef CONFIG_WIREGUARD_PARALLEL
 	packet_deinit_data_caches();
-err_packet:
 #endif
-	ratelimiter_module_deinit();
 	return ret;
 }
 
@@ -59,7 +57,6 @@ static void __exit mod_exit(void)
 #ifdef CONFIG_WIREGUARD_PARALLEL
 	packet_deinit_data_caches();
 #endif
-	ratelimiter_module_deinit();
 	pr_debug("WireGuard has been unloaded\n");
 }
 
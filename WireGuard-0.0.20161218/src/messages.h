@@ -33,7 +33,7 @@ enum cookie_values {
 
 enum counter_values {
 	COUNTER_BITS_TOTAL = 2048,
-	COUNTER_REDUNDANT_BITS = BITS_PER_LONG,
+	COUNTER_REDUNDANT_BITS = 32,
 	COUNTER_WINDOW_SIZE = COUNTER_BITS_TOTAL - COUNTER_REDUNDANT_BITS
 };
 
@@ -50,7 +50,10 @@ enum limits {
 	MAX_TIMER_HANDSHAKES = (90 * HZ) / REKEY_TIMEOUT,
 	MAX_QUEUED_INCOMING_HANDSHAKES = 4096,
 	MAX_BURST_INCOMING_HANDSHAKES = 16,
-	MAX_QUEUED_OUTGOING_PACKETS = 1024
+	MAX_BURST_EXPIRED_PEERS = 64,
+	MAX_QUEUED_OUTGOING_PACKETS = 1024,
+	MAX_QUEUED_INCOMING_PACKETS = 1024,
+	MAX_GRO_TRAIN_LENGTH = 64
 };
 
 enum message_type {
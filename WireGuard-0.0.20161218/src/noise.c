@@ -35,6 +35,21 @@ void noise_init(void)
 	blake2s(handshake_psk_name_hash, handshake_psk_name, NULL, NOISE_HASH_LEN, sizeof(handshake_psk_name), 0);
 }
 
+/* The static-static DH only depends on our private key and the peer's public key, so rather than
+ * doing it on every handshake, we keep it along with the public key of ours that it was worked
+ * out with, and only do it again once a handshake finds that our key has changed since. This
+ * must be called with the static identity held for reading and the handshake for writing. */
+static void refresh_static_static(struct noise_handshake *handshake)
+{
+	if (!memcmp(handshake->precomputed_static_public, handshake->static_identity->static_public, NOISE_PUBLIC_KEY_LEN))
+		return;
+	if (handshake->static_identity->has_identity)
+		curve25519(handshake->precomputed_static_static, handshake->static_identity->static_private, handshake->remote_static);
+	else
+		memset(handshake->precomputed_static_static, 0, NOISE_PUBLIC_KEY_LEN);
+	memcpy(handshake->precomputed_static_public, handshake->static_identity->static_public, NOISE_PUBLIC_KEY_LEN);
+}
+
 void noise_handshake_init(struct noise_handshake *handshake, struct noise_static_identity *static_identity, const u8 peer_public_key[NOISE_PUBLIC_KEY_LEN], struct wireguard_peer *peer)
 {
 	memset(handshake, 0, sizeof(struct noise_handshake));
@@ -44,6 +59,11 @@ void noise_handshake_init(struct noise_handshake *handshake, struct noise_static
 	memcpy(handshake->remote_static, peer_public_key, NOISE_PUBLIC_KEY_LEN);
 	handshake->static_identity = static_identity;
 	handshake->state = HANDSHAKE_ZEROED;
+	down_read(&static_identity->lock);
+	down_write(&handshake->lock);
+	refresh_static_static(handshake);
+	up_write(&handshake->lock);
+	up_read(&static_identity->lock);
 }
 
 void noise_handshake_clear(struct noise_handshake *handshake)
@@ -62,15 +82,39 @@ void noise_handshake_clear(struct noise_handshake *handshake)
 	index_hashtable_remove(&handshake->entry.peer->device->index_hashtable, &handshake->entry);
 }
 
+static void keypair_free_percpu_ref(struct percpu_ref *ref);
+
 static struct noise_keypair *keypair_create(struct wireguard_peer *peer)
 {
-	struct noise_keypair *keypair = kzalloc(sizeof(struct noise_keypair), GFP_KERNEL);
+	struct noise_keypair *keypair;
+
+	/* The sending and receiving keys must not share a cache line with each other or with the
+	 * members before them, and each key and its counter, which every packet uses, must fit in
+	 * the first 64 bytes of their key. */
+	BUILD_BUG_ON(IS_ENABLED(CONFIG_SMP) && (offsetof(struct noise_keypair, internal_id) + sizeof(u64) - 1) / SMP_CACHE_BYTES >= offsetof(struct noise_keypair, sending) / SMP_CACHE_BYTES);
+	BUILD_BUG_ON(IS_ENABLED(CONFIG_SMP) && (offsetof(struct noise_keypair, sending) + sizeof(struct noise_symmetric_key) - 1) / SMP_CACHE_BYTES >= offsetof(struct noise_keypair, receiving) / SMP_CACHE_BYTES);
+	BUILD_BUG_ON(offsetof(struct noise_symmetric_key, counter) + sizeof(atomic64_t) > 64);
+
+	keypair = kzalloc(sizeof(struct noise_keypair), GFP_KERNEL);
 	if (unlikely(!keypair))
 		return NULL;
+	/* This allocates a counter on every CPU for each new session, which is only affordable
+	 * because we are in process context, where percpu_ref_init may sleep, and because sessions
+	 * are created at most once per handshake, which is rate limited and, for a given peer,
+	 * happens every REKEY_AFTER_TIME at most. Meanwhile every packet takes a reference. */
+	if (unlikely(percpu_ref_init(&keypair->refcount, keypair_free_percpu_ref, 0, GFP_KERNEL))) {
+		kfree(keypair);
+		return NULL;
+	}
+	/* The keypair holds on to its peer, so that peer_remove_all can wait for both. */
+	keypair->entry.peer = peer_rcu_get(peer);
+	if (unlikely(!keypair->entry.peer)) {
+		percpu_ref_exit(&keypair->refcount);
+		kfree(keypair);
+		return NULL;
+	}
 	keypair->internal_id = atomic64_inc_return(&keypair_counter);
 	keypair->entry.type = INDEX_HASHTABLE_KEYPAIR;
-	keypair->entry.peer = peer;
-	kref_init(&keypair->refcount);
 	return keypair;
 }
 
@@ -78,13 +122,14 @@ static void keypair_free_rcu(struct rcu_head *rcu)
 {
 	struct noise_keypair *keypair = container_of(rcu, struct noise_keypair, rcu);
 	net_dbg_ratelimited("Keypair %Lu destroyed for peer %Lu\n", keypair->internal_id, keypair->entry.peer->internal_id);
+	percpu_ref_exit(&keypair->refcount);
+	peer_put(keypair->entry.peer);
 	kzfree(keypair);
 }
 
-static void keypair_free_kref(struct kref *kref)
+static void keypair_free_percpu_ref(struct percpu_ref *ref)
 {
-	struct noise_keypair *keypair = container_of(kref, struct noise_keypair, refcount);
-	index_hashtable_remove(&keypair->entry.peer->device->index_hashtable, &keypair->entry);
+	struct noise_keypair *keypair = container_of(ref, struct noise_keypair, refcount);
 	call_rcu(&keypair->rcu, keypair_free_rcu);
 }
 
@@ -92,13 +137,24 @@ void noise_keypair_put(struct noise_keypair *keypair)
 {
 	if (unlikely(!keypair))
 		return;
-	kref_put(&keypair->refcount, keypair_free_kref);
+	percpu_ref_put(&keypair->refcount);
+}
+
+/* Drops the reference held by a slot in noise_keypairs, which is the initial one, so the
+ * count goes back to being a single atomic, which can then reach zero. A keypair that has
+ * left its slot is of no more use to incoming packets, so its index goes away right now. */
+static void keypair_kill(struct noise_keypair *keypair)
+{
+	if (unlikely(!keypair))
+		return;
+	index_hashtable_remove(&keypair->entry.peer->device->index_hashtable, &keypair->entry);
+	percpu_ref_kill(&keypair->refcount);
 }
 
 struct noise_keypair *noise_keypair_get(struct noise_keypair *keypair)
 {
 	RCU_LOCKDEP_WARN(!rcu_read_lock_held(), "Calling noise_keypair_get without holding the RCU read lock.");
-	if (unlikely(!keypair || !kref_get_unless_zero(&keypair->refcount)))
+	if (unlikely(!keypair || !percpu_ref_tryget(&keypair->refcount)))
 		return NULL;
 	return keypair;
 }
@@ -109,13 +165,13 @@ void noise_keypairs_clear(struct noise_keypairs *keypairs)
 	mutex_lock(&keypairs->keypair_update_lock);
 	old = rcu_dereference_protected(keypairs->previous_keypair, lockdep_is_held(&keypairs->keypair_update_lock));
 	rcu_assign_pointer(keypairs->previous_keypair, NULL);
-	noise_keypair_put(old);
+	keypair_kill(old);
 	old = rcu_dereference_protected(keypairs->next_keypair, lockdep_is_held(&keypairs->keypair_update_lock));
 	rcu_assign_pointer(keypairs->next_keypair, NULL);
-	noise_keypair_put(old);
+	keypair_kill(old);
 	old = rcu_dereference_protected(keypairs->current_keypair, lockdep_is_held(&keypairs->keypair_update_lock));
 	rcu_assign_pointer(keypairs->current_keypair, NULL);
-	noise_keypair_put(old);
+	keypair_kill(old);
 	mutex_unlock(&keypairs->keypair_update_lock);
 }
 
@@ -139,13 +195,13 @@ static void add_new_keypair(struct noise_keypairs *keypairs, struct noise_keypai
 			 * might be a bit less robust. Something to think about and decide on. */
 			rcu_assign_pointer(keypairs->next_keypair, NULL);
 			rcu_assign_pointer(keypairs->previous_keypair, next_keypair);
-			noise_keypair_put(current_keypair);
+			keypair_kill(current_keypair);
 		} else	/* If there wasn't an existing next keypair, we replace the
 			 * previous with the current one. */
 			rcu_assign_pointer(keypairs->previous_keypair, current_keypair);
 		/* At this point we can get rid of the old previous keypair, and set up
 		 * the new keypair. */
-		noise_keypair_put(previous_keypair);
+		keypair_kill(previous_keypair);
 		rcu_assign_pointer(keypairs->current_keypair, new_keypair);
 	} else {
 		/* If we're the responder, it means we can't use the new keypair until
@@ -153,9 +209,9 @@ static void add_new_keypair(struct noise_keypairs *keypairs, struct noise_keypai
 		 * the existing previous one, the possibly existing next one, and slide
 		 * in the new next one. */
 		rcu_assign_pointer(keypairs->next_keypair, new_keypair);
-		noise_keypair_put(next_keypair);
+		keypair_kill(next_keypair);
 		rcu_assign_pointer(keypairs->previous_keypair, NULL);
-		noise_keypair_put(previous_keypair);
+		keypair_kill(previous_keypair);
 	}
 	mutex_unlock(&keypairs->keypair_update_lock);
 }
@@ -175,7 +231,7 @@ bool noise_received_with_keypair(struct noise_keypairs *keypairs, struct noise_k
 		 * the old previous. */
 		old_keypair = rcu_dereference(keypairs->previous_keypair);
 		rcu_assign_pointer(keypairs->previous_keypair, rcu_dereference(keypairs->current_keypair));
-		noise_keypair_put(old_keypair);
+		keypair_kill(old_keypair);
 		rcu_assign_pointer(keypairs->current_keypair, received_keypair);
 		rcu_assign_pointer(keypairs->next_keypair, NULL);
 	}
@@ -244,7 +300,6 @@ static void kdf(u8 *first_dst, u8 *second_dst, const u8 *data,
 
 static void symmetric_key_init(struct noise_symmetric_key *key)
 {
-	spin_lock_init(&key->counter.receive.lock);
 	atomic64_set(&key->counter.counter, 0);
 	memset(key->counter.receive.backtrack, 0, sizeof(key->counter.receive.backtrack));
 	key->birthdate = get_jiffies_64();
@@ -258,6 +313,119 @@ static void derive_keys(struct noise_symmetric_key *first_dst, struct noise_symm
 	symmetric_key_init(second_dst);
 }
 
+/* Generating an ephemeral keypair is a scalar multiplication, which is most of the cost of sending
+ * an initiation or a response. So each device keeps a small pool of them, generated ahead of time
+ * by a worker, and handshakes take one from there, falling back to generating one inline only when
+ * the pool has run dry. Each keypair is zeroed in the pool as soon as it's handed out, so none is
+ * ever used twice. */
+static void ephemeral_pool_refill_worker(struct work_struct *work)
+{
+	struct noise_ephemeral_pool *pool = container_of(work, struct noise_ephemeral_pool, refill_work);
+	u8 private[NOISE_PUBLIC_KEY_LEN], public[NOISE_PUBLIC_KEY_LEN];
+	bool full;
+
+	for (;;) {
+		spin_lock_bh(&pool->lock);
+		full = pool->depth == NOISE_EPHEMERAL_POOL_SIZE || pool->suspended;
+		spin_unlock_bh(&pool->lock);
+		if (full)
+			break;
+
+		curve25519_generate_secret(private);
+		curve25519_generate_public(public, private);
+
+		spin_lock_bh(&pool->lock);
+		if (pool->depth < NOISE_EPHEMERAL_POOL_SIZE && !pool->suspended) {
+			memcpy(pool->keys[pool->depth].private, private, NOISE_PUBLIC_KEY_LEN);
+			memcpy(pool->keys[pool->depth].public, public, NOISE_PUBLIC_KEY_LEN);
+			++pool->depth;
+		}
+		spin_unlock_bh(&pool->lock);
+		cond_resched();
+	}
+	memzero_explicit(private, NOISE_PUBLIC_KEY_LEN);
+}
+
+void noise_ephemeral_pool_init(struct noise_ephemeral_pool *pool)
+{
+	memset(pool, 0, sizeof(struct noise_ephemeral_pool));
+	spin_lock_init(&pool->lock);
+	INIT_WORK(&pool->refill_work, ephemeral_pool_refill_worker);
+}
+
+void noise_ephemeral_pool_refill(struct noise_ephemeral_pool *pool)
+{
+	if (unlikely(READ_ONCE(pool->suspended)))
+		return;
+	queue_work(system_freezable_power_efficient_wq, &pool->refill_work);
+}
+
+void noise_ephemeral_pool_clear(struct noise_ephemeral_pool *pool)
+{
+	spin_lock_bh(&pool->lock);
+	memzero_explicit(pool->keys, sizeof(pool->keys));
+	pool->depth = 0;
+	spin_unlock_bh(&pool->lock);
+}
+
+/* The suspend notifier runs before anything is frozen, so a worker that is already running or
+ * queued could otherwise fill the pool right back up after it has been cleared. Instead, the
+ * worker keeps nothing while suspended, and refilling is left off until resume. */
+void noise_ephemeral_pool_suspend(struct noise_ephemeral_pool *pool)
+{
+	spin_lock_bh(&pool->lock);
+	pool->suspended = true;
+	spin_unlock_bh(&pool->lock);
+	cancel_work_sync(&pool->refill_work);
+	noise_ephemeral_pool_clear(pool);
+}
+
+void noise_ephemeral_pool_resume(struct noise_ephemeral_pool *pool)
+{
+	spin_lock_bh(&pool->lock);
+	pool->suspended = false;
+	spin_unlock_bh(&pool->lock);
+}
+
+void noise_ephemeral_pool_uninit(struct noise_ephemeral_pool *pool)
+{
+	cancel_work_sync(&pool->refill_work);
+	noise_ephemeral_pool_clear(pool);
+}
+
+void noise_ephemeral_pool_stats(struct noise_ephemeral_pool *pool, u32 *depth, u64 *hits, u64 *misses)
+{
+	spin_lock_bh(&pool->lock);
+	*depth = pool->depth;
+	*hits = pool->hits;
+	*misses = pool->misses;
+	spin_unlock_bh(&pool->lock);
+}
+
+static void ephemeral_generate(struct noise_handshake *handshake)
+{
+	struct noise_ephemeral_pool *pool = &handshake->entry.peer->device->ephemeral_pool;
+	bool hit = false;
+
+	spin_lock_bh(&pool->lock);
+	if (likely(pool->depth)) {
+		--pool->depth;
+		memcpy(handshake->ephemeral_private, pool->keys[pool->depth].private, NOISE_PUBLIC_KEY_LEN);
+		memcpy(handshake->ephemeral_public, pool->keys[pool->depth].public, NOISE_PUBLIC_KEY_LEN);
+		memzero_explicit(&pool->keys[pool->depth], sizeof(pool->keys[pool->depth]));
+		++pool->hits;
+		hit = true;
+	} else
+		++pool->misses;
+	spin_unlock_bh(&pool->lock);
+
+	noise_ephemeral_pool_refill(pool);
+	if (!hit) {
+		curve25519_generate_secret(handshake->ephemeral_private);
+		curve25519_generate_public(handshake->ephemeral_public, handshake->ephemeral_private);
+	}
+}
+
 static void mix_key(u8 key[NOISE_SYMMETRIC_KEY_LEN], u8 chaining_key[NOISE_HASH_LEN], const u8 *src, size_t src_len)
 {
 	kdf(chaining_key, key, src, NOISE_HASH_LEN, NOISE_SYMMETRIC_KEY_LEN, src_len, chaining_key);
@@ -345,8 +513,7 @@ bool noise_handshake_create_initiation(struct message_handshake_initiation *dst,
 		       handshake->static_identity->has_psk ? handshake->static_identity->preshared_key : NULL);
 
 	/* e */
-	curve25519_generate_secret(handshake->ephemeral_private);
-	curve25519_generate_public(handshake->ephemeral_public, handshake->ephemeral_private);
+	ephemeral_generate(handshake);
 	handshake_nocrypt(dst->unencrypted_ephemeral, handshake->ephemeral_public, NOISE_PUBLIC_KEY_LEN, handshake->hash);
 	if (handshake->static_identity->has_psk)
 		mix_key(handshake->key, handshake->chaining_key, handshake->ephemeral_public, NOISE_PUBLIC_KEY_LEN);
@@ -359,7 +526,8 @@ bool noise_handshake_create_initiation(struct message_handshake_initiation *dst,
 		goto out;
 
 	/* ss */
-	mix_dh(handshake->key, handshake->chaining_key, handshake->static_identity->static_private, handshake->remote_static);
+	refresh_static_static(handshake);
+	mix_key(handshake->key, handshake->chaining_key, handshake->precomputed_static_static, NOISE_PUBLIC_KEY_LEN);
 
 	/* t */
 	tai64n_now(timestamp);
@@ -377,9 +545,36 @@ out:
 	return ret;
 }
 
-struct wireguard_peer *noise_handshake_consume_initiation(struct message_handshake_initiation *src, struct wireguard_device *wg)
+/* A flood of initiations is bound by the es of each, which is the only DH that can be done before
+ * decrypting the initiator's identity, so this does it for a whole batch of them at once with
+ * curve25519_batch. Nothing here is authenticated yet, so a bogus ephemeral just leads to a
+ * result that fails to decrypt later, as it would have anyway. */
+void noise_handshake_precompute_initiations(struct noise_precomputed_dh *dh[], struct message_handshake_initiation *src[], size_t num, struct wireguard_device *wg)
 {
-	bool replay_attack, flood_attack;
+	enum { BATCH_SIZE = 8 };
+	u8 *results[BATCH_SIZE];
+	const u8 *privates[BATCH_SIZE], *ephemerals[BATCH_SIZE];
+	size_t i, j, n;
+
+	down_read(&wg->static_identity.lock);
+	for (i = 0; i < num; i += n) {
+		n = min_t(size_t, num - i, BATCH_SIZE);
+		for (j = 0; j < n; ++j) {
+			dh[i + j]->valid = wg->static_identity.has_identity;
+			memcpy(dh[i + j]->static_public, wg->static_identity.static_public, NOISE_PUBLIC_KEY_LEN);
+			results[j] = dh[i + j]->result;
+			privates[j] = wg->static_identity.static_private;
+			ephemerals[j] = src[i + j]->unencrypted_ephemeral;
+		}
+		if (wg->static_identity.has_identity)
+			curve25519_batch(results, privates, ephemerals, n);
+	}
+	up_read(&wg->static_identity.lock);
+}
+
+struct wireguard_peer *noise_handshake_consume_initiation(struct message_handshake_initiation *src, struct wireguard_device *wg, const struct noise_precomputed_dh *es)
+{
+	bool replay_attack, flood_attack, stale_static_static;
 	u8 s[NOISE_PUBLIC_KEY_LEN];
 	u8 e[NOISE_PUBLIC_KEY_LEN];
 	u8 t[NOISE_TIMESTAMP_LEN];
@@ -401,34 +596,45 @@ struct wireguard_peer *noise_handshake_consume_initiation(struct message_handsha
 	if (wg->static_identity.has_psk)
 		mix_key(key, chaining_key, e, NOISE_PUBLIC_KEY_LEN);
 
-	/* es */
-	mix_dh(key, chaining_key, wg->static_identity.static_private, e);
+	/* es, using the precomputed one only if our static key hasn't changed since */
+	if (es && es->valid && !memcmp(es->static_public, wg->static_identity.static_public, NOISE_PUBLIC_KEY_LEN))
+		mix_key(key, chaining_key, es->result, NOISE_PUBLIC_KEY_LEN);
+	else
+		mix_dh(key, chaining_key, wg->static_identity.static_private, e);
 
 	/* s */
 	if (!handshake_decrypt(s, src->encrypted_static, sizeof(src->encrypted_static), key, hash))
 		goto out;
 
-	/* ss */
-	mix_dh(key, chaining_key, wg->static_identity.static_private, s);
-
-	/* t */
-	if (!handshake_decrypt(t, src->encrypted_timestamp, sizeof(src->encrypted_timestamp), key, hash))
-		goto out;
-
 	/* Lookup which peer we're actually talking to */
 	wg_peer = pubkey_hashtable_lookup(&wg->peer_hashtable, s);
 	if (!wg_peer)
 		goto out;
 	handshake = &wg_peer->handshake;
+
+	/* ss, doing the DH again, and keeping it for next time, if our static key has changed since */
+	down_read(&handshake->lock);
+	stale_static_static = memcmp(handshake->precomputed_static_public, wg->static_identity.static_public, NOISE_PUBLIC_KEY_LEN);
+	if (likely(!stale_static_static))
+		mix_key(key, chaining_key, handshake->precomputed_static_static, NOISE_PUBLIC_KEY_LEN);
+	up_read(&handshake->lock);
+	if (unlikely(stale_static_static)) {
+		down_write(&handshake->lock);
+		refresh_static_static(handshake);
+		mix_key(key, chaining_key, handshake->precomputed_static_static, NOISE_PUBLIC_KEY_LEN);
+		up_write(&handshake->lock);
+	}
+
+	/* t */
+	if (!handshake_decrypt(t, src->encrypted_timestamp, sizeof(src->encrypted_timestamp), key, hash))
+		goto fail;
+
 	down_read(&handshake->lock);
 	replay_attack = memcmp(t, handshake->latest_timestamp, NOISE_TIMESTAMP_LEN) <= 0;
 	flood_attack = !time_is_before_jiffies64(handshake->last_initiation_consumption + INITIATIONS_PER_SECOND);
 	up_read(&handshake->lock);
-	if (replay_attack || flood_attack) {
-		peer_put(wg_peer);
-		wg_peer = NULL;
-		goto out;
-	}
+	if (replay_attack || flood_attack)
+		goto fail;
 
 	/* Success! Copy everything to peer */
 	down_write(&handshake->lock);
@@ -441,7 +647,11 @@ struct wireguard_peer *noise_handshake_consume_initiation(struct message_handsha
 	handshake->last_initiation_consumption = get_jiffies_64();
 	handshake->state = HANDSHAKE_CONSUMED_INITIATION;
 	up_write(&handshake->lock);
+	goto out;
 
+fail:
+	peer_put(wg_peer);
+	wg_peer = NULL;
 out:
 	memzero_explicit(key, NOISE_SYMMETRIC_KEY_LEN);
 	memzero_explicit(hash, NOISE_HASH_LEN);
@@ -463,8 +673,7 @@ bool noise_handshake_create_response(struct message_handshake_response *dst, str
 	dst->receiver_index = handshake->remote_index;
 
 	/* e */
-	curve25519_generate_secret(handshake->ephemeral_private);
-	curve25519_generate_public(handshake->ephemeral_public, handshake->ephemeral_private);
+	ephemeral_generate(handshake);
 	handshake_nocrypt(dst->unencrypted_ephemeral, handshake->ephemeral_public, NOISE_PUBLIC_KEY_LEN, handshake->hash);
 	if (handshake->static_identity->has_psk)
 		mix_key(handshake->key, handshake->chaining_key, handshake->ephemeral_public, NOISE_PUBLIC_KEY_LEN);
@@ -580,8 +789,10 @@ bool noise_handshake_begin_session(struct noise_handshake *handshake, struct noi
 		derive_keys(&new_keypair->receiving, &new_keypair->sending, handshake->chaining_key);
 	up_read(&handshake->lock);
 
-	add_new_keypair(keypairs, new_keypair);
+	/* The index has to be in place before the keypair is in a slot, since keypair_kill,
+	 * which can happen as soon as it is, takes it back out. */
 	index_hashtable_replace(&handshake->entry.peer->device->index_hashtable, &handshake->entry, &new_keypair->entry);
+	add_new_keypair(keypairs, new_keypair);
 	noise_handshake_clear(handshake);
 	net_dbg_ratelimited("Keypair %Lu created for peer %Lu\n", new_keypair->internal_id, new_keypair->entry.peer->internal_id);
 
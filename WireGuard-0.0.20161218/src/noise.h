@@ -16,13 +16,15 @@
 #include <linux/rwsem.h>
 #include <linux/mutex.h>
 #include <linux/jiffies.h>
-#include <linux/kref.h>
+#include <linux/percpu-refcount.h>
+#include <linux/workqueue.h>
 
 union noise_counter {
 	struct {
-		u64 counter;
-		unsigned long backtrack[COUNTER_BITS_TOTAL / BITS_PER_LONG];
-		spinlock_t lock;
+		atomic64_t counter;
+		/* The low half of each word has COUNTER_REDUNDANT_BITS bits of the window, and the
+		 * high half says which block of that many nonces they are for. */
+		atomic64_t backtrack[COUNTER_BITS_TOTAL / COUNTER_REDUNDANT_BITS];
 	} receive;
 	atomic64_t counter;
 };
@@ -34,15 +36,18 @@ struct noise_symmetric_key {
 	bool is_valid;
 };
 
+/* The sending counter is bumped for every packet sent, and the receiving counter and its
+ * bitmap for every packet received, usually on different CPUs, so each key gets cache lines
+ * of its own, apart from the members that are only read after the keypair is created. */
 struct noise_keypair {
 	struct index_hashtable_entry entry;
-	struct noise_symmetric_key sending;
-	struct noise_symmetric_key receiving;
 	__le32 remote_index;
 	bool i_am_the_initiator;
-	struct kref refcount;
+	struct percpu_ref refcount;
 	struct rcu_head rcu;
 	u64 internal_id;
+	struct noise_symmetric_key sending ____cacheline_aligned_in_smp;
+	struct noise_symmetric_key receiving ____cacheline_aligned_in_smp;
 };
 
 struct noise_keypairs {
@@ -60,6 +65,20 @@ struct noise_static_identity {
 	struct rw_semaphore lock;
 };
 
+enum { NOISE_EPHEMERAL_POOL_SIZE = 32 };
+
+struct noise_ephemeral_pool {
+	struct {
+		u8 private[NOISE_PUBLIC_KEY_LEN];
+		u8 public[NOISE_PUBLIC_KEY_LEN];
+	} keys[NOISE_EPHEMERAL_POOL_SIZE];
+	unsigned int depth;
+	u64 hits, misses;
+	bool suspended;
+	spinlock_t lock;
+	struct work_struct refill_work;
+};
+
 enum noise_handshake_state {
 	HANDSHAKE_ZEROED,
 	HANDSHAKE_CREATED_INITIATION,
@@ -81,6 +100,8 @@ struct noise_handshake {
 
 	u8 remote_static[NOISE_PUBLIC_KEY_LEN];
 	u8 remote_ephemeral[NOISE_PUBLIC_KEY_LEN];
+	u8 precomputed_static_static[NOISE_PUBLIC_KEY_LEN];
+	u8 precomputed_static_public[NOISE_PUBLIC_KEY_LEN];
 
 	u8 key[NOISE_SYMMETRIC_KEY_LEN];
 	u8 hash[NOISE_HASH_LEN];
@@ -93,6 +114,14 @@ struct noise_handshake {
 	struct rw_semaphore lock;
 };
 
+/* The es of an initiation, that is DH(our static private key, initiator's ephemeral public key),
+ * computed ahead of time in a batch with others, along with which static key it was computed with. */
+struct noise_precomputed_dh {
+	u8 static_public[NOISE_PUBLIC_KEY_LEN];
+	u8 result[NOISE_PUBLIC_KEY_LEN];
+	bool valid;
+};
+
 struct wireguard_peer;
 struct wireguard_device;
 struct message_header;
@@ -112,8 +141,17 @@ bool noise_received_with_keypair(struct noise_keypairs *keypairs, struct noise_k
 void noise_set_static_identity_private_key(struct noise_static_identity *static_identity, const u8 private_key[NOISE_PUBLIC_KEY_LEN]);
 void noise_set_static_identity_preshared_key(struct noise_static_identity *static_identity, const u8 preshared_key[NOISE_SYMMETRIC_KEY_LEN]);
 
+void noise_ephemeral_pool_init(struct noise_ephemeral_pool *pool);
+void noise_ephemeral_pool_refill(struct noise_ephemeral_pool *pool);
+void noise_ephemeral_pool_clear(struct noise_ephemeral_pool *pool);
+void noise_ephemeral_pool_suspend(struct noise_ephemeral_pool *pool);
+void noise_ephemeral_pool_resume(struct noise_ephemeral_pool *pool);
+void noise_ephemeral_pool_uninit(struct noise_ephemeral_pool *pool);
+void noise_ephemeral_pool_stats(struct noise_ephemeral_pool *pool, u32 *depth, u64 *hits, u64 *misses);
+
 bool noise_handshake_create_initiation(struct message_handshake_initiation *dst, struct noise_handshake *handshake);
-struct wireguard_peer *noise_handshake_consume_initiation(struct message_handshake_initiation *src, struct wireguard_device *wg);
+void noise_handshake_precompute_initiations(struct noise_precomputed_dh *dh[], struct message_handshake_initiation *src[], size_t num, struct wireguard_device *wg);
+struct wireguard_peer *noise_handshake_consume_initiation(struct message_handshake_initiation *src, struct wireguard_device *wg, const struct noise_precomputed_dh *es);
 
 bool noise_handshake_create_response(struct message_handshake_response *dst, struct noise_handshake *peer);
 struct wireguard_peer *noise_handshake_consume_response(struct message_handshake_response *src, struct wireguard_device *wg);
@@ -8,15 +8,35 @@
 #include "socket.h"
 
 #include <linux/types.h>
-#include <linux/padata.h>
+#include <linux/list.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 struct wireguard_device;
 struct wireguard_peer;
 struct sk_buff;
 
 /* receive.c */
+struct handshake_batch_entry {
+	struct sk_buff *skb;
+	void *data;
+	size_t len;
+	struct noise_precomputed_dh es;
+};
+
+struct handshake_worker {
+	struct sk_buff_head queue;
+	struct work_struct work;
+	struct wireguard_device *wg;
+	/* Only touched by the worker itself, which never runs concurrently with itself. */
+	struct handshake_batch_entry batch[MAX_BURST_INCOMING_HANDSHAKES];
+};
+
 void packet_receive(struct wireguard_device *wg, struct sk_buff *skb);
-void packet_process_queued_handshake_packets(struct work_struct *work);
+int packet_init_handshake_queues(struct wireguard_device *wg);
+void packet_purge_handshake_queues(struct wireguard_device *wg);
+void packet_uninit_handshake_queues(struct wireguard_device *wg);
 
 /* send.c */
 void packet_send_queue(struct wireguard_peer *peer);
@@ -27,14 +47,40 @@ void packet_send_handshake_response(struct wireguard_peer *peer);
 void packet_send_handshake_cookie(struct wireguard_device *wg, struct sk_buff *initiating_skb, void *data, size_t data_len, __le32 sender_index);
 
 /* data.c */
+struct packet_cb {
+	u64 nonce;
+	u8 ds;
+	u8 num_frags;
+};
+#define PACKET_CB(skb) ((struct packet_cb *)skb->cb)
+
 typedef void (*packet_create_data_callback_t)(struct sk_buff_head *, struct wireguard_peer *);
 typedef void (*packet_consume_data_callback_t)(struct sk_buff *skb, struct wireguard_peer *, struct endpoint *, bool used_new_key, int err);
 int packet_create_data(struct sk_buff_head *queue, struct wireguard_peer *peer, packet_create_data_callback_t callback);
 void packet_consume_data(struct sk_buff *skb, size_t offset, struct wireguard_device *wg, packet_consume_data_callback_t callback);
 
 #ifdef CONFIG_WIREGUARD_PARALLEL
+/* The same structure serves as the per-peer queue, which keeps jobs in the order they
+ * must be delivered, and as the per-device queue, which the per-cpu workers pull from. */
+struct crypt_queue {
+	struct list_head list;
+	spinlock_t lock;
+	unsigned int len;
+	bool draining;
+	struct crypt_worker __percpu *worker;
+	int next_cpu;
+};
+
+struct crypt_worker {
+	struct crypt_queue *queue;
+	struct work_struct work;
+};
+
 int packet_init_data_caches(void);
 void packet_deinit_data_caches(void);
+void packet_queue_init(struct crypt_queue *queue);
+int packet_init_device_queues(struct wireguard_device *wg);
+void packet_uninit_device_queues(struct wireguard_device *wg);
 #endif
 
 #ifdef DEBUG
@@ -7,18 +7,48 @@
 #include "hashtables.h"
 #include "noise.h"
 
-#include <linux/kref.h>
+#include <linux/percpu-refcount.h>
 #include <linux/lockdep.h>
 #include <linux/rcupdate.h>
 #include <linux/list.h>
 
 static atomic64_t peer_counter = ATOMIC64_INIT(0);
 
+#define peer_member_end(member) (offsetof(struct wireguard_peer, member) + sizeof(((struct wireguard_peer *)0)->member))
+#define peer_first_line(member) (offsetof(struct wireguard_peer, member) / SMP_CACHE_BYTES)
+#define peer_last_line(member) ((peer_member_end(member) - 1) / SMP_CACHE_BYTES)
+#define peer_group_size(first, last) (peer_member_end(last) - offsetof(struct wireguard_peer, first))
+#ifdef CONFIG_WIREGUARD_PARALLEL
+#define PEER_LAST_TX tx_queue
+#define PEER_LAST_RX rx_queue
+#else
+#define PEER_LAST_TX need_resend_queue
+#define PEER_LAST_RX sent_lastminute_handshake
+#endif
+
+static void percpu_release(struct percpu_ref *ref);
+
 struct wireguard_peer *peer_create(struct wireguard_device *wg, const u8 public_key[NOISE_PUBLIC_KEY_LEN])
 {
 	struct wireguard_peer *peer;
 	lockdep_assert_held(&wg->device_update_lock);
 
+	/* No two groups of members in struct wireguard_peer may share a cache line, whatever gets
+	 * added to or moved around in them. */
+	BUILD_BUG_ON(IS_ENABLED(CONFIG_SMP) && peer_last_line(internal_id) >= peer_first_line(endpoint));
+	BUILD_BUG_ON(IS_ENABLED(CONFIG_SMP) && peer_last_line(PEER_LAST_TX) >= peer_first_line(sent_lastminute_handshake));
+	BUILD_BUG_ON(IS_ENABLED(CONFIG_SMP) && peer_last_line(PEER_LAST_RX) >= peer_first_line(timer_deadlines));
+	BUILD_BUG_ON(IS_ENABLED(CONFIG_SMP) && peer_last_line(timer_need_another_keepalive) >= peer_first_line(handshake));
+#if !defined(CONFIG_DEBUG_SPINLOCK) && !defined(CONFIG_DEBUG_MUTEXES) && !defined(CONFIG_DEBUG_LOCK_ALLOC)
+	/* Nor may the groups that every packet touches grow much past what they take on x86_64,
+	 * which is 152, 152, 56 and 74 bytes, as each line more is one more miss per packet. Lock
+	 * debugging makes the locks in them several times larger, so it's exempt. */
+	BUILD_BUG_ON(peer_group_size(device, internal_id) > 192);
+	BUILD_BUG_ON(peer_group_size(endpoint, PEER_LAST_TX) > 192);
+	BUILD_BUG_ON(peer_group_size(sent_lastminute_handshake, PEER_LAST_RX) > 64);
+	BUILD_BUG_ON(peer_group_size(timer_deadlines, timer_need_another_keepalive) > 128);
+#endif
+
 	if (peer_total_count(wg) >= MAX_PEERS_PER_DEVICE)
 		return NULL;
 
@@ -26,11 +56,28 @@ struct wireguard_peer *peer_create(struct wireguard_device *wg, const u8 public_
 	if (!peer)
 		return NULL;
 
+	peer->stats = netdev_alloc_pcpu_stats(struct peer_stats);
+	if (!peer->stats) {
+		kfree(peer);
+		return NULL;
+	}
+
 	if (dst_cache_init(&peer->endpoint_cache, GFP_KERNEL)) {
+		free_percpu(peer->stats);
 		kfree(peer);
 		return NULL;
 	}
 
+	/* Every packet takes and drops a reference or two, so these are per-CPU, until peer_remove
+	 * drops the initial reference, which switches the count back to a single atomic. */
+	if (percpu_ref_init(&peer->refcount, percpu_release, 0, GFP_KERNEL)) {
+		dst_cache_destroy(&peer->endpoint_cache);
+		free_percpu(peer->stats);
+		kfree(peer);
+		return NULL;
+	}
+	atomic_inc(&wg->peers_alive);
+
 	peer->internal_id = atomic64_inc_return(&peer_counter);
 	peer->device = wg;
 	cookie_init(&peer->latest_cookie);
@@ -39,7 +86,10 @@ struct wireguard_peer *peer_create(struct wireguard_device *wg, const u8 public_
 	INIT_WORK(&peer->transmit_handshake_work, packet_send_queued_handshakes);
 	rwlock_init(&peer->endpoint_lock);
 	skb_queue_head_init(&peer->tx_packet_queue);
-	kref_init(&peer->refcount);
+#ifdef CONFIG_WIREGUARD_PARALLEL
+	packet_queue_init(&peer->tx_queue);
+	packet_queue_init(&peer->rx_queue);
+#endif
 	pubkey_hashtable_add(&wg->peer_hashtable, peer);
 	list_add_tail(&peer->peer_list, &wg->peer_list);
 	pr_debug("Peer %Lu created\n", peer->internal_id);
@@ -49,7 +99,7 @@ struct wireguard_peer *peer_create(struct wireguard_device *wg, const u8 public_
 struct wireguard_peer *peer_get(struct wireguard_peer *peer)
 {
 	RCU_LOCKDEP_WARN(!rcu_read_lock_held(), "Calling peer_get without holding the RCU read lock.");
-	if (unlikely(!peer || !kref_get_unless_zero(&peer->refcount)))
+	if (unlikely(!peer || !percpu_ref_tryget(&peer->refcount)))
 		return NULL;
 	return peer;
 }
@@ -79,21 +129,26 @@ void peer_remove(struct wireguard_peer *peer)
 	if (peer->device->workqueue)
 		flush_workqueue(peer->device->workqueue);
 	skb_queue_purge(&peer->tx_packet_queue);
-	peer_put(peer);
+	percpu_ref_kill(&peer->refcount);
 }
 
 static void rcu_release(struct rcu_head *rcu)
 {
 	struct wireguard_peer *peer = container_of(rcu, struct wireguard_peer, rcu);
+	struct wireguard_device *wg = peer->device;
 	pr_debug("Peer %Lu (%pISpfsc) destroyed\n", peer->internal_id, &peer->endpoint.addr);
 	skb_queue_purge(&peer->tx_packet_queue);
 	dst_cache_destroy(&peer->endpoint_cache);
+	percpu_ref_exit(&peer->refcount);
+	free_percpu(peer->stats);
 	kzfree(peer);
+	if (atomic_dec_and_test(&wg->peers_alive))
+		wake_up(&wg->peers_freed);
 }
 
-static void kref_release(struct kref *refcount)
+static void percpu_release(struct percpu_ref *ref)
 {
-	struct wireguard_peer *peer = container_of(refcount, struct wireguard_peer, refcount);
+	struct wireguard_peer *peer = container_of(ref, struct wireguard_peer, refcount);
 	call_rcu(&peer->rcu, rcu_release);
 }
 
@@ -101,7 +156,7 @@ void peer_put(struct wireguard_peer *peer)
 {
 	if (unlikely(!peer))
 		return;
-	kref_put(&peer->refcount, kref_release);
+	percpu_ref_put(&peer->refcount);
 }
 
 int peer_for_each_unlocked(struct wireguard_device *wg, int (*fn)(struct wireguard_peer *peer, void *ctx), void *data)
@@ -137,6 +192,10 @@ void peer_remove_all(struct wireguard_device *wg)
 	lockdep_assert_held(&wg->device_update_lock);
 	list_for_each_entry_safe(peer, temp, &wg->peer_list, peer_list)
 		peer_remove(peer);
+	/* Packets in flight, and the keypairs, which hold a reference to their peer, might
+	 * outlive peer_remove, so we wait for all of them to let go before returning, which
+	 * lets the caller tear down the tables that they use. */
+	wait_event(wg->peers_freed, !atomic_read(&wg->peers_alive));
 }
 
 unsigned int peer_total_count(struct wireguard_device *wg)
@@ -148,3 +207,30 @@ unsigned int peer_total_count(struct wireguard_device *wg)
 		++i;
 	return i;
 }
+
+void peer_stats_get(struct wireguard_peer *peer, struct peer_stats *total)
+{
+	const struct peer_stats *stats;
+	struct peer_stats snapshot;
+	unsigned int start;
+	int cpu;
+
+	memset(total, 0, sizeof(*total));
+	for_each_possible_cpu(cpu) {
+		stats = per_cpu_ptr(peer->stats, cpu);
+		do {
+			start = u64_stats_fetch_begin_irq(&stats->syncp);
+			snapshot = *stats;
+		} while (u64_stats_fetch_retry_irq(&stats->syncp, start));
+		total->rx_packets += snapshot.rx_packets;
+		total->rx_bytes += snapshot.rx_bytes;
+		total->tx_packets += snapshot.tx_packets;
+		total->tx_bytes += snapshot.tx_bytes;
+		total->rx_dropped_length += snapshot.rx_dropped_length;
+		total->rx_dropped_source += snapshot.rx_dropped_source;
+		total->rx_dropped_auth += snapshot.rx_dropped_auth;
+		total->rx_replayed += snapshot.rx_replayed;
+		total->tx_dropped += snapshot.tx_dropped;
+		total->handshake_initiations += snapshot.handshake_initiations;
+	}
+}
@@ -5,11 +5,14 @@
 
 #include "noise.h"
 #include "cookie.h"
+#include "packets.h"
+#include "timers.h"
 
 #include <linux/types.h>
 #include <linux/netfilter.h>
 #include <linux/spinlock.h>
-#include <linux/kref.h>
+#include <linux/percpu-refcount.h>
+#include <linux/u64_stats_sync.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
 #include <net/dst_cache.h>
 #endif
@@ -28,33 +31,83 @@ struct endpoint {
 	};
 };
 
+struct peer_stats {
+	u64 rx_packets, rx_bytes, tx_packets, tx_bytes;
+	u64 rx_dropped_length, rx_dropped_source, rx_dropped_auth, rx_replayed, tx_dropped;
+	u64 handshake_initiations;
+	struct u64_stats_sync syncp;
+};
+
+/* Peer statistics are kept per-CPU and only summed up by peer_stats_get. Updates disable
+ * bottom halves, since some happen from process context, and on 32-bit the sequence count
+ * mustn't be entered twice on the same CPU. */
+#define peer_stats_add(peer, field, count) do { \
+	struct peer_stats *stats__; \
+	local_bh_disable(); \
+	stats__ = this_cpu_ptr((peer)->stats); \
+	u64_stats_update_begin(&stats__->syncp); \
+	stats__->field += (count); \
+	u64_stats_update_end(&stats__->syncp); \
+	local_bh_enable(); \
+} while (0)
+
+#define peer_stats_add_packet(peer, direction, len) do { \
+	struct peer_stats *stats__; \
+	local_bh_disable(); \
+	stats__ = this_cpu_ptr((peer)->stats); \
+	u64_stats_update_begin(&stats__->syncp); \
+	++stats__->direction##_packets; \
+	stats__->direction##_bytes += (len); \
+	u64_stats_update_end(&stats__->syncp); \
+	local_bh_enable(); \
+} while (0)
+
+/* The members are grouped by who writes them, so that packets being sent on one CPU and
+ * received on another don't keep stealing each other's cache lines, and so that neither
+ * disturbs the lines that every packet reads but only handshakes write. */
 struct wireguard_peer {
+	/* Read for every packet, and written rarely if ever. */
 	struct wireguard_device *device;
-	struct endpoint endpoint;
-	struct dst_cache endpoint_cache;
-	rwlock_t endpoint_lock;
-	struct noise_handshake handshake;
+	struct percpu_ref refcount;
+	struct peer_stats __percpu *stats;
 	struct noise_keypairs keypairs;
-	u64 last_sent_handshake;
-	struct work_struct transmit_handshake_work, clear_peer_work;
-	struct cookie latest_cookie;
-	struct hlist_node pubkey_hash;
-	u64 rx_bytes, tx_bytes;
-	struct timer_list timer_retransmit_handshake, timer_send_keepalive, timer_new_handshake, timer_kill_ephemerals, timer_persistent_keepalive;
-	unsigned int timer_handshake_attempts;
 	unsigned long persistent_keepalive_interval;
-	bool timer_need_another_keepalive;
-	bool need_resend_queue;
-	bool sent_lastminute_handshake;
-	struct timeval walltime_last_handshake;
-	struct sk_buff_head tx_packet_queue;
-	struct kref refcount;
-	struct rcu_head rcu;
-	struct list_head peer_list;
 	u64 internal_id;
+
+	/* Written when sending. */
+	struct endpoint endpoint ____cacheline_aligned_in_smp;
+	rwlock_t endpoint_lock;
+	struct dst_cache endpoint_cache;
+	struct sk_buff_head tx_packet_queue;
+	bool need_resend_queue;
 #ifdef CONFIG_WIREGUARD_PARALLEL
-	atomic_t parallel_encryption_inflight;
+	struct crypt_queue tx_queue;
 #endif
+
+	/* Written when receiving. */
+	bool sent_lastminute_handshake ____cacheline_aligned_in_smp;
+#ifdef CONFIG_WIREGUARD_PARALLEL
+	struct crypt_queue rx_queue;
+#endif
+
+	/* Written in both directions, but only when a timer is armed or cancelled. */
+	unsigned long timer_deadlines[TIMER_COUNT] ____cacheline_aligned_in_smp;
+	unsigned long timers_armed, timer_wheel_slot;
+	struct hlist_node timer_wheel_node;
+	bool timers_enabled;
+	bool timer_need_another_keepalive;
+
+	/* Only touched by handshakes and configuration. */
+	struct noise_handshake handshake ____cacheline_aligned_in_smp;
+	struct cookie latest_cookie;
+	u64 last_sent_handshake;
+	unsigned int timer_handshake_attempts;
+	struct timeval walltime_last_handshake;
+	struct work_struct transmit_handshake_work, clear_peer_work;
+	struct hlist_node pubkey_hash[2];
+	struct list_head peer_list;
+	u64 routing_table_stale_generation;
+	struct rcu_head rcu;
 };
 
 struct wireguard_peer *peer_create(struct wireguard_device *wg, const u8 public_key[NOISE_PUBLIC_KEY_LEN]);
@@ -73,4 +126,6 @@ int peer_for_each(struct wireguard_device *wg, int (*fn)(struct wireguard_peer *
 
 unsigned int peer_total_count(struct wireguard_device *wg);
 
+void peer_stats_get(struct wireguard_peer *peer, struct peer_stats *total);
+
 #endif
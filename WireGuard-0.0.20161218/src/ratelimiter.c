@@ -1,138 +1,195 @@
 /* Copyright (C) 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
 
 #include "ratelimiter.h"
-#include "peer.h"
-#include "device.h"
 
 #include <linux/module.h>
-#include <linux/netfilter/x_tables.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/ktime.h>
 #include <net/ip.h>
-
-static struct xt_match *v4_match;
-#if IS_ENABLED(CONFIG_IPV6)
-static struct xt_match *v6_match;
-#endif
-
+#include <net/ipv6.h>
+
+/* Each source gets a token bucket, where a token is a nanosecond of credit, so that
+ * refilling is just adding the time elapsed since the last packet. IPv4 sources are
+ * tracked by address and IPv6 sources by /64, since that's the smallest allocation
+ * anybody can be expected to have. Lookups happen under RCU, and the bucket itself
+ * is protected by a lock of its own, so different sources never contend. A source
+ * that has been quiet for a second has a full bucket again, which is exactly what an
+ * absent entry means, so those are lazily swept out by a worker that only runs while
+ * the table isn't empty. */
 enum {
 	RATELIMITER_PACKETS_PER_SECOND = 75,
-	RATELIMITER_PACKETS_BURSTABLE = 5
+	RATELIMITER_PACKETS_BURSTABLE = 5,
+	RATELIMITER_PACKET_COST = NSEC_PER_SEC / RATELIMITER_PACKETS_PER_SECOND,
+	RATELIMITER_TOKEN_MAX = RATELIMITER_PACKET_COST * RATELIMITER_PACKETS_BURSTABLE,
+	RATELIMITER_ENTRIES_PER_BUCKET = 8,
+	RATELIMITER_MAX_TABLE_SIZE = 8192,
+	RATELIMITER_MAX_CONFIGURED_TABLE_SIZE = 1 << 18
 };
 
-static inline void cfg_init(struct hashlimit_cfg1 *cfg, int family)
-{
-	memset(cfg, 0, sizeof(struct hashlimit_cfg1));
-	if (family == NFPROTO_IPV4)
-		cfg->srcmask = 32;
-	else if (family == NFPROTO_IPV6)
-		cfg->srcmask = 96;
-	cfg->mode = XT_HASHLIMIT_HASH_SIP; /* source IP only -- we could also do source port by ORing this with XT_HASHLIMIT_HASH_SPT */
-	cfg->avg = XT_HASHLIMIT_SCALE / RATELIMITER_PACKETS_PER_SECOND; /* 75 per second per IP */
-	cfg->burst = RATELIMITER_PACKETS_BURSTABLE; /* Allow bursts of 5 at a time */
-	cfg->gc_interval = 1000; /* same as expiration date */
-	cfg->expire = 1000; /* Units of avg (seconds = 1) times 1000 */
-	/* cfg->size and cfg->max are computed based on the memory size of left to zero */
-}
+static unsigned int ratelimiter_max_entries;
+module_param(ratelimiter_max_entries, uint, 0444);
+MODULE_PARM_DESC(ratelimiter_max_entries, "Maximum number of handshake sources tracked per interface by the rate limiter (0 picks a size from available memory)");
+
+struct ratelimiter_entry {
+	u64 last_time_ns, tokens;
+	__be64 ip;
+	bool is_v6;
+	spinlock_t lock;
+	struct hlist_node hash;
+	struct rcu_head rcu;
+};
 
-int ratelimiter_init(struct ratelimiter *ratelimiter, struct wireguard_device *wg)
+static void gc_entries(struct work_struct *work)
 {
-	struct net_device *dev = netdev_pub(wg);
-	struct xt_mtchk_param chk = { .net = wg->creating_net };
-	int ret;
-
-	memset(ratelimiter, 0, sizeof(struct ratelimiter));
-
-	cfg_init(&ratelimiter->v4_info.cfg, NFPROTO_IPV4);
-	memcpy(ratelimiter->v4_info.name, dev->name, IFNAMSIZ);
-	chk.matchinfo = &ratelimiter->v4_info;
-	chk.match = v4_match;
-	chk.family = NFPROTO_IPV4;
-	ret = v4_match->checkentry(&chk);
-	if (ret < 0)
-		return ret;
-
-#if IS_ENABLED(CONFIG_IPV6)
-	cfg_init(&ratelimiter->v6_info.cfg, NFPROTO_IPV6);
-	memcpy(ratelimiter->v6_info.name, dev->name, IFNAMSIZ);
-	chk.matchinfo = &ratelimiter->v6_info;
-	chk.match = v6_match;
-	chk.family = NFPROTO_IPV6;
-	ret = v6_match->checkentry(&chk);
-	if (ret < 0) {
-		struct xt_mtdtor_param dtor_v4 = {
-			.net = wg->creating_net,
-			.match = v4_match,
-			.matchinfo = &ratelimiter->v4_info,
-			.family = NFPROTO_IPV4
-		};
-		v4_match->destroy(&dtor_v4);
-		return ret;
+	struct ratelimiter *ratelimiter = container_of(to_delayed_work(work), struct ratelimiter, gc_work);
+	const u64 now = ktime_get_ns();
+	struct ratelimiter_entry *entry;
+	struct hlist_node *temp;
+	unsigned int i;
+
+	for (i = 0; i <= ratelimiter->table_mask; ++i) {
+		spin_lock_bh(&ratelimiter->table_lock);
+		hlist_for_each_entry_safe(entry, temp, &ratelimiter->table[i], hash) {
+			if ((s64)(now - READ_ONCE(entry->last_time_ns)) > NSEC_PER_SEC) {
+				hlist_del_rcu(&entry->hash);
+				atomic_dec(&ratelimiter->total_entries);
+				kfree_rcu(entry, rcu);
+			}
+		}
+		spin_unlock_bh(&ratelimiter->table_lock);
 	}
-#endif
-
-	ratelimiter->net = wg->creating_net;
-	return 0;
+	if (atomic_read(&ratelimiter->total_entries))
+		queue_delayed_work(system_power_efficient_wq, &ratelimiter->gc_work, HZ);
 }
 
-void ratelimiter_uninit(struct ratelimiter *ratelimiter)
+static bool entry_allow(struct ratelimiter_entry *entry)
 {
-	struct xt_mtdtor_param dtor = { .net = ratelimiter->net };
-
-	dtor.match = v4_match;
-	dtor.matchinfo = &ratelimiter->v4_info;
-	dtor.family = NFPROTO_IPV4;
-	v4_match->destroy(&dtor);
-
-#if IS_ENABLED(CONFIG_IPV6)
-	dtor.match = v6_match;
-	dtor.matchinfo = &ratelimiter->v6_info;
-	dtor.family = NFPROTO_IPV6;
-	v6_match->destroy(&dtor);
-#endif
+	u64 now, tokens;
+	bool ret;
+
+	spin_lock_bh(&entry->lock);
+	now = ktime_get_ns();
+	tokens = min_t(u64, RATELIMITER_TOKEN_MAX, entry->tokens + now - entry->last_time_ns);
+	WRITE_ONCE(entry->last_time_ns, now);
+	ret = tokens >= RATELIMITER_PACKET_COST;
+	entry->tokens = ret ? tokens - RATELIMITER_PACKET_COST : tokens;
+	spin_unlock_bh(&entry->lock);
+	return ret;
 }
 
 bool ratelimiter_allow(struct ratelimiter *ratelimiter, struct sk_buff *skb)
 {
-	struct xt_action_param action = { { NULL } };
+	struct ratelimiter_entry *entry, *existing;
+	struct hlist_head *bucket;
+	__be64 ip;
+	bool is_v6, ret;
+
 	if (unlikely(skb->len < sizeof(struct iphdr)))
 		return false;
 	if (ip_hdr(skb)->version == 4) {
-		action.match = v4_match;
-		action.matchinfo = &ratelimiter->v4_info;
-		action.thoff = ip_hdrlen(skb);
+		ip = (__force __be64)ip_hdr(skb)->saddr;
+		is_v6 = false;
 	}
 #if IS_ENABLED(CONFIG_IPV6)
-	else if (ip_hdr(skb)->version == 6) {
-		action.match = v6_match;
-		action.matchinfo = &ratelimiter->v6_info;
+	else if (ip_hdr(skb)->version == 6 && skb->len >= sizeof(struct ipv6hdr)) {
+		memcpy(&ip, &ipv6_hdr(skb)->saddr, sizeof(ip));
+		is_v6 = true;
 	}
 #endif
 	else
 		return false;
-	return action.match->match(skb, &action);
+	bucket = &ratelimiter->table[siphash_2u64((__force u64)ip, is_v6, ratelimiter->key) & ratelimiter->table_mask];
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(entry, bucket, hash) {
+		if (entry->ip != ip || entry->is_v6 != is_v6)
+			continue;
+		ret = entry_allow(entry);
+		rcu_read_unlock();
+		return ret;
+	}
+	rcu_read_unlock();
+
+	/* When the table is full, new sources are refused until the worker frees up room. */
+	if (atomic_inc_return(&ratelimiter->total_entries) > ratelimiter->max_entries)
+		goto err_oom;
+	entry = kmalloc(sizeof(*entry), GFP_ATOMIC);
+	if (!entry)
+		goto err_oom;
+	entry->ip = ip;
+	entry->is_v6 = is_v6;
+	entry->last_time_ns = ktime_get_ns();
+	entry->tokens = RATELIMITER_TOKEN_MAX - RATELIMITER_PACKET_COST;
+	spin_lock_init(&entry->lock);
+	spin_lock_bh(&ratelimiter->table_lock);
+	/* Another packet from the same source may have added it since we looked, in which case
+	 * that entry gets charged instead, as otherwise the source would get two full buckets. */
+	hlist_for_each_entry(existing, bucket, hash) {
+		if (existing->ip != ip || existing->is_v6 != is_v6)
+			continue;
+		ret = entry_allow(existing);
+		spin_unlock_bh(&ratelimiter->table_lock);
+		kfree(entry);
+		atomic_dec(&ratelimiter->total_entries);
+		return ret;
+	}
+	hlist_add_head_rcu(&entry->hash, bucket);
+	spin_unlock_bh(&ratelimiter->table_lock);
+	queue_delayed_work(system_power_efficient_wq, &ratelimiter->gc_work, HZ);
+	return true;
+
+err_oom:
+	atomic_dec(&ratelimiter->total_entries);
+	return false;
 }
 
-int ratelimiter_module_init(void)
+int ratelimiter_init(struct ratelimiter *ratelimiter)
 {
-	v4_match = xt_request_find_match(NFPROTO_IPV4, "hashlimit", 1);
-	if (IS_ERR(v4_match)) {
-		pr_err("The xt_hashlimit module for IPv4 is required\n");
-		return PTR_ERR(v4_match);
-	}
-#if IS_ENABLED(CONFIG_IPV6)
-	v6_match = xt_request_find_match(NFPROTO_IPV6, "hashlimit", 1);
-	if (IS_ERR(v6_match)) {
-		pr_err("The xt_hashlimit module for IPv6 is required\n");
-		module_put(v4_match->me);
-		return PTR_ERR(v6_match);
-	}
-#endif
+	unsigned int table_size;
+
+	memset(ratelimiter, 0, sizeof(struct ratelimiter));
+
+	/* By default, we size the table to about 1/16384 of memory, up to 8192 buckets, and
+	 * track at most 8 sources per bucket on average. A size that is asked for is capped at
+	 * 2^18 buckets, past which the chains just get longer, rather than the allocation failing. */
+	if (ratelimiter_max_entries)
+		table_size = clamp_t(unsigned int, roundup_pow_of_two(DIV_ROUND_UP(ratelimiter_max_entries, RATELIMITER_ENTRIES_PER_BUCKET)), 16, RATELIMITER_MAX_CONFIGURED_TABLE_SIZE);
+	else
+		table_size = clamp_t(unsigned long, roundup_pow_of_two(((unsigned long)totalram_pages << PAGE_SHIFT) / (1U << 14) / sizeof(struct hlist_head)), 16, RATELIMITER_MAX_TABLE_SIZE);
+	ratelimiter->max_entries = ratelimiter_max_entries ?: table_size * RATELIMITER_ENTRIES_PER_BUCKET;
+	ratelimiter->table_mask = table_size - 1;
+
+	ratelimiter->table = kcalloc(table_size, sizeof(struct hlist_head), GFP_KERNEL | __GFP_NOWARN);
+	if (!ratelimiter->table)
+		ratelimiter->table = vzalloc(table_size * sizeof(struct hlist_head));
+	if (!ratelimiter->table)
+		return -ENOMEM;
+
+	spin_lock_init(&ratelimiter->table_lock);
+	get_random_bytes(ratelimiter->key, sizeof(ratelimiter->key));
+	INIT_DELAYED_WORK(&ratelimiter->gc_work, gc_entries);
 	return 0;
 }
 
-void ratelimiter_module_deinit(void)
+void ratelimiter_uninit(struct ratelimiter *ratelimiter)
 {
-	module_put(v4_match->me);
-#if IS_ENABLED(CONFIG_IPV6)
-	module_put(v6_match->me);
-#endif
+	struct ratelimiter_entry *entry;
+	struct hlist_node *temp;
+	unsigned int i;
+
+	cancel_delayed_work_sync(&ratelimiter->gc_work);
+	for (i = 0; i <= ratelimiter->table_mask; ++i) {
+		hlist_for_each_entry_safe(entry, temp, &ratelimiter->table[i], hash) {
+			hlist_del_rcu(&entry->hash);
+			kfree_rcu(entry, rcu);
+		}
+	}
+	kvfree(ratelimiter->table);
+	ratelimiter->table = NULL;
 }
+
+#include "selftest/ratelimiter.h"
@@ -3,24 +3,29 @@
 #ifndef RATELIMITER_H
 #define RATELIMITER_H
 
-#include <uapi/linux/netfilter/xt_hashlimit.h>
+#include "crypto/siphash.h"
+
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
 
-struct wireguard_device;
 struct sk_buff;
 
 struct ratelimiter {
-	struct net *net;
-	struct xt_hashlimit_mtinfo1 v4_info;
-#if IS_ENABLED(CONFIG_IPV6)
-	struct xt_hashlimit_mtinfo1 v6_info;
-#endif
+	struct hlist_head *table;
+	unsigned int table_mask, max_entries;
+	atomic_t total_entries;
+	spinlock_t table_lock;
+	siphash_key_t key;
+	struct delayed_work gc_work;
 };
 
-int ratelimiter_init(struct ratelimiter *ratelimiter, struct wireguard_device *wg);
+int ratelimiter_init(struct ratelimiter *ratelimiter);
 void ratelimiter_uninit(struct ratelimiter *ratelimiter);
 bool ratelimiter_allow(struct ratelimiter *ratelimiter, struct sk_buff *skb);
 
-int ratelimiter_module_init(void);
-void ratelimiter_module_deinit(void);
+#ifdef DEBUG
+bool ratelimiter_selftest(void);
+#endif
 
 #endif
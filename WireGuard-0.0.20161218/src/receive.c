@@ -20,7 +20,7 @@ static inline void rx_stats(struct wireguard_peer *peer, size_t len)
 	++tstats->rx_packets;
 	u64_stats_update_end(&tstats->syncp);
 	put_cpu_ptr(tstats);
-	peer->rx_bytes += len;
+	peer_stats_add_packet(peer, rx, len);
 }
 
 static inline void update_latest_addr(struct wireguard_peer *peer, struct sk_buff *skb)
@@ -70,41 +70,43 @@ static inline int skb_data_offset(struct sk_buff *skb, size_t *data_offset, size
 	return 0;
 }
 
-static void receive_handshake_packet(struct wireguard_device *wg, void *data, size_t len, struct sk_buff *skb)
+/* Decides what to do with a handshake packet, given what cookie_validate_packet said about its
+ * macs: invalid ones are dropped, and when we're under load, ones without a valid cookie get a
+ * cookie reply instead of an answer. Returns whether it should go on to receive_handshake_packet. */
+static bool validate_handshake_packet(struct wireguard_device *wg, void *data, size_t len, struct sk_buff *skb, enum cookie_mac_state mac_state, bool under_load)
 {
-	struct wireguard_peer *peer = NULL;
-	enum message_type message_type;
-	bool under_load;
-	enum cookie_mac_state mac_state;
+	enum message_type message_type = message_determine_type(data, len);
 	bool packet_needs_cookie;
 
-	message_type = message_determine_type(data, len);
-
-	if (message_type == MESSAGE_HANDSHAKE_COOKIE) {
-		net_dbg_skb_ratelimited("Receiving cookie response from %pISpfsc\n", skb);
-		cookie_message_consume(data, wg);
-		return;
-	}
-
-	under_load = skb_queue_len(&wg->incoming_handshakes) >= MAX_QUEUED_INCOMING_HANDSHAKES / 2;
-	mac_state = cookie_validate_packet(&wg->cookie_checker, skb, data, len, under_load);
 	if ((under_load && mac_state == VALID_MAC_WITH_COOKIE) || (!under_load && mac_state == VALID_MAC_BUT_NO_COOKIE))
 		packet_needs_cookie = false;
 	else if (under_load && mac_state == VALID_MAC_BUT_NO_COOKIE)
 		packet_needs_cookie = true;
 	else {
 		net_dbg_skb_ratelimited("Invalid MAC of handshake, dropping packet from %pISpfsc\n", skb);
-		return;
+		return false;
 	}
 
-	switch (message_type) {
-	case MESSAGE_HANDSHAKE_INITIATION:
-		if (packet_needs_cookie) {
+	if (packet_needs_cookie) {
+		if (message_type == MESSAGE_HANDSHAKE_INITIATION) {
 			struct message_handshake_initiation *message = data;
 			packet_send_handshake_cookie(wg, skb, message, sizeof(*message), message->sender_index);
-			return;
+		} else if (message_type == MESSAGE_HANDSHAKE_RESPONSE) {
+			struct message_handshake_response *message = data;
+			packet_send_handshake_cookie(wg, skb, message, sizeof(*message), message->sender_index);
 		}
-		peer = noise_handshake_consume_initiation(data, wg);
+		return false;
+	}
+	return true;
+}
+
+static void receive_handshake_packet(struct wireguard_device *wg, void *data, size_t len, struct sk_buff *skb, const struct noise_precomputed_dh *es)
+{
+	struct wireguard_peer *peer = NULL;
+
+	switch (message_determine_type(data, len)) {
+	case MESSAGE_HANDSHAKE_INITIATION:
+		peer = noise_handshake_consume_initiation(data, wg, es);
 		if (unlikely(!peer)) {
 			net_dbg_skb_ratelimited("Invalid handshake initiation from %pISpfsc\n", skb);
 			return;
@@ -114,11 +116,6 @@ static void receive_handshake_packet(struct wireguard_device *wg, void *data, si
 		packet_send_handshake_response(peer);
 		break;
 	case MESSAGE_HANDSHAKE_RESPONSE:
-		if (packet_needs_cookie) {
-			struct message_handshake_response *message = data;
-			packet_send_handshake_cookie(wg, skb, message, sizeof(*message), message->sender_index);
-			return;
-		}
 		peer = noise_handshake_consume_response(data, wg);
 		if (unlikely(!peer)) {
 			net_dbg_skb_ratelimited("Invalid handshake response from %pISpfsc\n", skb);
@@ -150,22 +147,141 @@ static void receive_handshake_packet(struct wireguard_device *wg, void *data, si
 	peer_put(peer);
 }
 
-void packet_process_queued_handshake_packets(struct work_struct *work)
+static void packet_process_queued_handshake_packets(struct work_struct *work)
 {
-	struct wireguard_device *wg = container_of(work, struct wireguard_device, incoming_handshakes_work);
+	struct handshake_worker *worker = container_of(work, struct handshake_worker, work);
+	struct wireguard_device *wg = worker->wg;
+	struct sk_buff *initiation_skbs[MAX_BURST_INCOMING_HANDSHAKES];
+	void *initiation_data[MAX_BURST_INCOMING_HANDSHAKES];
+	enum cookie_mac_state initiation_mac_states[MAX_BURST_INCOMING_HANDSHAKES];
+	struct message_handshake_initiation *initiations[MAX_BURST_INCOMING_HANDSHAKES];
+	struct noise_precomputed_dh *dh[MAX_BURST_INCOMING_HANDSHAKES];
+	bool under_load = atomic_read(&wg->incoming_handshake_count) >= MAX_QUEUED_INCOMING_HANDSHAKES / 2;
+	struct handshake_batch_entry *entry;
+	enum cookie_mac_state mac_state;
 	struct sk_buff *skb;
 	size_t len, offset;
-	size_t num_processed = 0;
+	size_t i, j, num_dequeued, num = 0, num_accepted = 0, num_initiations = 0;
+
+	/* Take a burst off the queue, dealing with cookie replies straight away, since there's
+	 * nothing more to check about those. */
+	for (num_dequeued = 0; num_dequeued < MAX_BURST_INCOMING_HANDSHAKES && (skb = skb_dequeue(&worker->queue)) != NULL; ++num_dequeued) {
+		atomic_dec(&wg->incoming_handshake_count);
+		if (skb_data_offset(skb, &offset, &len) < 0) {
+			dev_kfree_skb(skb);
+			continue;
+		}
+		switch (message_determine_type(skb->data + offset, len)) {
+		case MESSAGE_HANDSHAKE_COOKIE:
+			net_dbg_skb_ratelimited("Receiving cookie response from %pISpfsc\n", skb);
+			cookie_message_consume(skb->data + offset, wg);
+			dev_kfree_skb(skb);
+			continue;
+		case MESSAGE_HANDSHAKE_INITIATION:
+			initiation_skbs[num_initiations] = skb;
+			initiation_data[num_initiations++] = skb->data + offset;
+			break;
+		default:
+			break;
+		}
+		entry = &worker->batch[num++];
+		entry->skb = skb;
+		entry->data = skb->data + offset;
+		entry->len = len;
+	}
 
-	while ((skb = skb_dequeue(&wg->incoming_handshakes)) != NULL) {
-		if (!skb_data_offset(skb, &offset, &len))
-			receive_handshake_packet(wg, skb->data + offset, len, skb);
-		dev_kfree_skb(skb);
-		if (++num_processed == MAX_BURST_INCOMING_HANDSHAKES) {
-			queue_work(wg->workqueue, &wg->incoming_handshakes_work);
-			return;
+	/* Initiations all have the same length, so their mac1s can be computed together. */
+	if (num_initiations)
+		cookie_validate_packets(&wg->cookie_checker, initiation_mac_states, initiation_skbs, initiation_data, sizeof(struct message_handshake_initiation), num_initiations, under_load);
+
+	/* Then weed out everything that doesn't go on to need any curve25519, so that what's left
+	 * can have the es of its initiations computed together, several at a time. */
+	num_initiations = 0;
+	for (i = 0, j = 0; i < num; ++i) {
+		entry = &worker->batch[i];
+		if (message_determine_type(entry->data, entry->len) == MESSAGE_HANDSHAKE_INITIATION)
+			mac_state = initiation_mac_states[j++];
+		else
+			mac_state = cookie_validate_packet(&wg->cookie_checker, entry->skb, entry->data, entry->len, under_load);
+		if (!validate_handshake_packet(wg, entry->data, entry->len, entry->skb, mac_state, under_load)) {
+			dev_kfree_skb(entry->skb);
+			continue;
 		}
+		if (num_accepted != i)
+			worker->batch[num_accepted] = *entry;
+		entry = &worker->batch[num_accepted++];
+		entry->es.valid = false;
+		if (message_determine_type(entry->data, entry->len) == MESSAGE_HANDSHAKE_INITIATION) {
+			initiations[num_initiations] = entry->data;
+			dh[num_initiations++] = &entry->es;
+		}
+	}
+
+	if (num_initiations)
+		noise_handshake_precompute_initiations(dh, initiations, num_initiations, wg);
+
+	for (i = 0; i < num_accepted; ++i) {
+		entry = &worker->batch[i];
+		receive_handshake_packet(wg, entry->data, entry->len, entry->skb, &entry->es);
+		memzero_explicit(&entry->es, sizeof(entry->es));
+		dev_kfree_skb(entry->skb);
+	}
+
+	/* The workqueue is per-cpu, so this puts us back on the end of this CPU's list. */
+	if (!skb_queue_empty(&worker->queue))
+		queue_work(wg->handshake_receive_wq, work);
+}
+
+/* Each CPU has its own handshake queue, so that a flood of handshakes gets all CPUs
+ * computing curve25519 rather than one. Packets are steered by the hash of their flow,
+ * so that the handshakes of any given peer are still processed in order, on one CPU. */
+static inline int handshake_cpu(struct sk_buff *skb)
+{
+	unsigned int n = reciprocal_scale(skb_get_hash(skb), num_online_cpus());
+	int cpu;
+
+	for_each_online_cpu(cpu) {
+		if (!n--)
+			return cpu;
+	}
+	return cpumask_first(cpu_online_mask);
+}
+
+int packet_init_handshake_queues(struct wireguard_device *wg)
+{
+	struct handshake_worker *worker;
+	int cpu;
+
+	wg->incoming_handshakes = alloc_percpu(struct handshake_worker);
+	if (!wg->incoming_handshakes)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		worker = per_cpu_ptr(wg->incoming_handshakes, cpu);
+		skb_queue_head_init(&worker->queue);
+		INIT_WORK(&worker->work, packet_process_queued_handshake_packets);
+		worker->wg = wg;
 	}
+	atomic_set(&wg->incoming_handshake_count, 0);
+	return 0;
+}
+
+void packet_purge_handshake_queues(struct wireguard_device *wg)
+{
+	struct sk_buff *skb;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		while ((skb = skb_dequeue(&per_cpu_ptr(wg->incoming_handshakes, cpu)->queue)) != NULL) {
+			atomic_dec(&wg->incoming_handshake_count);
+			dev_kfree_skb(skb);
+		}
+	}
+}
+
+void packet_uninit_handshake_queues(struct wireguard_device *wg)
+{
+	packet_purge_handshake_queues(wg);
+	free_percpu(wg->incoming_handshakes);
 }
 
 static void keep_key_fresh(struct wireguard_peer *peer)
@@ -188,16 +304,12 @@ static void keep_key_fresh(struct wireguard_peer *peer)
 	}
 }
 
-struct packet_cb {
-	u8 ds;
-};
-#define PACKET_CB(skb) ((struct packet_cb *)skb->cb)
-
 static void receive_data_packet(struct sk_buff *skb, struct wireguard_peer *peer, struct endpoint *endpoint, bool used_new_key, int err)
 {
 	struct net_device *dev;
 	struct wireguard_peer *routed_peer;
 	struct wireguard_device *wg;
+	unsigned int len;
 
 	if (unlikely(err < 0 || !peer || !endpoint)) {
 		dev_kfree_skb(skb);
@@ -225,6 +337,7 @@ static void receive_data_packet(struct sk_buff *skb, struct wireguard_peer *peer
 	if (!pskb_may_pull(skb, 1 /* For checking the ip version below */)) {
 		++dev->stats.rx_errors;
 		++dev->stats.rx_length_errors;
+		peer_stats_add(peer, rx_dropped_length, 1);
 		net_dbg_ratelimited("Packet missing IP version from peer %Lu (%pISpfsc)\n", peer->internal_id, &peer->endpoint.addr);
 		goto packet_processed;
 	}
@@ -242,6 +355,7 @@ static void receive_data_packet(struct sk_buff *skb, struct wireguard_peer *peer
 	} else {
 		++dev->stats.rx_errors;
 		++dev->stats.rx_length_errors;
+		peer_stats_add(peer, rx_dropped_length, 1);
 		net_dbg_ratelimited("Packet neither ipv4 nor ipv6 from peer %Lu (%pISpfsc)\n", peer->internal_id, &peer->endpoint.addr);
 		goto packet_processed;
 	}
@@ -254,17 +368,17 @@ static void receive_data_packet(struct sk_buff *skb, struct wireguard_peer *peer
 	if (unlikely(routed_peer != peer)) {
 		++dev->stats.rx_errors;
 		++dev->stats.rx_frame_errors;
+		peer_stats_add(peer, rx_dropped_source, 1);
 		net_dbg_skb_ratelimited("Packet has unallowed src IP (%pISc) from peer %Lu (%pISpfsc)\n", skb, peer->internal_id, &peer->endpoint.addr);
 		goto packet_processed;
 	}
 
 	dev->last_rx = jiffies;
-	if (likely(netif_rx(skb) == NET_RX_SUCCESS))
-		rx_stats(peer, skb->len);
-	else {
-		++dev->stats.rx_dropped;
-		net_dbg_ratelimited("Failed to give packet to userspace from peer %Lu (%pISpfsc)\n", peer->internal_id, &peer->endpoint.addr);
-	}
+	len = skb->len;
+	/* This re-aggregates consecutive inner packets with GRO before they reach the stack.
+	 * gro_cells counts its own drops in dev->rx_dropped, so only deliveries count here. */
+	if (likely(gro_cells_receive(&wg->gro_cells, skb) == NET_RX_SUCCESS))
+		rx_stats(peer, len);
 	goto continue_processing;
 
 packet_processed:
@@ -277,7 +391,9 @@ continue_processing:
 
 void packet_receive(struct wireguard_device *wg, struct sk_buff *skb)
 {
+	struct handshake_worker *worker;
 	size_t len, offset;
+	int cpu;
 
 	if (unlikely(skb_data_offset(skb, &offset, &len) < 0))
 		goto err;
@@ -285,7 +401,7 @@ void packet_receive(struct wireguard_device *wg, struct sk_buff *skb)
 	case MESSAGE_HANDSHAKE_INITIATION:
 	case MESSAGE_HANDSHAKE_RESPONSE:
 	case MESSAGE_HANDSHAKE_COOKIE:
-		if (skb_queue_len(&wg->incoming_handshakes) > MAX_QUEUED_INCOMING_HANDSHAKES) {
+		if (atomic_read(&wg->incoming_handshake_count) > MAX_QUEUED_INCOMING_HANDSHAKES) {
 			net_dbg_skb_ratelimited("Too many handshakes queued, dropping packet from %pISpfsc\n", skb);
 			goto err;
 		}
@@ -293,9 +409,12 @@ void packet_receive(struct wireguard_device *wg, struct sk_buff *skb)
 			net_dbg_skb_ratelimited("Unable to linearize handshake skb from %pISpfsc\n", skb);
 			goto err;
 		}
-		skb_queue_tail(&wg->incoming_handshakes, skb);
+		cpu = handshake_cpu(skb);
+		worker = per_cpu_ptr(wg->incoming_handshakes, cpu);
+		atomic_inc(&wg->incoming_handshake_count);
+		skb_queue_tail(&worker->queue, skb);
 		/* Queues up a call to packet_process_queued_handshake_packets(skb): */
-		queue_work(wg->workqueue, &wg->incoming_handshakes_work);
+		queue_work_on(cpu, wg->handshake_receive_wq, &worker->work);
 		break;
 	case MESSAGE_DATA:
 		PACKET_CB(skb)->ds = ip_tunnel_get_dsfield(ip_hdr(skb), skb);
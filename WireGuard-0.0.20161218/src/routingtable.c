@@ -3,10 +3,18 @@
 #include "routingtable.h"
 #include "peer.h"
 
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/u64_stats_sync.h>
+
 struct routing_table_node {
 	struct routing_table_node __rcu *bit[2];
 	struct rcu_head rcu;
 	struct wireguard_peer *peer;
+	u64 generation;
 	u8 cidr;
 	u8 bit_at_a, bit_at_b;
 	bool incidental;
@@ -73,6 +81,7 @@ static bool walk_remove_by_peer(struct routing_table_node __rcu **top, struct wi
 	struct routing_table_node __rcu **nptr;
 	struct routing_table_node *node = NULL;
 	struct routing_table_node *prev = NULL;
+	struct routing_table_node *parent;
 	unsigned int len = 0;
 	bool ret = false;
 
@@ -93,6 +102,7 @@ static bool walk_remove_by_peer(struct routing_table_node __rcu **top, struct wi
 			if (ref(node->bit[1]))
 				push(&node->bit[1]);
 		} else {
+			--len;
 			if (node->peer == peer) {
 				ret = true;
 				node->peer = NULL;
@@ -103,9 +113,15 @@ static bool walk_remove_by_peer(struct routing_table_node __rcu **top, struct wi
 					rcu_assign_pointer(node->bit[0], NULL);
 					rcu_assign_pointer(node->bit[1], NULL);
 					free_node(node, lock);
+					/* The parent no longer points to node, so if node was its first child, make it see
+					 * whatever replaced node as where we came from, so that it goes on to its second. */
+					parent = len ? rcu_dereference_protected(*stack[len - 1], lockdep_is_held(lock)) : NULL;
+					if (parent && nptr == &parent->bit[0]) {
+						prev = rcu_dereference_protected(*nptr, lockdep_is_held(lock));
+						continue;
+					}
 				}
 			}
-			--len;
 		}
 		prev = node;
 	}
@@ -188,6 +204,233 @@ static inline struct routing_table_node *find_node(struct routing_table_node *tr
 	return found;
 }
 
+/* The binary trie above is what we modify, but lookups go through a level-compressed
+ * copy of it, built off-line once updates have settled and published with RCU. Each
+ * lc_node consumes a whole byte of the address, so that a lookup takes at most 4 or
+ * 16 dependent loads. The 256 slots of a node are compressed Poptrie-style: a slot
+ * either has a child, found by the rank of its bit in child_bitmap, or resolves to
+ * a leaf holding the longest match, and since neighbouring slots mostly share their
+ * longest match, leaves are stored once per run of equal slots, found by the rank of
+ * the slot in leaf_bitmap, which marks the start of each run. While a copy is being
+ * rebuilt, lookups fall back to find_node(). */
+enum { LC_STRIDE = 8, LC_FANOUT = 1 << LC_STRIDE, LC_MAX_LEVELS = 128 / LC_STRIDE, LC_REBUILD_DELAY = HZ / 10 };
+
+struct lc_node {
+	u64 child_bitmap[LC_FANOUT / 64];
+	u64 leaf_bitmap[LC_FANOUT / 64];
+	u32 child_base, leaf_base;
+};
+
+struct lc_trie {
+	struct rcu_head rcu;
+	struct lc_node *nodes;
+	struct wireguard_peer **leaves;
+};
+
+struct lc_builder {
+	struct lc_trie *lc; /* NULL while we're only counting */
+	u32 node_count, leaf_count;
+	struct wireguard_peer *slots[LC_MAX_LEVELS][LC_FANOUT];
+	struct routing_table_node *roots[LC_MAX_LEVELS][LC_FANOUT][2];
+	struct routing_table_node *stack[128];
+};
+
+/* Returns the number of bits set in bitmap at or below slot. */
+static inline unsigned int lc_rank(const u64 *bitmap, u8 slot)
+{
+	unsigned int i, rank = 0;
+	for (i = 0; i < slot / 64; ++i)
+		rank += hweight64(bitmap[i]);
+	return rank + hweight64(bitmap[slot / 64] & (~0ULL >> (63 - slot % 64)));
+}
+
+static inline struct wireguard_peer *lc_lookup(const struct lc_trie *lc, const u8 *key)
+{
+	const struct lc_node *node = &lc->nodes[0];
+	u8 slot;
+
+	for (;; ++key) {
+		slot = *key;
+		if (!(node->child_bitmap[slot / 64] & (1ULL << (slot % 64))))
+			return lc->leaves[node->leaf_base + lc_rank(node->leaf_bitmap, slot) - 1];
+		node = &lc->nodes[node->child_base + lc_rank(node->child_bitmap, slot) - 1];
+	}
+}
+
+#define push(p) do { \
+	struct routing_table_node *next = rcu_dereference_protected(p, lockdep_is_held(lock)); \
+	if (next) { \
+		BUG_ON(len >= 128); \
+		b->stack[len++] = next; \
+	} \
+} while (0)
+/* Fills in the node at index, for the byte at level, from the binary subtries in roots,
+ * whose prefixes are all longer than level * 8 bits. Prefixes ending within this byte
+ * are expanded into the slots they cover, which we do in pre-order so that longer ones
+ * override shorter ones, and prefixes going beyond it become the roots of a child. */
+static void lc_build_node(struct lc_builder *b, u32 index, unsigned int level, struct wireguard_peer *inherited, struct routing_table_node *const roots[2], struct mutex *lock)
+{
+	struct wireguard_peer **slots = b->slots[level];
+	struct routing_table_node *(*child_roots)[2] = b->roots[level];
+	struct lc_node *lc_node = b->lc ? &b->lc->nodes[index] : NULL;
+	unsigned int depth = (level + 1) * LC_STRIDE, len = 0, i, count, children = 0, runs = 0;
+	struct routing_table_node *node;
+	u32 child_base, leaf_base;
+	u8 slot;
+
+	for (i = 0; i < LC_FANOUT; ++i) {
+		slots[i] = inherited;
+		child_roots[i][0] = child_roots[i][1] = NULL;
+	}
+
+	for (i = 0; i < 2; ++i) {
+		if (roots[i])
+			b->stack[len++] = roots[i];
+	}
+	while (len > 0) {
+		node = b->stack[--len];
+		if (node->cidr > depth) {
+			slot = node->bits[level];
+			/* Only a node ending exactly at depth can give a slot two subtries. */
+			child_roots[slot][child_roots[slot][0] ? 1 : 0] = node;
+			continue;
+		}
+		if (!node->incidental) {
+			count = 1U << (depth - node->cidr);
+			slot = node->bits[level] & ~(count - 1);
+			for (i = 0; i < count; ++i)
+				slots[slot + i] = node->peer;
+		}
+		push(node->bit[0]);
+		push(node->bit[1]);
+	}
+
+	for (i = 0; i < LC_FANOUT; ++i) {
+		if (child_roots[i][0])
+			++children;
+		if (!i || slots[i] != slots[i - 1])
+			++runs;
+	}
+	child_base = b->node_count;
+	b->node_count += children;
+	leaf_base = b->leaf_count;
+	b->leaf_count += runs;
+
+	if (lc_node) {
+		memset(lc_node, 0, sizeof(*lc_node));
+		lc_node->child_base = child_base;
+		lc_node->leaf_base = leaf_base;
+		for (i = 0, runs = 0; i < LC_FANOUT; ++i) {
+			if (child_roots[i][0])
+				lc_node->child_bitmap[i / 64] |= 1ULL << (i % 64);
+			if (!i || slots[i] != slots[i - 1]) {
+				lc_node->leaf_bitmap[i / 64] |= 1ULL << (i % 64);
+				b->lc->leaves[leaf_base + runs++] = slots[i];
+			}
+		}
+	}
+
+	for (i = 0, children = 0; i < LC_FANOUT; ++i) {
+		if (child_roots[i][0])
+			lc_build_node(b, child_base + children++, level + 1, slots[i], child_roots[i], lock);
+	}
+}
+#undef push
+
+static struct lc_trie *lc_build(struct lc_builder *b, struct routing_table_node *root, struct mutex *lock)
+{
+	struct routing_table_node *const roots[2] = { root, NULL };
+	struct lc_trie *lc;
+	size_t size;
+
+	b->lc = NULL;
+	b->node_count = 1;
+	b->leaf_count = 0;
+	lc_build_node(b, 0, 0, NULL, roots, lock);
+
+	size = sizeof(*lc) + sizeof(struct lc_node) * b->node_count + sizeof(struct wireguard_peer *) * b->leaf_count;
+	lc = kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	if (!lc)
+		lc = vmalloc(size);
+	if (!lc)
+		return NULL;
+	lc->nodes = (struct lc_node *)(lc + 1);
+	lc->leaves = (struct wireguard_peer **)(lc->nodes + b->node_count);
+
+	b->lc = lc;
+	b->node_count = 1;
+	b->leaf_count = 0;
+	lc_build_node(b, 0, 0, NULL, roots, lock);
+	return lc;
+}
+
+static void lc_free_rcu(struct rcu_head *rcu)
+{
+	kvfree(container_of(rcu, struct lc_trie, rcu));
+}
+
+static void lc_replace(struct lc_trie __rcu **lc_ptr, struct lc_trie *new, struct mutex *lock)
+{
+	struct lc_trie *old = rcu_dereference_protected(*lc_ptr, lockdep_is_held(lock));
+	rcu_assign_pointer(*lc_ptr, new);
+	if (old)
+		call_rcu(&old->rcu, lc_free_rcu);
+}
+
+static void lc_rebuild(struct routing_table *table)
+{
+	struct lc_builder *b;
+
+	lockdep_assert_held(&table->table_update_lock);
+	b = vmalloc(sizeof(*b));
+	if (!b)
+		return; /* Lookups are still correct through the binary trie, just slower. */
+	if (!rcu_access_pointer(table->lc4))
+		lc_replace(&table->lc4, lc_build(b, rcu_dereference_protected(table->root4, lockdep_is_held(&table->table_update_lock)), &table->table_update_lock), &table->table_update_lock);
+	if (!rcu_access_pointer(table->lc6))
+		lc_replace(&table->lc6, lc_build(b, rcu_dereference_protected(table->root6, lockdep_is_held(&table->table_update_lock)), &table->table_update_lock), &table->table_update_lock);
+	vfree(b);
+}
+
+static void lc_rebuild_work(struct work_struct *work)
+{
+	struct routing_table *table = container_of(to_delayed_work(work), struct routing_table, lc_rebuild_work);
+
+	mutex_lock(&table->table_update_lock);
+	lc_rebuild(table);
+	mutex_unlock(&table->table_update_lock);
+}
+
+/* Consecutive packets mostly go to the same few addresses, so lookup_dst() and lookup_src()
+ * first try a small direct-mapped per-CPU cache of address to peer. Entries are only
+ * valid for the generation of the table they were filled in, which is bumped after
+ * every change, so a cached peer is never newer than its removal from the table. */
+enum { ROUTING_TABLE_CACHE_BITS = 6, ROUTING_TABLE_CACHE_SIZE = 1 << ROUTING_TABLE_CACHE_BITS };
+
+struct routing_table_cache_entry {
+	struct wireguard_peer *peer;
+	unsigned long generation;
+	u8 len;
+	u8 ip[16];
+};
+
+struct routing_table_cache {
+	struct routing_table_cache_entry entries[ROUTING_TABLE_CACHE_SIZE];
+	u64 hits, misses;
+	struct u64_stats_sync syncp;
+};
+
+/* Must be called after every change to the binary trie behind lc_ptr. The rebuild is
+ * pushed back by each further change, so that a burst of updates only costs one. */
+static void invalidate_lookups(struct routing_table *table, struct lc_trie __rcu **lc_ptr)
+{
+	lc_replace(lc_ptr, NULL, &table->table_update_lock);
+	mod_delayed_work(system_wq, &table->lc_rebuild_work, LC_REBUILD_DELAY);
+	/* Pairs with the smp_rmb() in lookup_cached(). */
+	smp_wmb();
+	WRITE_ONCE(table->cache_generation, table->cache_generation + 1);
+}
+
 static inline bool node_placement(struct routing_table_node __rcu *trie, const u8 *key, u8 cidr, struct routing_table_node **rnode, struct mutex *lock)
 {
 	bool exact = false;
@@ -205,7 +448,7 @@ static inline bool node_placement(struct routing_table_node __rcu *trie, const u
 	return exact;
 }
 
-static int add(struct routing_table_node __rcu **trie, u8 bits, const u8 *key, u8 cidr, struct wireguard_peer *peer, struct mutex *lock)
+static int add(struct routing_table_node __rcu **trie, u8 bits, const u8 *key, u8 cidr, struct wireguard_peer *peer, u64 generation, struct mutex *lock)
 {
 	struct routing_table_node *node, *parent, *down, *newnode;
 	int bits_in_common;
@@ -215,6 +458,7 @@ static int add(struct routing_table_node __rcu **trie, u8 bits, const u8 *key, u
 		if (!node)
 			return -ENOMEM;
 		node->peer = peer;
+		node->generation = generation;
 		memcpy(node->bits, key, (cidr + 7) / 8);
 		/* Not strictly neccessary for the data structure, but helps keep the data cleaner: */
 		node->bits[(cidr + 7) / 8 - 1] &= 0xff << ((8 - (cidr % 8)) % 8);
@@ -226,6 +470,7 @@ static int add(struct routing_table_node __rcu **trie, u8 bits, const u8 *key, u
 		/* exact match */
 		node->incidental = false;
 		node->peer = peer;
+		node->generation = generation;
 		return 0;
 	}
 
@@ -233,6 +478,7 @@ static int add(struct routing_table_node __rcu **trie, u8 bits, const u8 *key, u
 	if (!newnode)
 		return -ENOMEM;
 	newnode->peer = peer;
+	newnode->generation = generation;
 	memcpy(newnode->bits, key, (cidr + 7) / 8);
 	/* Not strictly neccessary for the data structure, but helps keep the data cleaner: */
 	newnode->bits[(cidr + 7) / 8 - 1] &= 0xff << ((8 - (cidr % 8)) % 8);
@@ -348,54 +594,309 @@ static int walk_ips_by_peer(struct routing_table_node *top, int family, void *ct
 }
 #undef push
 
-void routing_table_init(struct routing_table *table)
+/* Between routing_table_begin_update() and routing_table_end_update(), changes go to a
+ * private copy of each trie, made the first time that trie is changed, and all of them
+ * are then published at once with a single pointer swap, so that lookups never see
+ * half of a large configuration change, and the compiled tries are rebuilt only once.
+ * Making the copy costs as much as changing every prefix, so callers should only stage
+ * changes that are large compared to the table.
+ *
+ * routing_table_stale_by_peer() doesn't go looking for a peer's prefixes, which would
+ * make replacing the prefixes of every peer quadratic. Instead, every node records the
+ * generation in which it was last inserted, and marking a peer stale just stamps it with
+ * a newer generation. Re-inserting a prefix then revives its node, and once everything
+ * is in, a single pass at publishing drops every node older than its peer. */
+#define push(p) do { \
+	struct routing_table_node *next = rcu_dereference_protected(p, lockdep_is_held(lock)); \
+	if (next) { \
+		BUG_ON(len >= 128); \
+		stack[len++] = next; \
+	} \
+} while (0)
+static int copy_trie(struct routing_table_node __rcu **copy, struct routing_table_node *top, u8 bits, struct mutex *lock)
 {
+	struct routing_table_node *stack[128], *node, *child;
+	const size_t size = sizeof(*node) + (bits + 7) / 8;
+	unsigned int len = 0, i;
+
+	RCU_INIT_POINTER(*copy, NULL);
+	if (!top)
+		return 0;
+	node = kmemdup(top, size, GFP_KERNEL);
+	if (!node)
+		return -ENOMEM;
+	RCU_INIT_POINTER(*copy, node);
+	stack[len++] = node;
+	/* Every node on the stack is a copy, still pointing to the original's children. */
+	while (len > 0) {
+		node = stack[--len];
+		for (i = 0; i < 2; ++i) {
+			child = rcu_dereference_protected(node->bit[i], lockdep_is_held(lock));
+			if (!child)
+				continue;
+			child = kmemdup(child, size, GFP_KERNEL);
+			if (!child) {
+				RCU_INIT_POINTER(node->bit[i], NULL);
+				if (!i)
+					RCU_INIT_POINTER(node->bit[1], NULL);
+				goto err;
+			}
+			RCU_INIT_POINTER(node->bit[i], child);
+			push(node->bit[i]);
+		}
+	}
+	return 0;
+
+err:
+	/* Cut every pending copy off from the originals, so that only copies get freed. */
+	while (len > 0) {
+		node = stack[--len];
+		RCU_INIT_POINTER(node->bit[0], NULL);
+		RCU_INIT_POINTER(node->bit[1], NULL);
+	}
+	free_node(rcu_dereference_protected(*copy, lockdep_is_held(lock)), lock);
+	RCU_INIT_POINTER(*copy, NULL);
+	return -ENOMEM;
+}
+
+static void mark_stale(struct routing_table_node *top, struct mutex *lock)
+{
+	struct routing_table_node *stack[128], *node;
+	unsigned int len = 0;
+
+	if (top)
+		stack[len++] = top;
+	while (len > 0) {
+		node = stack[--len];
+		if (node->peer && node->generation < node->peer->routing_table_stale_generation) {
+			node->peer = NULL;
+			node->incidental = true;
+		}
+		push(node->bit[0]);
+		push(node->bit[1]);
+	}
+}
+#undef push
+
+/* Returns where changes to the trie for the given address length should go. */
+static struct routing_table_node __rcu **writable_root(struct routing_table *table, u8 bits)
+{
+	struct routing_table_node __rcu **root = bits == 32 ? &table->root4 : &table->root6;
+	struct routing_table_node __rcu **staged = bits == 32 ? &table->staged4 : &table->staged6;
+	bool *has_staged = bits == 32 ? &table->has_staged4 : &table->has_staged6;
+
+	if (!table->updating)
+		return root;
+	if (!*has_staged) {
+		if (copy_trie(staged, rcu_dereference_protected(*root, lockdep_is_held(&table->table_update_lock)), bits, &table->table_update_lock) < 0)
+			return ERR_PTR(-ENOMEM);
+		*has_staged = true;
+	}
+	return staged;
+}
+
+static void publish_staged(struct routing_table *table, struct routing_table_node __rcu **root, struct routing_table_node __rcu **staged, struct lc_trie __rcu **lc)
+{
+	struct routing_table_node *old = rcu_dereference_protected(*root, lockdep_is_held(&table->table_update_lock));
+
+	mark_stale(rcu_dereference_protected(*staged, lockdep_is_held(&table->table_update_lock)), &table->table_update_lock);
+	/* Passing NULL sweeps out the incidental nodes that mark_stale() left behind. */
+	walk_remove_by_peer(staged, NULL, &table->table_update_lock);
+	rcu_assign_pointer(*root, rcu_dereference_protected(*staged, lockdep_is_held(&table->table_update_lock)));
+	RCU_INIT_POINTER(*staged, NULL);
+	invalidate_lookups(table, lc);
+	free_node(old, &table->table_update_lock);
+}
+
+void routing_table_begin_update(struct routing_table *table)
+{
+	mutex_lock(&table->table_update_lock);
+	table->updating = true;
+	mutex_unlock(&table->table_update_lock);
+}
+
+void routing_table_end_update(struct routing_table *table)
+{
+	mutex_lock(&table->table_update_lock);
+	if (table->has_staged4)
+		publish_staged(table, &table->root4, &table->staged4, &table->lc4);
+	if (table->has_staged6)
+		publish_staged(table, &table->root6, &table->staged6, &table->lc6);
+	table->has_staged4 = table->has_staged6 = false;
+	table->updating = false;
+	mutex_unlock(&table->table_update_lock);
+}
+
+/* Outside of an update, there's nothing to revive anything into, so this just removes the peer's prefixes. */
+int routing_table_stale_by_peer(struct routing_table *table, struct wireguard_peer *peer)
+{
+	int ret = 0;
+
+	mutex_lock(&table->table_update_lock);
+	if (!table->updating) {
+		mutex_unlock(&table->table_update_lock);
+		routing_table_remove_by_peer(table, peer);
+		return 0;
+	}
+	/* Both tries have to be staged, so that the sweep at the end gets to see all of the peer's prefixes. */
+	if (IS_ERR(writable_root(table, 32)) || IS_ERR(writable_root(table, 128))) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	peer->routing_table_stale_generation = ++table->generation;
+out:
+	mutex_unlock(&table->table_update_lock);
+	return ret;
+}
+
+int routing_table_init(struct routing_table *table)
+{
+	int cpu;
+
 	memset(table, 0, sizeof(struct routing_table));
 	mutex_init(&table->table_update_lock);
+	INIT_DELAYED_WORK(&table->lc_rebuild_work, lc_rebuild_work);
+	/* Zeroed entries are never valid, since the generation starts at 1. */
+	table->cache_generation = 1;
+	table->cache = alloc_percpu(struct routing_table_cache);
+	if (!table->cache)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(table->cache, cpu)->syncp);
+	return 0;
 }
 
 void routing_table_free(struct routing_table *table)
 {
+	cancel_delayed_work_sync(&table->lc_rebuild_work);
 	mutex_lock(&table->table_update_lock);
+	lc_replace(&table->lc4, NULL, &table->table_update_lock);
+	lc_replace(&table->lc6, NULL, &table->table_update_lock);
 	free_node(rcu_dereference_protected(table->root4, lockdep_is_held(&table->table_update_lock)), &table->table_update_lock);
 	rcu_assign_pointer(table->root4, NULL);
 	free_node(rcu_dereference_protected(table->root6, lockdep_is_held(&table->table_update_lock)), &table->table_update_lock);
 	rcu_assign_pointer(table->root6, NULL);
+	free_node(rcu_dereference_protected(table->staged4, lockdep_is_held(&table->table_update_lock)), &table->table_update_lock);
+	RCU_INIT_POINTER(table->staged4, NULL);
+	free_node(rcu_dereference_protected(table->staged6, lockdep_is_held(&table->table_update_lock)), &table->table_update_lock);
+	RCU_INIT_POINTER(table->staged6, NULL);
+	table->has_staged4 = table->has_staged6 = table->updating = false;
 	mutex_unlock(&table->table_update_lock);
+	free_percpu(table->cache);
+	table->cache = NULL;
 }
 
 int routing_table_insert_v4(struct routing_table *table, const struct in_addr *ip, u8 cidr, struct wireguard_peer *peer)
 {
+	struct routing_table_node __rcu **root;
 	int ret;
 	if (cidr > 32)
 		return -EINVAL;
 	mutex_lock(&table->table_update_lock);
-	ret = add(&table->root4, 32, (const u8 *)ip, cidr, peer, &table->table_update_lock);
+	root = writable_root(table, 32);
+	ret = IS_ERR(root) ? PTR_ERR(root) : add(root, 32, (const u8 *)ip, cidr, peer, table->generation, &table->table_update_lock);
+	if (!ret && root == &table->root4)
+		invalidate_lookups(table, &table->lc4);
 	mutex_unlock(&table->table_update_lock);
 	return ret;
 }
 
 int routing_table_insert_v6(struct routing_table *table, const struct in6_addr *ip, u8 cidr, struct wireguard_peer *peer)
 {
+	struct routing_table_node __rcu **root;
 	int ret;
 	if (cidr > 128)
 		return -EINVAL;
 	mutex_lock(&table->table_update_lock);
-	ret = add(&table->root6, 128, (const u8 *)ip, cidr, peer, &table->table_update_lock);
+	root = writable_root(table, 128);
+	ret = IS_ERR(root) ? PTR_ERR(root) : add(root, 128, (const u8 *)ip, cidr, peer, table->generation, &table->table_update_lock);
+	if (!ret && root == &table->root6)
+		invalidate_lookups(table, &table->lc6);
 	mutex_unlock(&table->table_update_lock);
 	return ret;
 }
 
+/* Must be called with the RCU read lock held, and does not take a reference. */
+static inline struct wireguard_peer *lookup(struct routing_table *table, const u8 *ip, u8 len)
+{
+	struct routing_table_node *node;
+	struct lc_trie *lc;
+
+	lc = len == 4 ? rcu_dereference(table->lc4) : rcu_dereference(table->lc6);
+	if (likely(lc))
+		return lc_lookup(lc, ip);
+	node = find_node(len == 4 ? rcu_dereference(table->root4) : rcu_dereference(table->root6), len * 8, ip);
+	return node ? node->peer : NULL;
+}
+
+/* Returns a strong reference to a peer */
+static struct wireguard_peer *lookup_cached(struct routing_table *table, const u8 *ip, u8 len)
+{
+	struct routing_table_cache_entry *entry;
+	struct routing_table_cache *cache;
+	struct wireguard_peer *peer;
+	unsigned long generation;
+	u32 folded = 0;
+	u8 i;
+
+	for (i = 0; i < len; i += 4)
+		folded ^= *(const u32 *)(ip + i);
+
+	local_bh_disable();
+	rcu_read_lock();
+	cache = this_cpu_ptr(table->cache);
+	entry = &cache->entries[hash_32(folded, ROUTING_TABLE_CACHE_BITS)];
+	generation = READ_ONCE(table->cache_generation);
+	/* Pairs with the smp_wmb() in invalidate_lookups(). */
+	smp_rmb();
+	if (entry->generation == generation && entry->len == len && !memcmp(entry->ip, ip, len)) {
+		u64_stats_update_begin(&cache->syncp);
+		++cache->hits;
+		u64_stats_update_end(&cache->syncp);
+		peer = entry->peer;
+	} else {
+		u64_stats_update_begin(&cache->syncp);
+		++cache->misses;
+		u64_stats_update_end(&cache->syncp);
+		peer = lookup(table, ip, len);
+		entry->peer = peer;
+		entry->generation = generation;
+		entry->len = len;
+		memcpy(entry->ip, ip, len);
+	}
+	peer = peer_get(peer);
+	rcu_read_unlock();
+	local_bh_enable();
+	return peer;
+}
+
+void routing_table_cache_stats(struct routing_table *table, u64 *hits, u64 *misses)
+{
+	const struct routing_table_cache *cache;
+	u64 cpu_hits, cpu_misses;
+	unsigned int start;
+	int cpu;
+
+	*hits = *misses = 0;
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(table->cache, cpu);
+		do {
+			start = u64_stats_fetch_begin_irq(&cache->syncp);
+			cpu_hits = cache->hits;
+			cpu_misses = cache->misses;
+		} while (u64_stats_fetch_retry_irq(&cache->syncp, start));
+		*hits += cpu_hits;
+		*misses += cpu_misses;
+	}
+}
+
 /* Returns a strong reference to a peer */
 inline struct wireguard_peer *routing_table_lookup_v4(struct routing_table *table, const struct in_addr *ip)
 {
-	struct wireguard_peer *peer = NULL;
-	struct routing_table_node *node;
+	struct wireguard_peer *peer;
 
 	rcu_read_lock();
-	node = find_node(rcu_dereference(table->root4), 32, (const u8 *)ip);
-	if (node)
-		peer = peer_get(node->peer);
+	peer = peer_get(lookup(table, (const u8 *)ip, 4));
 	rcu_read_unlock();
 	return peer;
 }
@@ -403,31 +904,36 @@ inline struct wireguard_peer *routing_table_lookup_v4(struct routing_table *tabl
 /* Returns a strong reference to a peer */
 inline struct wireguard_peer *routing_table_lookup_v6(struct routing_table *table, const struct in6_addr *ip)
 {
-	struct wireguard_peer *peer = NULL;
-	struct routing_table_node *node;
+	struct wireguard_peer *peer;
 
 	rcu_read_lock();
-	node = find_node(rcu_dereference(table->root6), 128, (const u8 *)ip);
-	if (node)
-		peer = peer_get(node->peer);
+	peer = peer_get(lookup(table, (const u8 *)ip, 16));
 	rcu_read_unlock();
 	return peer;
 }
 
 int routing_table_remove_v4(struct routing_table *table, const struct in_addr *ip, u8 cidr)
 {
+	struct routing_table_node __rcu **root;
 	int ret;
 	mutex_lock(&table->table_update_lock);
-	ret = remove(&table->root4, (const u8 *)ip, cidr, &table->table_update_lock);
+	root = writable_root(table, 32);
+	ret = IS_ERR(root) ? PTR_ERR(root) : remove(root, (const u8 *)ip, cidr, &table->table_update_lock);
+	if (!ret && root == &table->root4)
+		invalidate_lookups(table, &table->lc4);
 	mutex_unlock(&table->table_update_lock);
 	return ret;
 }
 
 int routing_table_remove_v6(struct routing_table *table, const struct in6_addr *ip, u8 cidr)
 {
+	struct routing_table_node __rcu **root;
 	int ret;
 	mutex_lock(&table->table_update_lock);
-	ret = remove(&table->root6, (const u8 *)ip, cidr, &table->table_update_lock);
+	root = writable_root(table, 128);
+	ret = IS_ERR(root) ? PTR_ERR(root) : remove(root, (const u8 *)ip, cidr, &table->table_update_lock);
+	if (!ret && root == &table->root6)
+		invalidate_lookups(table, &table->lc6);
 	mutex_unlock(&table->table_update_lock);
 	return ret;
 }
@@ -437,6 +943,15 @@ int routing_table_remove_by_peer(struct routing_table *table, struct wireguard_p
 	bool found;
 	mutex_lock(&table->table_update_lock);
 	found = walk_remove_by_peer(&table->root4, peer, &table->table_update_lock) | walk_remove_by_peer(&table->root6, peer, &table->table_update_lock);
+	if (found) {
+		invalidate_lookups(table, &table->lc4);
+		invalidate_lookups(table, &table->lc6);
+	}
+	/* The peer is going away, so it mustn't come back when a pending update is published. */
+	if (table->has_staged4)
+		found |= walk_remove_by_peer(&table->staged4, peer, &table->table_update_lock);
+	if (table->has_staged6)
+		found |= walk_remove_by_peer(&table->staged6, peer, &table->table_update_lock);
 	mutex_unlock(&table->table_update_lock);
 	return found ? 0 : -EINVAL;
 }
@@ -502,9 +1017,9 @@ struct wireguard_peer *routing_table_lookup_dst(struct routing_table *table, str
 	if (unlikely(!has_valid_ip_header(skb)))
 		return NULL;
 	if (ip_hdr(skb)->version == 4)
-		return routing_table_lookup_v4(table, (struct in_addr *)&ip_hdr(skb)->daddr);
+		return lookup_cached(table, (const u8 *)&ip_hdr(skb)->daddr, 4);
 	else if (ip_hdr(skb)->version == 6)
-		return routing_table_lookup_v6(table, &ipv6_hdr(skb)->daddr);
+		return lookup_cached(table, (const u8 *)&ipv6_hdr(skb)->daddr, 16);
 	return NULL;
 }
 
@@ -514,9 +1029,9 @@ struct wireguard_peer *routing_table_lookup_src(struct routing_table *table, str
 	if (unlikely(!has_valid_ip_header(skb)))
 		return NULL;
 	if (ip_hdr(skb)->version == 4)
-		return routing_table_lookup_v4(table, (struct in_addr *)&ip_hdr(skb)->saddr);
+		return lookup_cached(table, (const u8 *)&ip_hdr(skb)->saddr, 4);
 	else if (ip_hdr(skb)->version == 6)
-		return routing_table_lookup_v6(table, &ipv6_hdr(skb)->saddr);
+		return lookup_cached(table, (const u8 *)&ipv6_hdr(skb)->saddr, 16);
 	return NULL;
 }
 
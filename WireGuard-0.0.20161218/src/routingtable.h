@@ -4,25 +4,40 @@
 #define ROUTINGTABLE_H
 
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
 
 struct wireguard_peer;
 struct routing_table_node;
+struct lc_trie;
+struct routing_table_cache;
 
 struct routing_table {
 	struct routing_table_node __rcu *root4;
 	struct routing_table_node __rcu *root6;
+	struct lc_trie __rcu *lc4;
+	struct lc_trie __rcu *lc6;
 	struct mutex table_update_lock;
+	struct delayed_work lc_rebuild_work;
+	struct routing_table_cache __percpu *cache;
+	unsigned long cache_generation;
+	struct routing_table_node __rcu *staged4;
+	struct routing_table_node __rcu *staged6;
+	u64 generation;
+	bool updating, has_staged4, has_staged6;
 };
 
-void routing_table_init(struct routing_table *table);
+int routing_table_init(struct routing_table *table);
 void routing_table_free(struct routing_table *table);
 int routing_table_insert_v4(struct routing_table *table, const struct in_addr *ip, u8 cidr, struct wireguard_peer *peer);
 int routing_table_insert_v6(struct routing_table *table, const struct in6_addr *ip, u8 cidr, struct wireguard_peer *peer);
 int routing_table_remove_v4(struct routing_table *table, const struct in_addr *ip, u8 cidr);
 int routing_table_remove_v6(struct routing_table *table, const struct in6_addr *ip, u8 cidr);
 int routing_table_remove_by_peer(struct routing_table *table, struct wireguard_peer *peer);
+void routing_table_begin_update(struct routing_table *table);
+void routing_table_end_update(struct routing_table *table);
+int routing_table_stale_by_peer(struct routing_table *table, struct wireguard_peer *peer);
 int routing_table_walk_ips(struct routing_table *table, void *ctx, int (*func)(void *ctx, struct wireguard_peer *peer, union nf_inet_addr ip, u8 cidr, int family));
 int routing_table_walk_ips_by_peer(struct routing_table *table, void *ctx, struct wireguard_peer *peer, int (*func)(void *ctx, union nf_inet_addr ip, u8 cidr, int family));
 int routing_table_walk_ips_by_peer_sleepable(struct routing_table *table, void *ctx, struct wireguard_peer *peer, int (*func)(void *ctx, union nf_inet_addr ip, u8 cidr, int family));
@@ -32,6 +47,7 @@ struct wireguard_peer *routing_table_lookup_v4(struct routing_table *table, cons
 struct wireguard_peer *routing_table_lookup_v6(struct routing_table *table, const struct in6_addr *ip);
 struct wireguard_peer *routing_table_lookup_dst(struct routing_table *table, struct sk_buff *skb);
 struct wireguard_peer *routing_table_lookup_src(struct routing_table *table, struct sk_buff *skb);
+void routing_table_cache_stats(struct routing_table *table, u64 *hits, u64 *misses);
 
 #ifdef DEBUG
 bool routing_table_selftest(void);
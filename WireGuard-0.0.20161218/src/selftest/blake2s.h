@@ -1,6 +1,8 @@
 /* Copyright (C) 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
 
 #ifdef DEBUG
+#include <linux/random.h>
+
 static const u8 blake2s_testvecs[][BLAKE2S_OUTBYTES] = {
 	{ 0x69, 0x21, 0x7A, 0x30, 0x79, 0x90, 0x80, 0x94, 0xE1, 0x11, 0x21, 0xD0, 0x42, 0x35, 0x4A, 0x7C, 0x1F, 0x55, 0xB6, 0x48, 0x2C, 0xA1, 0xA5, 0x1E, 0x1B, 0x25, 0x0D, 0xFD, 0x1E, 0xD0, 0xEE, 0xF9 },
 	{ 0xE3, 0x4D, 0x74, 0xDB, 0xAF, 0x4F, 0xF4, 0xC6, 0xAB, 0xD8, 0x71, 0xCC, 0x22, 0x04, 0x51, 0xD2, 0xEA, 0x26, 0x48, 0x84, 0x6C, 0x77, 0x57, 0xFB, 0xAA, 0xC8, 0x2F, 0xE5, 0x1A, 0xD6, 0x4B, 0xEA },
@@ -519,7 +521,7 @@ static const u8 blake2s_keyed_testvecs[][BLAKE2S_OUTBYTES] = {
 	{ 0x3F, 0xB7, 0x35, 0x06, 0x1A, 0xBC, 0x51, 0x9D, 0xFE, 0x97, 0x9E, 0x54, 0xC1, 0xEE, 0x5B, 0xFA, 0xD0, 0xA9, 0xD8, 0x58, 0xB3, 0x31, 0x5B, 0xAD, 0x34, 0xBD, 0xE9, 0x99, 0xEF, 0xD7, 0x24, 0xDD }
 };
 
-bool blake2s_selftest(void)
+static bool blake2s_selftest_vectors(const char *impl)
 {
 	u8 key[BLAKE2S_KEYBYTES];
 	u8 buf[ARRAY_SIZE(blake2s_testvecs)];
@@ -536,7 +538,7 @@ bool blake2s_selftest(void)
 	for (i = 0; i < ARRAY_SIZE(blake2s_keyed_testvecs); ++i) {
 		blake2s(hash, buf, key, BLAKE2S_OUTBYTES, i, BLAKE2S_KEYBYTES);
 		if (memcmp(hash, blake2s_keyed_testvecs[i], BLAKE2S_OUTBYTES)) {
-			pr_info("blake2s keyed self-test %zu: FAIL\n", i + 1);
+			pr_info("blake2s %s keyed self-test %zu: FAIL\n", impl, i + 1);
 			success = false;
 		}
 	}
@@ -544,10 +546,80 @@ bool blake2s_selftest(void)
 	for (i = 0; i < ARRAY_SIZE(blake2s_testvecs); ++i) {
 		blake2s(hash, buf, NULL, BLAKE2S_OUTBYTES, i, 0);
 		if (memcmp(hash, blake2s_testvecs[i], BLAKE2S_OUTBYTES)) {
-			pr_info("blake2s unkeyed self-test %zu: FAIL\n", i + i);
+			pr_info("blake2s %s unkeyed self-test %zu: FAIL\n", impl, i + 1);
 			success = false;
 		}
 	}
+	return success;
+}
+
+/* Batches must agree with hashing each message on its own, whatever is left in the buffer of
+ * the starting state, for lengths on either side of a block boundary, and for batch sizes that
+ * leave some messages over after the groups of eight. */
+static bool blake2s_selftest_batch(const char *impl)
+{
+	static const size_t prefix_lens[] = { 0, 32, 64, 100 };
+	static const size_t lens[] = { 1, 31, 63, 64, 65, 116, 180, 200 };
+	enum { BATCH = 11, MAX_LEN = 200 };
+	u8 key[BLAKE2S_KEYBYTES], prefix[100], messages[BATCH][MAX_LEN], hashes[BATCH][BLAKE2S_OUTBYTES], hash[BLAKE2S_OUTBYTES];
+	u8 *out[BATCH];
+	const u8 *in[BATCH];
+	struct blake2s_state state, copy;
+	size_t i, j, k, test_num = 0;
+	bool success = true;
+
+	get_random_bytes(key, sizeof(key));
+	get_random_bytes(prefix, sizeof(prefix));
+	get_random_bytes(messages, sizeof(messages));
+	for (k = 0; k < BATCH; ++k) {
+		out[k] = hashes[k];
+		in[k] = messages[k];
+	}
+
+	for (i = 0; i < ARRAY_SIZE(prefix_lens); ++i) {
+		for (j = 0; j < ARRAY_SIZE(lens); ++j) {
+			++test_num;
+			blake2s_init_key(&state, BLAKE2S_OUTBYTES - i, key, BLAKE2S_KEYBYTES);
+			blake2s_update(&state, prefix, prefix_lens[i]);
+			blake2s_batch(out, &state, in, lens[j], BLAKE2S_OUTBYTES - i, BATCH);
+			for (k = 0; k < BATCH; ++k) {
+				copy = state;
+				blake2s_update(&copy, messages[k], lens[j]);
+				blake2s_final(&copy, hash, BLAKE2S_OUTBYTES - i);
+				if (memcmp(hash, hashes[k], BLAKE2S_OUTBYTES - i)) {
+					pr_info("blake2s %s batch self-test %zu: FAIL\n", impl, test_num);
+					success = false;
+					break;
+				}
+			}
+		}
+	}
+	return success;
+}
+
+bool blake2s_selftest(void)
+{
+	bool success = true;
+
+#ifdef CONFIG_X86_64
+	blake2s_use_ssse3 = false;
+	blake2s_use_avx2 = false;
+#endif
+	success &= blake2s_selftest_vectors("generic");
+	success &= blake2s_selftest_batch("generic");
+
+	blake2s_fpu_init();
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_SSSE3)
+	if (blake2s_use_ssse3) {
+		blake2s_ssse3_min_blocks = 1;
+		success &= blake2s_selftest_vectors("ssse3");
+		blake2s_ssse3_min_blocks = 8;
+	}
+#endif
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+	if (blake2s_use_avx2)
+		success &= blake2s_selftest_batch("avx2");
+#endif
 
 	if (success)
 		pr_info("blake2s self-tests: pass\n");
@@ -1,6 +1,9 @@
 /* Copyright (C) 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
 
 #ifdef DEBUG
+#include <linux/slab.h>
+#include <linux/timex.h>
+
 /* ChaCha20-Poly1305 AEAD test vectors from RFC7539 2.8.2 */
 struct chacha20poly1305_testvec {
 	u8 *key, *nonce, *assoc, *input, *result;
@@ -25,6 +28,271 @@ static const struct chacha20poly1305_testvec chacha20poly1305_dec_vectors[] = {
 	.result	= "\x49\x6e\x74\x65\x72\x6e\x65\x74\x2d\x44\x72\x61\x66\x74\x73\x20\x61\x72\x65\x20\x64\x72\x61\x66\x74\x20\x64\x6f\x63\x75\x6d\x65\x6e\x74\x73\x20\x76\x61\x6c\x69\x64\x20\x66\x6f\x72\x20\x61\x20\x6d\x61\x78\x69\x6d\x75\x6d\x20\x6f\x66\x20\x73\x69\x78\x20\x6d\x6f\x6e\x74\x68\x73\x20\x61\x6e\x64\x20\x6d\x61\x79\x20\x62\x65\x20\x75\x70\x64\x61\x74\x65\x64\x2c\x20\x72\x65\x70\x6c\x61\x63\x65\x64\x2c\x20\x6f\x72\x20\x6f\x62\x73\x6f\x6c\x65\x74\x65\x64\x20\x62\x79\x20\x6f\x74\x68\x65\x72\x20\x64\x6f\x63\x75\x6d\x65\x6e\x74\x73\x20\x61\x74\x20\x61\x6e\x79\x20\x74\x69\x6d\x65\x2e\x20\x49\x74\x20\x69\x73\x20\x69\x6e\x61\x70\x70\x72\x6f\x70\x72\x69\x61\x74\x65\x20\x74\x6f\x20\x75\x73\x65\x20\x49\x6e\x74\x65\x72\x6e\x65\x74\x2d\x44\x72\x61\x66\x74\x73\x20\x61\x73\x20\x72\x65\x66\x65\x72\x65\x6e\x63\x65\x20\x6d\x61\x74\x65\x72\x69\x61\x6c\x20\x6f\x72\x20\x74\x6f\x20\x63\x69\x74\x65\x20\x74\x68\x65\x6d\x20\x6f\x74\x68\x65\x72\x20\x74\x68\x61\x6e\x20\x61\x73\x20\x2f\xe2\x80\x9c\x77\x6f\x72\x6b\x20\x69\x6e\x20\x70\x72\x6f\x67\x72\x65\x73\x73\x2e\x2f\xe2\x80\x9d"
 } };
 
+static const size_t chacha20poly1305_batch_lengths[] = { 0, 1, 15, 63, 64, 65, 128, 200, 265 };
+
+static bool chacha20poly1305_batch_selftest(void)
+{
+	struct chacha20poly1305_batch_entry batch[ARRAY_SIZE(chacha20poly1305_batch_lengths) + 1];
+	u8 batch_result[1280], batch_expected[1280];
+	const struct chacha20poly1305_testvec *vec = &chacha20poly1305_enc_vectors[0];
+	size_t i, offset = 0;
+	bool have_simd, success = true;
+
+	/* Every length shares the batch with the others, and each uses a different nonce. */
+	for (i = 0; i < ARRAY_SIZE(chacha20poly1305_batch_lengths); ++i) {
+		batch[i].dst = batch_result + offset;
+		batch[i].src = vec->input;
+		batch[i].src_len = chacha20poly1305_batch_lengths[i];
+		batch[i].ad = i & 1 ? vec->assoc : NULL;
+		batch[i].ad_len = i & 1 ? vec->alen : 0;
+		batch[i].nonce = 0x0706050403020100ULL + i * 0x10001;
+		chacha20poly1305_encrypt(batch_expected + offset, batch[i].src, batch[i].src_len, batch[i].ad, batch[i].ad_len, batch[i].nonce, vec->key);
+		offset += batch[i].src_len + POLY1305_MAC_SIZE;
+	}
+	/* The last one is the RFC7539 vector itself, encrypted in place. */
+	memcpy(batch_result + offset, vec->input, vec->ilen);
+	batch[i].dst = batch_result + offset;
+	batch[i].src = batch[i].dst;
+	batch[i].src_len = vec->ilen;
+	batch[i].ad = vec->assoc;
+	batch[i].ad_len = vec->alen;
+	batch[i].nonce = le64_to_cpu(*(__force __le64 *)vec->nonce);
+	memcpy(batch_expected + offset, vec->result, vec->ilen + POLY1305_MAC_SIZE);
+	offset += vec->ilen + POLY1305_MAC_SIZE;
+
+	have_simd = chacha20poly1305_init_simd();
+	chacha20poly1305_encrypt_batch(batch, ARRAY_SIZE(batch), vec->key, have_simd);
+	chacha20poly1305_deinit_simd(have_simd);
+
+	for (i = 0; i < ARRAY_SIZE(batch); ++i) {
+		if (memcmp(batch[i].dst, batch_expected + (batch[i].dst - batch_result), batch[i].src_len + POLY1305_MAC_SIZE)) {
+			pr_info("chacha20poly1305 batch self-test %zu: FAIL\n", i + 1);
+			success = false;
+		}
+	}
+	return success;
+}
+
+/* Long enough to go through the sixteen-, eight-, four- and one-block functions and a partial tail. */
+static const size_t chacha20poly1305_wide_lengths[] = { 1024, 1536, 1983, 2048 + 1024 + 512 + 256 + 64 + 17 };
+
+static bool chacha20poly1305_wide_selftest(void)
+{
+	const struct chacha20poly1305_testvec *vec = &chacha20poly1305_enc_vectors[0];
+	enum { MAX_WIDE_LEN = 2048 + 1024 + 512 + 256 + 64 + 17 };
+	u8 *input, *simd_result, *generic_result;
+	size_t i, j;
+	bool have_simd, success = false;
+
+	input = kmalloc(MAX_WIDE_LEN, GFP_KERNEL);
+	simd_result = kmalloc(MAX_WIDE_LEN + POLY1305_MAC_SIZE, GFP_KERNEL);
+	generic_result = kmalloc(MAX_WIDE_LEN + POLY1305_MAC_SIZE, GFP_KERNEL);
+	if (!input || !simd_result || !generic_result)
+		goto out;
+	for (j = 0; j < MAX_WIDE_LEN; ++j)
+		input[j] = vec->input[j % vec->ilen] ^ j;
+
+	success = true;
+	for (i = 0; i < ARRAY_SIZE(chacha20poly1305_wide_lengths); ++i) {
+		have_simd = chacha20poly1305_init_simd();
+		__chacha20poly1305_encrypt(simd_result, input, chacha20poly1305_wide_lengths[i], vec->assoc, vec->alen, i, vec->key, have_simd);
+		chacha20poly1305_deinit_simd(have_simd);
+		__chacha20poly1305_encrypt(generic_result, input, chacha20poly1305_wide_lengths[i], vec->assoc, vec->alen, i, vec->key, false);
+		if (memcmp(simd_result, generic_result, chacha20poly1305_wide_lengths[i] + POLY1305_MAC_SIZE)) {
+			pr_info("chacha20poly1305 wide self-test %zu: FAIL\n", i + 1);
+			success = false;
+		}
+	}
+
+out:
+	kfree(input);
+	kfree(simd_result);
+	kfree(generic_result);
+	return success;
+}
+
+/* Fragments that put both ChaCha20 and Poly1305 block boundaries in the middle of scatterlist entries. */
+static const size_t chacha20poly1305_sg_fragments[] = { 1, 63, 64, 17, 200, 3, 1024, 79 };
+
+static bool chacha20poly1305_sg_selftest(void)
+{
+	const struct chacha20poly1305_testvec *vec = &chacha20poly1305_enc_vectors[0];
+	struct scatterlist src[ARRAY_SIZE(chacha20poly1305_sg_fragments)], dst[ARRAY_SIZE(chacha20poly1305_sg_fragments)];
+	u8 *input, *result, *expected;
+	size_t i, offset = 0, len = 0;
+	bool have_simd, success = false;
+
+	for (i = 0; i < ARRAY_SIZE(chacha20poly1305_sg_fragments); ++i)
+		len += chacha20poly1305_sg_fragments[i];
+	input = kmalloc(len, GFP_KERNEL);
+	result = kmalloc(len + POLY1305_MAC_SIZE, GFP_KERNEL);
+	expected = kmalloc(len + POLY1305_MAC_SIZE, GFP_KERNEL);
+	if (!input || !result || !expected)
+		goto out;
+	for (i = 0; i < len; ++i)
+		input[i] = vec->input[i % vec->ilen] ^ i;
+
+	sg_init_table(src, ARRAY_SIZE(src));
+	sg_init_table(dst, ARRAY_SIZE(dst));
+	for (i = 0; i < ARRAY_SIZE(chacha20poly1305_sg_fragments); ++i) {
+		sg_set_buf(&src[i], input + offset, chacha20poly1305_sg_fragments[i]);
+		sg_set_buf(&dst[i], result + offset, chacha20poly1305_sg_fragments[i] + (i == ARRAY_SIZE(dst) - 1 ? POLY1305_MAC_SIZE : 0));
+		offset += chacha20poly1305_sg_fragments[i];
+	}
+
+	success = true;
+	chacha20poly1305_encrypt(expected, input, len, vec->assoc, vec->alen, 1, vec->key);
+	have_simd = chacha20poly1305_init_simd();
+	chacha20poly1305_encrypt_sg(dst, src, len, vec->assoc, vec->alen, 1, vec->key, have_simd);
+	chacha20poly1305_deinit_simd(have_simd);
+	if (memcmp(result, expected, len + POLY1305_MAC_SIZE)) {
+		pr_info("chacha20poly1305 sg encryption self-test: FAIL\n");
+		success = false;
+	}
+	if (!chacha20poly1305_decrypt_sg(dst, dst, len + POLY1305_MAC_SIZE, vec->assoc, vec->alen, 1, vec->key) || memcmp(result, input, len)) {
+		pr_info("chacha20poly1305 sg decryption self-test: FAIL\n");
+		success = false;
+	}
+
+out:
+	kfree(input);
+	kfree(result);
+	kfree(expected);
+	return success;
+}
+
+/* Not a test, but it's the one place every implementation gets run, so this prints how many
+ * cycles per byte Poly1305 on its own and the whole AEAD take on a full-sized packet with each. */
+static void chacha20poly1305_selftest_benchmark(const char *name, bool use_simd)
+{
+	enum { BENCH_LEN = 1420 };
+	const struct chacha20poly1305_testvec *vec = &chacha20poly1305_enc_vectors[0];
+	struct poly1305_ctx poly1305_state;
+	u64 start, cycles, poly1305_cpb, aead_cpb;
+	u8 mac[POLY1305_MAC_SIZE], *buf;
+	unsigned long count;
+	bool have_simd;
+
+	buf = kzalloc(BENCH_LEN + POLY1305_MAC_SIZE, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	count = 0;
+	start = ktime_get_ns();
+	cycles = get_cycles();
+	do {
+		have_simd = use_simd && chacha20poly1305_init_simd();
+		poly1305_init(&poly1305_state, vec->key);
+		poly1305_update(&poly1305_state, buf, BENCH_LEN, have_simd);
+		poly1305_finish(&poly1305_state, mac);
+		chacha20poly1305_deinit_simd(have_simd);
+		++count;
+		cond_resched();
+	} while (ktime_get_ns() - start < NSEC_PER_SEC / 20);
+	poly1305_cpb = div64_u64((get_cycles() - cycles) * 100, (u64)count * BENCH_LEN);
+
+	count = 0;
+	start = ktime_get_ns();
+	cycles = get_cycles();
+	do {
+		have_simd = use_simd && chacha20poly1305_init_simd();
+		__chacha20poly1305_encrypt(buf, buf, BENCH_LEN, NULL, 0, count, vec->key, have_simd);
+		chacha20poly1305_deinit_simd(have_simd);
+		++count;
+		cond_resched();
+	} while (ktime_get_ns() - start < NSEC_PER_SEC / 20);
+	aead_cpb = div64_u64((get_cycles() - cycles) * 100, (u64)count * BENCH_LEN);
+
+	pr_info("chacha20poly1305 %s: poly1305 %llu.%02llu, aead %llu.%02llu cycles per byte at %d bytes\n", name, poly1305_cpb / 100, poly1305_cpb % 100, aead_cpb / 100, aead_cpb % 100, BENCH_LEN);
+	kfree(buf);
+}
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+/* A full batch of packets of each length, one at a time and then together, which is what
+ * CHACHA20POLY1305_MAX_BATCH_LEN, below which data.c batches, should be weighed against. */
+static void chacha20poly1305_selftest_batch_benchmark(void)
+{
+	static const size_t lengths[] = { 64, 128, 256, 384, 512, 768, 1024 };
+	const struct chacha20poly1305_testvec *vec = &chacha20poly1305_enc_vectors[0];
+	struct chacha20poly1305_batch_entry batch[CHACHA20POLY1305_MAX_BATCH];
+	u64 start, cycles, single_cpb, batch_cpb;
+	unsigned long count;
+	bool have_simd;
+	size_t i, j;
+	u8 *buf;
+
+	buf = kzalloc(CHACHA20POLY1305_MAX_BATCH * (1024 + POLY1305_MAC_SIZE), GFP_KERNEL);
+	if (!buf)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(lengths); ++i) {
+		for (j = 0; j < CHACHA20POLY1305_MAX_BATCH; ++j) {
+			batch[j].dst = buf + j * (lengths[i] + POLY1305_MAC_SIZE);
+			batch[j].src = batch[j].dst;
+			batch[j].src_len = lengths[i];
+			batch[j].ad = NULL;
+			batch[j].ad_len = 0;
+			batch[j].nonce = j;
+		}
+
+		count = 0;
+		start = ktime_get_ns();
+		cycles = get_cycles();
+		do {
+			have_simd = chacha20poly1305_init_simd();
+			for (j = 0; j < CHACHA20POLY1305_MAX_BATCH; ++j)
+				__chacha20poly1305_encrypt(batch[j].dst, batch[j].src, batch[j].src_len, NULL, 0, batch[j].nonce, vec->key, have_simd);
+			chacha20poly1305_deinit_simd(have_simd);
+			++count;
+			cond_resched();
+		} while (ktime_get_ns() - start < NSEC_PER_SEC / 20);
+		single_cpb = div64_u64((get_cycles() - cycles) * 100, (u64)count * CHACHA20POLY1305_MAX_BATCH * lengths[i]);
+
+		count = 0;
+		start = ktime_get_ns();
+		cycles = get_cycles();
+		do {
+			have_simd = chacha20poly1305_init_simd();
+			chacha20poly1305_encrypt_batch(batch, CHACHA20POLY1305_MAX_BATCH, vec->key, have_simd);
+			chacha20poly1305_deinit_simd(have_simd);
+			++count;
+			cond_resched();
+		} while (ktime_get_ns() - start < NSEC_PER_SEC / 20);
+		batch_cpb = div64_u64((get_cycles() - cycles) * 100, (u64)count * CHACHA20POLY1305_MAX_BATCH * lengths[i]);
+
+		pr_info("chacha20poly1305 batch: one at a time %llu.%02llu, batched %llu.%02llu cycles per byte at %zu bytes\n", single_cpb / 100, single_cpb % 100, batch_cpb / 100, batch_cpb % 100, lengths[i]);
+	}
+	kfree(buf);
+}
+#endif
+
+static void chacha20poly1305_selftest_benchmarks(void)
+{
+#ifdef CONFIG_X86_64
+	bool use_avx2 = chacha20poly1305_use_avx2, use_avx512 = chacha20poly1305_use_avx512;
+#endif
+
+	chacha20poly1305_selftest_benchmark("generic", false);
+#ifdef CONFIG_X86_64
+	/* Each one on its own, and AVX-512 even where it is off by default, as that is the
+	 * number to weigh against its clock penalty. */
+	chacha20poly1305_use_avx2 = chacha20poly1305_use_avx512 = false;
+	if (chacha20poly1305_use_ssse3)
+		chacha20poly1305_selftest_benchmark("ssse3", true);
+	chacha20poly1305_use_avx2 = use_avx2;
+	if (use_avx2)
+		chacha20poly1305_selftest_benchmark("avx2", true);
+#ifdef CONFIG_AS_AVX2
+	if (use_avx2)
+		chacha20poly1305_selftest_batch_benchmark();
+#endif
+	chacha20poly1305_use_avx512 = use_avx2 && boot_cpu_has(X86_FEATURE_AVX512F);
+	if (chacha20poly1305_use_avx512)
+		chacha20poly1305_selftest_benchmark("avx512", true);
+	chacha20poly1305_use_avx512 = use_avx512;
+#endif
+}
+
 bool chacha20poly1305_selftest(void)
 {
 	size_t i;
@@ -47,6 +315,13 @@ bool chacha20poly1305_selftest(void)
 			success = false;
 		}
 	}
+	if (!chacha20poly1305_batch_selftest())
+		success = false;
+	if (!chacha20poly1305_wide_selftest())
+		success = false;
+	if (!chacha20poly1305_sg_selftest())
+		success = false;
+	chacha20poly1305_selftest_benchmarks();
 	if (success)
 		pr_info("chacha20poly1305 self-tests: pass\n");
 	return success;
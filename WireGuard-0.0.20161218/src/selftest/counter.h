@@ -1,13 +1,100 @@
 /* Copyright (C) 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
 
 #ifdef DEBUG
+enum { COUNTER_STRESS_MESSAGES = 1 << 16 };
+
+struct counter_stress {
+	union noise_counter counter;
+	atomic64_t next_nonce;
+	unsigned long *accepted, *rejected_in_window;
+	bool accepted_twice;
+};
+
+struct counter_stress_worker {
+	struct work_struct work;
+	struct counter_stress *stress;
+};
+
+static void counter_stress_validate(struct counter_stress *stress, u64 nonce)
+{
+	if (counter_validate(&stress->counter, nonce)) {
+		if (test_and_set_bit(nonce, stress->accepted))
+			stress->accepted_twice = true;
+	} else if (COUNTER_WINDOW_SIZE + nonce + 1 >= (u64)atomic64_read(&stress->counter.receive.counter))
+		/* The head only moves forward, so the nonce was inside the window all along. */
+		set_bit(nonce, stress->rejected_in_window);
+}
+
+static void counter_stress_work(struct work_struct *work)
+{
+	struct counter_stress *stress = container_of(work, struct counter_stress_worker, work)->stress;
+	u64 nonce;
+
+	for (;;) {
+		local_bh_disable();
+		nonce = atomic64_inc_return(&stress->next_nonce) - 1;
+		if (nonce >= COUNTER_STRESS_MESSAGES) {
+			local_bh_enable();
+			break;
+		}
+		/* Every nonce arrives once from the CPU that drew it, once as an immediate replay,
+		 * and once as a replay of a recent nonce that another CPU may still be validating. */
+		counter_stress_validate(stress, nonce);
+		counter_stress_validate(stress, nonce);
+		counter_stress_validate(stress, nonce - nonce % 97);
+		local_bh_enable();
+		cond_resched();
+	}
+}
+
+/* No nonce may be accepted twice, no matter how the CPUs interleave, and a nonce may only be
+ * turned away while inside the window if it has been accepted. A CPU that falls far enough
+ * behind the others may legitimately see its nonce fall out of the window before it gets to it. */
+static bool counter_stress_selftest(void)
+{
+	struct counter_stress_worker *workers;
+	struct counter_stress *stress;
+	unsigned int cpu;
+	bool success = false;
+
+	stress = kzalloc(sizeof(struct counter_stress), GFP_KERNEL);
+	workers = kcalloc(nr_cpu_ids, sizeof(struct counter_stress_worker), GFP_KERNEL);
+	if (!stress || !workers)
+		goto out;
+	stress->accepted = kcalloc(BITS_TO_LONGS(COUNTER_STRESS_MESSAGES), sizeof(unsigned long), GFP_KERNEL);
+	stress->rejected_in_window = kcalloc(BITS_TO_LONGS(COUNTER_STRESS_MESSAGES), sizeof(unsigned long), GFP_KERNEL);
+	if (!stress->accepted || !stress->rejected_in_window)
+		goto out;
+
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		workers[cpu].stress = stress;
+		INIT_WORK(&workers[cpu].work, counter_stress_work);
+		schedule_work_on(cpu, &workers[cpu].work);
+	}
+	for_each_online_cpu(cpu)
+		flush_work(&workers[cpu].work);
+	put_online_cpus();
+
+	success = !stress->accepted_twice && bitmap_subset(stress->rejected_in_window, stress->accepted, COUNTER_STRESS_MESSAGES);
+
+out:
+	if (stress) {
+		kfree(stress->accepted);
+		kfree(stress->rejected_in_window);
+	}
+	kfree(stress);
+	kfree(workers);
+	return success;
+}
+
 bool packet_counter_selftest(void)
 {
 	bool success = true;
 	unsigned int test_num = 0, i;
 	union noise_counter counter;
 
-#define T_INIT do { memset(&counter, 0, sizeof(union noise_counter)); spin_lock_init(&counter.receive.lock); } while (0)
+#define T_INIT do { memset(&counter, 0, sizeof(union noise_counter)); } while (0)
 #define T_LIM (COUNTER_WINDOW_SIZE + 1)
 #define T(n, v) do { ++test_num; if (counter_validate(&counter, n) != v) { pr_info("nonce counter self-test %u: FAIL\n", test_num); success = false; } } while (0)
 	T_INIT;
@@ -82,6 +169,11 @@ bool packet_counter_selftest(void)
 #undef T_LIM
 #undef T_INIT
 
+	if (!counter_stress_selftest()) {
+		pr_info("nonce counter stress self-test: FAIL\n");
+		success = false;
+	}
+
 	if (success)
 		pr_info("nonce counter self-tests: pass\n");
 	return success;
@@ -1,6 +1,10 @@
 /* Copyright (C) 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
 
 #ifdef DEBUG
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
 struct curve25519_test_vector {
 	u8 private[CURVE25519_POINT_SIZE];
 	u8 public[CURVE25519_POINT_SIZE];
@@ -43,21 +47,139 @@ static const struct curve25519_test_vector curve25519_test_vectors[] = {
 		.result = { 0 }
 	}
 };
-bool curve25519_selftest(void)
+static bool curve25519_selftest_implementation(void (*fn)(u8 *, const u8 *, const u8 *), size_t *test_num)
 {
-	bool success = true;
-	size_t i = 0;
 	u8 out[CURVE25519_POINT_SIZE];
+	size_t i;
 
 	for (i = 0; i < ARRAY_SIZE(curve25519_test_vectors); ++i) {
+		++*test_num;
 		memset(out, 0, CURVE25519_POINT_SIZE);
-		curve25519(out, curve25519_test_vectors[i].private, curve25519_test_vectors[i].public);
+		fn(out, curve25519_test_vectors[i].private, curve25519_test_vectors[i].public);
 		if (memcmp(out, curve25519_test_vectors[i].result, CURVE25519_POINT_SIZE)) {
-			pr_info("curve25519 self-test %zu: FAIL\n", i + 1);
-			success = false;
-			break;
+			pr_info("curve25519 self-test %zu: FAIL\n", *test_num);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Not a test, but it's the one place every implementation gets run, so this prints how many
+ * scalar multiplications each one manages per second, which bounds the handshake rate. */
+static void curve25519_selftest_benchmark(void (*fn)(u8 *, const u8 *, const u8 *), const char *name)
+{
+	u8 secret[CURVE25519_POINT_SIZE], point[CURVE25519_POINT_SIZE] = { 9 };
+	u64 start = ktime_get_ns(), elapsed;
+	unsigned long count = 0;
+
+	curve25519_generate_secret(secret);
+	do {
+		fn(point, secret, point);
+		++count;
+		cond_resched();
+	} while ((elapsed = ktime_get_ns() - start) < NSEC_PER_SEC / 10);
+	pr_info("curve25519 %s: %llu scalar multiplications per second\n", name, div64_u64((u64)count * NSEC_PER_SEC, elapsed));
+}
+
+/* Every batch size up to a little over two groups of four, mixing the vectors above with random
+ * points, must agree with computing each result on its own, however the batch ends up split. */
+static bool curve25519_selftest_batch(size_t *test_num)
+{
+	enum { MAX_BATCH = 9 };
+	u8 secrets[MAX_BATCH][CURVE25519_POINT_SIZE], points[MAX_BATCH][CURVE25519_POINT_SIZE], outs[MAX_BATCH][CURVE25519_POINT_SIZE], expected[CURVE25519_POINT_SIZE];
+	u8 *out[MAX_BATCH];
+	const u8 *secret[MAX_BATCH], *point[MAX_BATCH];
+	size_t num, i;
+
+	for (num = 1; num <= MAX_BATCH; ++num) {
+		++*test_num;
+		for (i = 0; i < num; ++i) {
+			if ((i + num) % 2) {
+				memcpy(secrets[i], curve25519_test_vectors[(i + num) % ARRAY_SIZE(curve25519_test_vectors)].private, CURVE25519_POINT_SIZE);
+				memcpy(points[i], curve25519_test_vectors[(i + num) % ARRAY_SIZE(curve25519_test_vectors)].public, CURVE25519_POINT_SIZE);
+			} else {
+				get_random_bytes(secrets[i], CURVE25519_POINT_SIZE);
+				get_random_bytes(points[i], CURVE25519_POINT_SIZE);
+			}
+			memset(outs[i], 0, CURVE25519_POINT_SIZE);
+			out[i] = outs[i];
+			secret[i] = secrets[i];
+			point[i] = points[i];
+		}
+		curve25519_batch(out, secret, point, num);
+		for (i = 0; i < num; ++i) {
+			curve25519(expected, secrets[i], points[i]);
+			if (memcmp(outs[i], expected, CURVE25519_POINT_SIZE)) {
+				pr_info("curve25519 self-test %zu: FAIL\n", *test_num);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+static void curve25519_selftest_batch_benchmark(void)
+{
+	u8 secrets[4][CURVE25519_POINT_SIZE], points[4][CURVE25519_POINT_SIZE] = { { 9 }, { 9 }, { 9 }, { 9 } };
+	u8 *out[4] = { points[0], points[1], points[2], points[3] };
+	const u8 *secret[4] = { secrets[0], secrets[1], secrets[2], secrets[3] }, *point[4] = { points[0], points[1], points[2], points[3] };
+	u64 start = ktime_get_ns(), elapsed;
+	unsigned long count = 0;
+	size_t i;
+
+	for (i = 0; i < 4; ++i)
+		curve25519_generate_secret(secrets[i]);
+	do {
+		curve25519_batch(out, secret, point, 4);
+		count += 4;
+		cond_resched();
+	} while ((elapsed = ktime_get_ns() - start) < NSEC_PER_SEC / 10);
+	pr_info("curve25519 batch: %llu scalar multiplications per second\n", div64_u64((u64)count * NSEC_PER_SEC, elapsed));
+}
+#endif
+
+bool curve25519_selftest(void)
+{
+	bool success = true;
+	size_t test_num = 0;
+
+	success &= curve25519_selftest_implementation(curve25519_generic, &test_num);
+	curve25519_selftest_benchmark(curve25519_generic, "generic");
+
+	curve25519_init();
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_ADX)
+	if (curve25519_use_bmi2_adx) {
+		u8 secret[CURVE25519_POINT_SIZE], point[CURVE25519_POINT_SIZE], expected[CURVE25519_POINT_SIZE], out[CURVE25519_POINT_SIZE];
+		size_t i;
+
+		success &= curve25519_selftest_implementation(curve25519_bmi2_adx, &test_num);
+
+		/* Random points, including ones that are not reduced, must agree with the generic code. */
+		for (i = 0; i < 64; ++i) {
+			++test_num;
+			get_random_bytes(secret, CURVE25519_POINT_SIZE);
+			get_random_bytes(point, CURVE25519_POINT_SIZE);
+			if (i & 1)
+				memset(point + 8 * (i & 3), 0xff, 8);
+			curve25519_generic(expected, secret, point);
+			curve25519_bmi2_adx(out, secret, point);
+			if (memcmp(out, expected, CURVE25519_POINT_SIZE)) {
+				pr_info("curve25519 self-test %zu: FAIL\n", test_num);
+				success = false;
+				break;
+			}
 		}
+		curve25519_selftest_benchmark(curve25519_bmi2_adx, "bmi2/adx");
 	}
+#endif
+
+	success &= curve25519_selftest_batch(&test_num);
+#if defined(CONFIG_X86_64) && defined(CONFIG_AS_AVX2)
+	if (curve25519_use_avx2)
+		curve25519_selftest_batch_benchmark();
+#endif
 
 	if (success)
 		pr_info("curve25519 self-tests: pass\n");
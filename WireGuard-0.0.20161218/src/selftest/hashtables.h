@@ -0,0 +1,108 @@
+/* Copyright (C) 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#ifdef DEBUG
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+
+/* The peer here is never killed, so its references only need to work, not to ever drop to zero. */
+static void index_hashtable_selftest_release(struct percpu_ref *ref)
+{
+}
+
+/* Fills the table from one entry up to a million, in steps of ten, letting the resizes run
+ * alongside the insertions, and times lookups of random entries at each step. Then all but
+ * one in sixteen are removed, so that the table shrinks while the rest are being looked up. */
+bool index_hashtable_selftest(void)
+{
+	enum { MAX_ENTRIES = 1000000 };
+	struct index_hashtable_entry *entries, *entry;
+	struct wireguard_peer *peer;
+	struct index_hashtable table;
+	unsigned int count = 0, step, i;
+	unsigned long lookups;
+	bool success = false;
+	u64 start;
+
+	peer = kzalloc(sizeof(struct wireguard_peer), GFP_KERNEL);
+	if (!peer)
+		return false;
+	if (percpu_ref_init(&peer->refcount, index_hashtable_selftest_release, 0, GFP_KERNEL)) {
+		kfree(peer);
+		return false;
+	}
+	entries = vzalloc(sizeof(struct index_hashtable_entry) * MAX_ENTRIES);
+	if (!entries)
+		goto out_peer;
+	if (index_hashtable_init(&table) < 0)
+		goto out_entries;
+
+	success = true;
+	for (step = 1; step <= MAX_ENTRIES; step *= 10) {
+		for (; count < step; ++count) {
+			entries[count].peer = peer;
+			entries[count].type = INDEX_HASHTABLE_KEYPAIR;
+			index_hashtable_insert(&table, &entries[count]);
+			if (!(count % 1024))
+				cond_resched();
+		}
+		flush_work(&table.resize_work);
+
+		lookups = 0;
+		start = ktime_get_ns();
+		do {
+			i = get_random_int() % count;
+			entry = index_hashtable_lookup(&table, INDEX_HASHTABLE_KEYPAIR, entries[i].index);
+			if (entry != &entries[i]) {
+				pr_info("index hashtable self-test lookup %u/%u: FAIL\n", i, count);
+				success = false;
+				break;
+			}
+			peer_put(entry->peer);
+			if (!(++lookups % 1024))
+				cond_resched();
+		} while (ktime_get_ns() - start < NSEC_PER_SEC / 20);
+		if (!success)
+			break;
+		pr_info("index hashtable: %llu ns per lookup with %u entries\n", div64_u64(ktime_get_ns() - start, lookups), count);
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (i % 16)
+			index_hashtable_remove(&table, &entries[i]);
+		if (!(i % 1024))
+			cond_resched();
+	}
+	for (i = 0; i < count; ++i) {
+		entry = index_hashtable_lookup(&table, INDEX_HASHTABLE_KEYPAIR | INDEX_HASHTABLE_HANDSHAKE, entries[i].index);
+		if (entry)
+			peer_put(entry->peer);
+		if (entry != (i % 16 ? NULL : &entries[i])) {
+			pr_info("index hashtable self-test removal %u: FAIL\n", i);
+			success = false;
+			break;
+		}
+		if (!(i % 1024))
+			cond_resched();
+	}
+	flush_work(&table.resize_work);
+	for (i = 0; i < count; i += 16)
+		index_hashtable_remove(&table, &entries[i]);
+	if (table.entries) {
+		pr_info("index hashtable self-test entry count: FAIL\n");
+		success = false;
+	}
+	flush_work(&table.resize_work);
+
+	if (success)
+		pr_info("index hashtable self-tests: pass\n");
+
+	index_hashtable_uninit(&table);
+out_entries:
+	vfree(entries);
+out_peer:
+	percpu_ref_exit(&peer->refcount);
+	kfree(peer);
+	return success;
+}
+#endif
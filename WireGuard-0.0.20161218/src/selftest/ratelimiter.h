@@ -0,0 +1,82 @@
+/* Copyright (C) 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
+
+#ifdef DEBUG
+#include <linux/delay.h>
+
+bool ratelimiter_selftest(void)
+{
+	struct ratelimiter ratelimiter;
+	struct sk_buff *skb4 = NULL, *skb6 = NULL;
+	struct iphdr *hdr4;
+	struct ipv6hdr *hdr6;
+	bool success = false;
+	size_t i = 0;
+	unsigned int j;
+
+	if (ratelimiter_init(&ratelimiter) < 0)
+		return false;
+
+	skb4 = alloc_skb(sizeof(struct iphdr), GFP_KERNEL);
+	skb6 = alloc_skb(sizeof(struct ipv6hdr), GFP_KERNEL);
+	if (!skb4 || !skb6)
+		goto out;
+	skb_reset_network_header(skb4);
+	hdr4 = (struct iphdr *)skb_put(skb4, sizeof(struct iphdr));
+	memset(hdr4, 0, sizeof(struct iphdr));
+	hdr4->version = 4;
+	hdr4->saddr = htonl(0xc0a80101);
+	skb_reset_network_header(skb6);
+	hdr6 = (struct ipv6hdr *)skb_put(skb6, sizeof(struct ipv6hdr));
+	memset(hdr6, 0, sizeof(struct ipv6hdr));
+	hdr6->version = 6;
+	hdr6->saddr.in6_u.u6_addr32[0] = htonl(0x20010db8);
+	hdr6->saddr.in6_u.u6_addr32[3] = htonl(1);
+
+	success = true;
+#define test(skb, expected) do { \
+	++i; \
+	if (ratelimiter_allow(&ratelimiter, skb) != (expected)) { \
+		pr_info("ratelimiter self-test %zu: FAIL\n", i); \
+		success = false; \
+	} \
+} while (0)
+	for (j = 0; j < RATELIMITER_PACKETS_BURSTABLE; ++j) {
+		test(skb4, true);
+		test(skb6, true);
+	}
+	test(skb4, false);
+	test(skb6, false);
+
+	/* Another address in the same /64 shares the bucket, unlike one from another /64. */
+	hdr6->saddr.in6_u.u6_addr32[3] = htonl(2);
+	test(skb6, false);
+	hdr6->saddr.in6_u.u6_addr32[1] = htonl(1);
+	test(skb6, true);
+
+	/* Other IPv4 addresses have buckets of their own. */
+	hdr4->saddr = htonl(0xc0a80102);
+	test(skb4, true);
+
+	/* After the cost of a packet has elapsed, one more is let through. */
+	hdr4->saddr = htonl(0xc0a80101);
+	msleep(DIV_ROUND_UP(RATELIMITER_PACKET_COST, NSEC_PER_MSEC));
+	test(skb4, true);
+
+	/* Once the table is full, new sources are turned away, but known ones aren't. */
+	ratelimiter.max_entries = atomic_read(&ratelimiter.total_entries);
+	hdr4->saddr = htonl(0xc0a80103);
+	test(skb4, false);
+	hdr4->saddr = htonl(0xc0a80102);
+	test(skb4, true);
+#undef test
+
+	if (success)
+		pr_info("ratelimiter self-tests: pass\n");
+
+out:
+	kfree_skb(skb4);
+	kfree_skb(skb6);
+	ratelimiter_uninit(&ratelimiter);
+	return success;
+}
+#endif
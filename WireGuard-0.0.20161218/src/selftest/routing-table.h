@@ -1,6 +1,8 @@
 /* Copyright (C) 2015-2016 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved. */
 
 #ifdef DEBUG
+#include <linux/random.h>
+
 static inline struct in_addr *ip4(u8 a, u8 b, u8 c, u8 d)
 {
 	static struct in_addr ip;
@@ -22,17 +24,125 @@ static inline struct in6_addr *ip6(u32 a, u32 b, u32 c, u32 d)
 	return &ip;
 }
 
+/* Fills a routing table with random, heavily nested prefixes, compiles it, and checks
+ * that every lookup through the compiled trie agrees with the binary trie walk. */
+static bool routing_table_lc_random_selftest(struct wireguard_peer *peers[], size_t num_peers)
+{
+	enum { NUM_BASES = 16, NUM_PREFIXES = 2000, NUM_LOOKUPS = 20000 };
+	struct routing_table t;
+	u8 bases[NUM_BASES][16], key[16];
+	struct lc_trie *lc4, *lc6;
+	unsigned int i, j, cidr, round;
+	bool success = true;
+
+	if (routing_table_init(&t) < 0)
+		return false;
+	get_random_bytes(bases, sizeof(bases));
+
+#define random_key(len) do { \
+	memcpy(key, bases[prandom_u32_max(NUM_BASES)], 16); \
+	for (j = prandom_u32_max(len * 8 + 1); j < len * 8; ++j) \
+		key[j / 8] ^= (prandom_u32() & 1) << (7 - j % 8); \
+} while (0)
+	for (round = 0; round < 2; ++round) {
+		for (i = 0; i < NUM_PREFIXES; ++i) {
+			random_key(4);
+			cidr = prandom_u32_max(33);
+			if (round)
+				routing_table_remove_v4(&t, (struct in_addr *)key, cidr);
+			else
+				routing_table_insert_v4(&t, (struct in_addr *)key, cidr, peers[prandom_u32_max(num_peers)]);
+			random_key(16);
+			cidr = prandom_u32_max(129);
+			if (round)
+				routing_table_remove_v6(&t, (struct in6_addr *)key, cidr);
+			else
+				routing_table_insert_v6(&t, (struct in6_addr *)key, cidr, peers[prandom_u32_max(num_peers)]);
+		}
+		if (round)
+			routing_table_remove_by_peer(&t, peers[0]);
+
+		mutex_lock(&t.table_update_lock);
+		lc_rebuild(&t);
+		mutex_unlock(&t.table_update_lock);
+
+		rcu_read_lock();
+		lc4 = rcu_dereference(t.lc4);
+		lc6 = rcu_dereference(t.lc6);
+		if (!lc4 || !lc6) {
+			rcu_read_unlock();
+			pr_info("routing table self-test lc build: FAIL\n");
+			success = false;
+			break;
+		}
+		for (i = 0; i < NUM_LOOKUPS; ++i) {
+			struct routing_table_node *node;
+
+			random_key(4);
+			node = find_node(rcu_dereference(t.root4), 32, key);
+			if (round && node && node->peer == peers[0]) {
+				pr_info("routing table self-test remove by peer v4 %u: FAIL\n", i);
+				success = false;
+			}
+			if (lc_lookup(lc4, key) != (node ? node->peer : NULL)) {
+				pr_info("routing table self-test lc v4 %u/%u: FAIL\n", round, i);
+				success = false;
+			}
+			random_key(16);
+			node = find_node(rcu_dereference(t.root6), 128, key);
+			if (round && node && node->peer == peers[0]) {
+				pr_info("routing table self-test remove by peer v6 %u: FAIL\n", i);
+				success = false;
+			}
+			if (lc_lookup(lc6, key) != (node ? node->peer : NULL)) {
+				pr_info("routing table self-test lc v6 %u/%u: FAIL\n", round, i);
+				success = false;
+			}
+		}
+		rcu_read_unlock();
+	}
+#undef random_key
+
+	routing_table_free(&t);
+	return success;
+}
+
+/* The peers here are never killed, so their references only need to work, not to ever drop to zero. */
+static void selftest_peer_release(struct percpu_ref *ref)
+{
+}
+
+static void selftest_peer_free(struct wireguard_peer *peer)
+{
+	if (!peer)
+		return;
+	percpu_ref_exit(&peer->refcount);
+	kfree(peer);
+}
+
 bool routing_table_selftest(void)
 {
 	struct routing_table t;
 	struct wireguard_peer *a = NULL, *b = NULL, *c = NULL, *d = NULL, *e = NULL, *f = NULL, *g = NULL, *h = NULL;
 	size_t i = 0;
+	unsigned int pass;
 	bool success = false;
 	struct in6_addr ip;
+	u64 hits, misses;
 	__be64 part;
 
-	routing_table_init(&t);
-#define init_peer(name) do { name = kzalloc(sizeof(struct wireguard_peer), GFP_KERNEL); if (!name) goto free; kref_init(&name->refcount); } while (0)
+	if (routing_table_init(&t) < 0)
+		goto free;
+#define init_peer(name) do { \
+	name = kzalloc(sizeof(struct wireguard_peer), GFP_KERNEL); \
+	if (!name) \
+		goto free; \
+	if (percpu_ref_init(&name->refcount, selftest_peer_release, 0, GFP_KERNEL)) { \
+		kfree(name); \
+		name = NULL; \
+		goto free; \
+	} \
+} while (0)
 	init_peer(a);
 	init_peer(b);
 	init_peer(c);
@@ -65,11 +175,19 @@ bool routing_table_selftest(void)
 	insert(4, b, 10, 1, 0, 4, 30);
 	insert(4, c, 10, 1, 0, 8, 29);
 	insert(4, d, 10, 1, 0, 16, 29);
-#undef insert
 
 	success = true;
+	for (pass = 0; pass < 2; ++pass) {
+	/* The second time around, lookups go through the compiled tries. */
+	if (pass) {
+		mutex_lock(&t.table_update_lock);
+		lc_rebuild(&t);
+		mutex_unlock(&t.table_update_lock);
+	}
 #define test(version, mem, ipa, ipb, ipc, ipd) do { \
-	bool _s = routing_table_lookup_v##version(&t, ip##version(ipa, ipb, ipc, ipd)) == mem; \
+	struct wireguard_peer *_p = routing_table_lookup_v##version(&t, ip##version(ipa, ipb, ipc, ipd)); \
+	bool _s = _p == mem; \
+	peer_put(_p); \
 	++i; \
 	if (!_s) { \
 		pr_info("routing table self-test %zu: FAIL\n", i); \
@@ -104,7 +222,61 @@ bool routing_table_selftest(void)
 	test(4, b, 10, 1, 0, 6);
 	test(4, c, 10, 1, 0, 10);
 	test(4, d, 10, 1, 0, 20);
+	}
+
+	/* The per-CPU cache must follow every change to the table. */
+#define test_cached(mem) do { \
+	struct wireguard_peer *_p = lookup_cached(&t, (const u8 *)ip4(10, 1, 0, 20), 4); \
+	bool _s = _p == mem; \
+	peer_put(_p); \
+	++i; \
+	if (!_s) { \
+		pr_info("routing table self-test %zu: FAIL\n", i); \
+		success = false; \
+	} \
+} while (0)
+	test_cached(d);
+	test_cached(d);
+	routing_table_insert_v4(&t, ip4(10, 1, 0, 20), 32, e);
+	test_cached(e);
+	routing_table_remove_by_peer(&t, e);
+	test_cached(d);
+#undef test_cached
+	routing_table_cache_stats(&t, &hits, &misses);
+	if (hits + misses != 4 || misses < 3) {
+		pr_info("routing table self-test cache stats: FAIL\n");
+		success = false;
+	}
+
+	/* Nothing in an update is visible until it is published, and only stale entries are dropped. */
+	routing_table_begin_update(&t);
+	routing_table_stale_by_peer(&t, c);
+	insert(4, c, 192, 168, 0, 0, 16);
+	insert(4, c, 172, 16, 0, 0, 12);
+	test(4, c, 192, 95, 5, 70);
+	test(4, NULL, 172, 16, 1, 1);
+	routing_table_end_update(&t);
+	test(4, c, 192, 168, 200, 182);
+	test(4, c, 172, 16, 1, 1);
+	test(4, NULL, 192, 95, 5, 70);
+	test(4, NULL, 10, 1, 0, 10);
+	test(4, d, 10, 1, 0, 20);
+	test(6, f, 0x26075300, 0x60006b00, 0, 0xc02e01ee);
+	test(6, d, 0x26075300, 0x60006b00, 0, 0xc05f0543);
+
+	/* Marking a peer stale again drops what was inserted for it since, and outside of an update, it removes straight away. */
+	routing_table_begin_update(&t);
+	routing_table_stale_by_peer(&t, c);
+	insert(4, c, 192, 168, 0, 0, 16);
+	routing_table_stale_by_peer(&t, c);
+	insert(4, c, 172, 16, 0, 0, 12);
+	routing_table_end_update(&t);
+	test(4, NULL, 192, 168, 200, 182);
+	test(4, c, 172, 16, 1, 1);
+	routing_table_stale_by_peer(&t, c);
+	test(4, NULL, 172, 16, 1, 1);
 #undef test
+#undef insert
 
 	/* These will hit the BUG_ON(len >= 128) in free_node if something goes wrong. */
 	for (i = 0; i < 128; ++i) {
@@ -114,19 +286,22 @@ bool routing_table_selftest(void)
 		routing_table_insert_v6(&t, &ip, 128, a);
 	}
 
+	if (!routing_table_lc_random_selftest((struct wireguard_peer *[]){ a, b, c, d, e, f, g, h }, 8))
+		success = false;
+
 	if (success)
 		pr_info("routing table self-tests: pass\n");
 
 free:
 	routing_table_free(&t);
-	kfree(a);
-	kfree(b);
-	kfree(c);
-	kfree(d);
-	kfree(e);
-	kfree(f);
-	kfree(g);
-	kfree(h);
+	selftest_peer_free(a);
+	selftest_peer_free(b);
+	selftest_peer_free(c);
+	selftest_peer_free(d);
+	selftest_peer_free(e);
+	selftest_peer_free(f);
+	selftest_peer_free(g);
+	selftest_peer_free(h);
 
 	return success;
 }
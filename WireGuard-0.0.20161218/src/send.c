@@ -34,6 +34,7 @@ static void packet_send_handshake_initiation(struct wireguard_peer *peer)
 		timers_any_authenticated_packet_traversal(peer);
 		socket_send_buffer_to_peer(peer, &packet, sizeof(struct message_handshake_initiation), HANDSHAKE_DSCP);
 		timers_handshake_initiated(peer);
+		peer_stats_add(peer, handshake_initiations, 1);
 	}
 }
 
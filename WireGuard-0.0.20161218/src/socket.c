@@ -10,6 +10,7 @@
 #include <linux/net.h>
 #include <linux/if_vlan.h>
 #include <linux/if_ether.h>
+#include <linux/version.h>
 #include <net/udp_tunnel.h>
 #include <net/ipv6.h>
 
@@ -156,7 +157,9 @@ int socket_send_skb_to_peer(struct wireguard_peer *peer, struct sk_buff *skb, u8
 	else if (peer->endpoint.addr.sa_family == AF_INET6)
 		ret = send6(peer->device, skb, &peer->endpoint, ds, &peer->endpoint_cache);
 	if (likely(!ret))
-		peer->tx_bytes += skb_len;
+		peer_stats_add_packet(peer, tx, skb_len);
+	else
+		peer_stats_add(peer, tx_dropped, 1);
 	read_unlock_bh(&peer->endpoint_lock);
 
 	return ret;
@@ -280,6 +283,88 @@ err:
 	return 0;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+/* Returns whether p holds the train that header belongs to. Those it doesn't are marked as
+ * being of a different flow, so that they aren't looked at again for this skb. */
+static bool gro_same_train(struct sk_buff *p, unsigned int off, const struct message_data *header)
+{
+	struct message_data *p_header, p_header_buf;
+
+	if (!NAPI_GRO_CB(p)->same_flow)
+		return false;
+	p_header = skb_header_pointer(p, off, sizeof(p_header_buf), &p_header_buf);
+	if (!p_header || p_header->key_idx != header->key_idx) {
+		NAPI_GRO_CB(p)->same_flow = 0;
+		return false;
+	}
+	return true;
+}
+
+/* This lets GRO coalesce back-to-back data messages from the same source and key index
+ * into a single train, which packet_consume_data() splits back up and decrypts as one
+ * batch. Just like for UDP GSO, every message but the last must be exactly gso_size
+ * bytes long, so a shorter message ends the train. Handshake messages are never held.
+ * Since 4.19, the held skbs are on a list_head, and skb_gro_receive takes the skb itself. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+static struct sk_buff *gro_receive(struct sock *sk, struct list_head *head, struct sk_buff *skb)
+#else
+static struct sk_buff **gro_receive(struct sock *sk, struct sk_buff **head, struct sk_buff *skb)
+#endif
+{
+	struct message_data *header;
+	unsigned int off = skb_gro_offset(skb), hlen = off + sizeof(struct message_data), len = skb_gro_len(skb);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	struct sk_buff *p, *pp = NULL;
+#else
+	struct sk_buff *p, **pp = NULL;
+#endif
+	int flush = 1;
+
+	header = skb_gro_header_fast(skb, off);
+	if (skb_gro_header_hard(skb, hlen)) {
+		header = skb_gro_header_slow(skb, hlen, off);
+		if (unlikely(!header))
+			goto out;
+	}
+	if (header->header.type != cpu_to_le32(MESSAGE_DATA) || len < MESSAGE_MINIMUM_LENGTH)
+		goto out;
+
+	flush = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	list_for_each_entry(p, head, list) {
+		if (!gro_same_train(p, off, header))
+			continue;
+		if (len > skb_shinfo(p)->gso_size || skb_gro_receive(p, skb) || len != skb_shinfo(p)->gso_size || NAPI_GRO_CB(p)->count >= MAX_GRO_TRAIN_LENGTH)
+			pp = p;
+		break;
+	}
+#else
+	for (; (p = *head); head = &p->next) {
+		if (!gro_same_train(p, off, header))
+			continue;
+		if (len > skb_shinfo(p)->gso_size || skb_gro_receive(head, skb) || len != skb_shinfo(p)->gso_size || NAPI_GRO_CB(p)->count >= MAX_GRO_TRAIN_LENGTH)
+			pp = head;
+		break;
+	}
+#endif
+
+out:
+	NAPI_GRO_CB(skb)->flush |= flush;
+	return pp;
+}
+
+static int gro_complete(struct sock *sk, struct sk_buff *skb, int nhoff)
+{
+	/* udp_gro_complete has already marked the train as UDP tunnel GSO with encapsulation set,
+	 * so should anything on the way to us segment it again, the inner headers must point at
+	 * the messages rather than wherever they were left. Otherwise there's nothing to fix up,
+	 * since the train is split by gso_size on receive. */
+	skb_set_inner_mac_header(skb, nhoff);
+	skb_set_inner_network_header(skb, nhoff);
+	return 0;
+}
+#endif
+
 /* Generates a default port from the interface name.
  * wg0 --> 51820
  * wg1 --> 51821
@@ -356,7 +441,11 @@ int socket_init(struct wireguard_device *wg)
 	struct udp_tunnel_sock_cfg cfg = {
 		.sk_user_data = wg,
 		.encap_type = 1,
-		.encap_rcv = receive
+		.encap_rcv = receive,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+		.gro_receive = gro_receive,
+		.gro_complete = gro_complete
+#endif
 	};
 
 	mutex_lock(&wg->socket_update_lock);
@@ -9,6 +9,7 @@
 #include <linux/if_ether.h>
 
 struct wireguard_device;
+struct wireguard_peer;
 struct endpoint;
 
 int socket_init(struct wireguard_device *wg);
@@ -20,7 +20,6 @@ test: debug
 	-sudo modprobe udp_tunnel
 	-sudo modprobe x_tables
 	-sudo modprobe ipv6
-	-sudo modprobe xt_hashlimit
 	-sudo modprobe nf_conntrack_ipv4
 	-sudo modprobe nf_conntrack_ipv6
 	-sudo rmmod wireguard
@@ -280,3 +280,52 @@ n1 ping -W 1 -c 1 192.168.241.2
 ip1 addr add fd00:aa::10/96 dev veth1
 ip1 addr del fd00:aa::1/96 dev veth1
 n1 ping -W 1 -c 1 192.168.241.2
+
+# Compare the throughput of several builds of the module, such as one with the old padata
+# engine against one with the per-peer queues, by listing their .ko files, in the order
+# they are to be run, in $WG_BENCHMARK_MODULES. Each one is loaded in turn in place of
+# whatever module is loaded now, and the last one stays loaded afterwards. On a kernel with
+# CONFIG_LOCK_STAT, how often the timer base locks were contended during the runs is printed
+# as well, which is what arming the peer timers lazily should bring down. Every build is run
+# with one to eight parallel streams, which all go through the one peer, so that how well
+# its reference count scales across CPUs shows, such as with a kref against a percpu_ref.
+benchmark() {
+	local ko streams result results=( )
+
+	ip1 link del veth1
+	ip1 link del wg0
+	ip2 link del wg0
+	for ko in $WG_BENCHMARK_MODULES; do
+		pp rmmod wireguard || true
+		pp insmod "$ko"
+		ip0 link add dev wg0 type wireguard
+		ip0 link set wg0 netns $netns1
+		ip0 link add dev wg0 type wireguard
+		ip0 link set wg0 netns $netns2
+		configure_peers
+		n1 wg set wg0 peer "$pub2" endpoint 127.0.0.1:2
+		n2 wg set wg0 peer "$pub1" endpoint 127.0.0.1:1
+		n1 ping -W 1 -c 1 192.168.241.2
+
+		if [[ -w /proc/lock_stat ]]; then
+			printf 0 > /proc/lock_stat
+			printf 1 > /proc/sys/kernel/lock_stat
+		fi
+		for streams in 1 2 4 8; do
+			n2 iperf3 -s -1 -B 192.168.241.2 &
+			waitiperf $netns2
+			results+=( "$ko: $streams streams: $(n1 iperf3 -Z -t 10 -f m -P $streams -c 192.168.241.2 | sed -n 's/.* \([0-9.]\+ Mbits\/sec\) .*receiver$/\1/p' | tail -n 1)" )
+		done
+		if [[ -w /proc/lock_stat ]]; then
+			printf 0 > /proc/sys/kernel/lock_stat
+			results+=( "$ko: $(awk '/con-bounces/ { for (i = 1; i <= NF; ++i) col[$i] = i - 1 } $1 ~ /^&(\(&)?base->lock(\)->rlock)?[#0-9]*:$/ { printf "%s %d contentions in %d acquisitions ", $1, $col["contentions"], $col["acquisitions"] }' /proc/lock_stat)" )
+		fi
+
+		ip1 link del wg0
+		ip2 link del wg0
+	done
+	for result in "${results[@]}"; do
+		pretty "" "$result"
+	done
+}
+if [[ -n $WG_BENCHMARK_MODULES ]]; then benchmark; fi
@@ -13,31 +13,125 @@
  * Timer for, if enabled, sending an empty authenticated packet every user-specified seconds
  */
 
+/* Rather than each peer having five kernel timers, which for many thousands of peers means
+ * many thousands of timers expiring at nearly the same moments, each device has a coarse
+ * timer wheel with one slot per quarter second or so, and a peer sits in the slot of its
+ * earliest deadline. A single work item walks the slots as they come due and handles the
+ * peers in them in batches. Deadlines further out than a full turn of the wheel just stay
+ * in their slot for the turns in between.
+ *
+ * Since these timers are touched for nearly every packet, they are also armed lazily: the
+ * packet path only records the deadline and a bit in peer->timers_armed, and only takes the
+ * wheel lock when the deadline falls in an earlier slot than the peer is already in. When a
+ * peer comes due, each armed timer is checked against its current deadline, and the peer is
+ * put back in the slot of whatever is left. Cancelling is just clearing the bit.
+ *
+ * The one race that matters is the packet path arming a timer just as the wheel takes the peer
+ * out of its slot: each side writes one thing and then reads the other's, so both need a full
+ * barrier in between, or each can miss the other's write and the timer is lost for good. See
+ * timers_arm() and expire_peer(). Beyond that, a timer armed again at the very moment it
+ * fires may be taken as having fired, just as if the packet had been a moment earlier. */
+
+#define TIMER_WHEEL_GRANULARITY roundup_pow_of_two(HZ / 4)
+
 /* This rounds the time down to the closest power of two of the closest quarter second. */
 static inline unsigned long slack_time(unsigned long time)
 {
-	return time & ~(roundup_pow_of_two(HZ / 4) - 1);
+	return time & ~(TIMER_WHEEL_GRANULARITY - 1);
+}
+
+/* The time of the first slot that isn't before the given time, so that nothing fires early. */
+static inline unsigned long timer_wheel_slot(unsigned long time)
+{
+	return slack_time(time + TIMER_WHEEL_GRANULARITY - 1);
+}
+
+static inline struct hlist_head *timer_wheel_bucket(struct timer_wheel *wheel, unsigned long slot)
+{
+	return &wheel->slots[(slot / TIMER_WHEEL_GRANULARITY) & (TIMER_WHEEL_SLOTS - 1)];
+}
+
+/* Must be called with the wheel lock held. */
+static void timer_wheel_wake(struct wireguard_device *wg, unsigned long slot)
+{
+	struct timer_wheel *wheel = &wg->timer_wheel;
+	long delay;
+
+	if (wheel->scheduled && !time_before(slot, wheel->next_run))
+		return;
+	wheel->scheduled = true;
+	wheel->next_run = slot;
+	delay = (long)(slot - jiffies);
+	mod_delayed_work(wg->workqueue, &wheel->work, max(delay, 0L));
+}
+
+static void timer_wheel_add(struct wireguard_peer *peer, unsigned long expires)
+{
+	struct timer_wheel *wheel = &peer->device->timer_wheel;
+	unsigned long slot = timer_wheel_slot(expires);
+
+	spin_lock_bh(&wheel->lock);
+	if (unlikely(!peer->timers_enabled))
+		goto out;
+	if (!hlist_unhashed(&peer->timer_wheel_node)) {
+		if (!time_before(slot, peer->timer_wheel_slot))
+			goto out;
+		hlist_del(&peer->timer_wheel_node);
+	}
+	if (time_before(slot, wheel->clock))
+		slot = wheel->clock;
+	peer->timer_wheel_slot = slot;
+	hlist_add_head(&peer->timer_wheel_node, timer_wheel_bucket(wheel, slot));
+	timer_wheel_wake(peer->device, slot);
+out:
+	spin_unlock_bh(&wheel->lock);
 }
 
-#define peer_get_from_ptr(ptr) \
-	struct wireguard_peer *peer = peer_rcu_get((struct wireguard_peer *)ptr); \
-	if (unlikely(!peer)) \
+static inline void timers_arm(struct wireguard_peer *peer, enum peer_timer timer, unsigned long expires)
+{
+	bool moved = false;
+
+	if (unlikely(!READ_ONCE(peer->timers_enabled)))
 		return;
+	if (READ_ONCE(peer->timer_deadlines[timer]) != expires) {
+		WRITE_ONCE(peer->timer_deadlines[timer], expires);
+		moved = true;
+	}
+	/* Pairs with the smp_mb() in expire_peer(). Either the wheel sees our bit and deadline
+	 * after taking the peer out of its slot and puts it back, or we see that it's been taken
+	 * out and put it back ourselves. When nothing changed, there's nothing to be seen. */
+	if (!test_bit(timer, &peer->timers_armed)) {
+		set_bit(timer, &peer->timers_armed);
+		smp_mb__after_atomic();
+	} else if (moved)
+		smp_mb();
+	if (hlist_unhashed(&peer->timer_wheel_node) || time_before(timer_wheel_slot(expires), READ_ONCE(peer->timer_wheel_slot)))
+		timer_wheel_add(peer, expires);
+}
+
+static inline void timers_cancel(struct wireguard_peer *peer, enum peer_timer timer)
+{
+	if (test_bit(timer, &peer->timers_armed))
+		clear_bit(timer, &peer->timers_armed);
+}
 
-static void expired_retransmit_handshake(unsigned long ptr)
+static inline bool timer_is_armed(struct wireguard_peer *peer, enum peer_timer timer)
+{
+	return test_bit(timer, &peer->timers_armed);
+}
+
+static void expired_retransmit_handshake(struct wireguard_peer *peer)
 {
-	peer_get_from_ptr(ptr);
 	pr_debug("Handshake for peer %Lu (%pISpfsc) did not complete after %d seconds, retrying\n", peer->internal_id, &peer->endpoint.addr, REKEY_TIMEOUT / HZ);
 	if (peer->timer_handshake_attempts > MAX_TIMER_HANDSHAKES) {
-		del_timer(&peer->timer_send_keepalive);
+		timers_cancel(peer, TIMER_SEND_KEEPALIVE);
 		/* We remove all existing packets and don't try again,
 		 * if we try unsuccessfully for too long to make a handshake. */
 		skb_queue_purge(&peer->tx_packet_queue);
 		/* We set a timer for destroying any residue that might be left
 		 * of a partial exchange. */
-		if (likely(peer->timer_kill_ephemerals.data))
-			mod_timer(&peer->timer_kill_ephemerals, jiffies + (REJECT_AFTER_TIME * 3));
-		goto out;
+		timers_arm(peer, TIMER_KILL_EPHEMERALS, jiffies + (REJECT_AFTER_TIME * 3));
+		return;
 	}
 
 	/* We clear the endpoint address src address, in case this is the cause of trouble. */
@@ -45,34 +139,30 @@ static void expired_retransmit_handshake(unsigned long ptr)
 
 	packet_queue_handshake_initiation(peer);
 	++peer->timer_handshake_attempts;
-out:
-	peer_put(peer);
 }
 
-static void expired_send_keepalive(unsigned long ptr)
+static void expired_send_keepalive(struct wireguard_peer *peer)
 {
-	peer_get_from_ptr(ptr);
 	packet_send_keepalive(peer);
 	if (peer->timer_need_another_keepalive) {
 		peer->timer_need_another_keepalive = false;
-		mod_timer(&peer->timer_send_keepalive, jiffies + KEEPALIVE_TIMEOUT);
+		timers_arm(peer, TIMER_SEND_KEEPALIVE, jiffies + KEEPALIVE_TIMEOUT);
 	}
-	peer_put(peer);
 }
 
-static void expired_new_handshake(unsigned long ptr)
+static void expired_new_handshake(struct wireguard_peer *peer)
 {
-	peer_get_from_ptr(ptr);
 	pr_debug("Retrying handshake with peer %Lu (%pISpfsc) because we stopped hearing back after %d seconds\n", peer->internal_id, &peer->endpoint.addr, (KEEPALIVE_TIMEOUT + REKEY_TIMEOUT) / HZ);
 	/* We clear the endpoint address src address, in case this is the cause of trouble. */
 	socket_clear_peer_endpoint_src(peer);
 	packet_queue_handshake_initiation(peer);
-	peer_put(peer);
 }
 
-static void expired_kill_ephemerals(unsigned long ptr)
+static void expired_kill_ephemerals(struct wireguard_peer *peer)
 {
-	peer_get_from_ptr(ptr);
+	peer = peer_rcu_get(peer);
+	if (unlikely(!peer))
+		return;
 	if (!queue_work(peer->device->workqueue, &peer->clear_peer_work)) /* Takes our reference. */
 		peer_put(peer); /* If the work was already on the queue, we want to drop the extra reference */
 }
@@ -85,122 +175,219 @@ static void queued_expired_kill_ephemerals(struct work_struct *work)
 	peer_put(peer);
 }
 
-static void expired_send_persistent_keepalive(unsigned long ptr)
+static void expired_send_persistent_keepalive(struct wireguard_peer *peer)
 {
-	peer_get_from_ptr(ptr);
 	if (likely(peer->persistent_keepalive_interval))
 		packet_send_keepalive(peer);
-	peer_put(peer);
+}
+
+static void (*const timer_functions[TIMER_COUNT])(struct wireguard_peer *peer) = {
+	[TIMER_RETRANSMIT_HANDSHAKE] = expired_retransmit_handshake,
+	[TIMER_SEND_KEEPALIVE] = expired_send_keepalive,
+	[TIMER_NEW_HANDSHAKE] = expired_new_handshake,
+	[TIMER_KILL_EPHEMERALS] = expired_kill_ephemerals,
+	[TIMER_PERSISTENT_KEEPALIVE] = expired_send_persistent_keepalive
+};
+
+static void expire_peer(struct wireguard_peer *peer)
+{
+	struct timer_wheel *wheel = &peer->device->timer_wheel;
+	unsigned long expires, next = 0, due = 0;
+	bool pending = false;
+	unsigned int i;
+
+	/* Pairs with the barrier in timers_arm(): timer_wheel_run() has just unhashed us, and that
+	 * must be visible before we look at which timers are armed, as spin_unlock doesn't order it. */
+	smp_mb();
+
+	/* The timers are claimed under the wheel lock, so that once timers_uninit_peer() has
+	 * disabled them, none can be claimed anymore, and timers_uninit_peer_wait() only has
+	 * to wait for the wheel to finish with those that were claimed before. */
+	spin_lock_bh(&wheel->lock);
+	for (i = 0; peer->timers_enabled && i < TIMER_COUNT; ++i) {
+		if (!timer_is_armed(peer, i) || time_before(jiffies, READ_ONCE(peer->timer_deadlines[i])))
+			continue;
+		if (test_and_clear_bit(i, &peer->timers_armed))
+			__set_bit(i, &due);
+	}
+	spin_unlock_bh(&wheel->lock);
+
+	/* The timer functions were written to run from softirq context, so that's what they get. */
+	local_bh_disable();
+	for_each_set_bit(i, &due, TIMER_COUNT)
+		timer_functions[i](peer);
+	local_bh_enable();
+
+	for (i = 0; i < TIMER_COUNT; ++i) {
+		if (!timer_is_armed(peer, i))
+			continue;
+		expires = READ_ONCE(peer->timer_deadlines[i]);
+		if (!pending || time_before(expires, next))
+			next = expires;
+		pending = true;
+	}
+	if (pending)
+		timer_wheel_add(peer, next);
+}
+
+static void timer_wheel_run(struct work_struct *work)
+{
+	struct timer_wheel *wheel = container_of(to_delayed_work(work), struct timer_wheel, work);
+	struct wireguard_device *wg = container_of(wheel, struct wireguard_device, timer_wheel);
+	struct wireguard_peer *batch[MAX_BURST_EXPIRED_PEERS];
+	const unsigned long now = slack_time(jiffies);
+	struct wireguard_peer *peer;
+	struct hlist_node *temp;
+	size_t num, i;
+
+	spin_lock_bh(&wheel->lock);
+	wheel->scheduled = false;
+	/* If we've fallen more than a full turn behind, there's no sense in visiting slots twice. */
+	if (time_after(now, wheel->clock + (TIMER_WHEEL_SLOTS - 1) * TIMER_WHEEL_GRANULARITY))
+		wheel->clock = now - (TIMER_WHEEL_SLOTS - 1) * TIMER_WHEEL_GRANULARITY;
+	spin_unlock_bh(&wheel->lock);
+
+	do {
+		num = 0;
+		spin_lock_bh(&wheel->lock);
+		while (!time_after(wheel->clock, now)) {
+			hlist_for_each_entry_safe(peer, temp, timer_wheel_bucket(wheel, wheel->clock), timer_wheel_node) {
+				if (time_after(peer->timer_wheel_slot, wheel->clock))
+					continue; /* This one is due on a later turn of the wheel. */
+				if (num == MAX_BURST_EXPIRED_PEERS)
+					break;
+				hlist_del_init(&peer->timer_wheel_node);
+				if (likely(peer_rcu_get(peer)))
+					batch[num++] = peer;
+			}
+			if (num == MAX_BURST_EXPIRED_PEERS)
+				break;
+			wheel->clock += TIMER_WHEEL_GRANULARITY;
+		}
+		spin_unlock_bh(&wheel->lock);
+
+		for (i = 0; i < num; ++i) {
+			expire_peer(batch[i]);
+			peer_put(batch[i]);
+		}
+		cond_resched();
+	} while (num == MAX_BURST_EXPIRED_PEERS);
+
+	/* Sleep until the next slot that has anybody in it at all, even if only for a later turn. */
+	spin_lock_bh(&wheel->lock);
+	for (i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+		if (!hlist_empty(timer_wheel_bucket(wheel, wheel->clock + i * TIMER_WHEEL_GRANULARITY))) {
+			timer_wheel_wake(wg, wheel->clock + i * TIMER_WHEEL_GRANULARITY);
+			break;
+		}
+	}
+	spin_unlock_bh(&wheel->lock);
 }
 
 /* Should be called after an authenticated data packet is sent. */
 void timers_data_sent(struct wireguard_peer *peer)
 {
-	if (likely(peer->timer_send_keepalive.data))
-		del_timer(&peer->timer_send_keepalive);
+	timers_cancel(peer, TIMER_SEND_KEEPALIVE);
 
-	if (likely(peer->timer_new_handshake.data) && !timer_pending(&peer->timer_new_handshake))
-		mod_timer(&peer->timer_new_handshake, jiffies + KEEPALIVE_TIMEOUT + REKEY_TIMEOUT);
+	if (!timer_is_armed(peer, TIMER_NEW_HANDSHAKE))
+		timers_arm(peer, TIMER_NEW_HANDSHAKE, jiffies + KEEPALIVE_TIMEOUT + REKEY_TIMEOUT);
 }
 
 /* Should be called after an authenticated data packet is received. */
 void timers_data_received(struct wireguard_peer *peer)
 {
-	if (likely(peer->timer_send_keepalive.data) && !timer_pending(&peer->timer_send_keepalive))
-		mod_timer(&peer->timer_send_keepalive, jiffies + KEEPALIVE_TIMEOUT);
-	else
+	if (!timer_is_armed(peer, TIMER_SEND_KEEPALIVE))
+		timers_arm(peer, TIMER_SEND_KEEPALIVE, jiffies + KEEPALIVE_TIMEOUT);
+	else if (!peer->timer_need_another_keepalive)
 		peer->timer_need_another_keepalive = true;
 }
 
 /* Should be called after any type of authenticated packet is received -- keepalive or data. */
 void timers_any_authenticated_packet_received(struct wireguard_peer *peer)
 {
-	if (likely(peer->timer_new_handshake.data))
-		del_timer(&peer->timer_new_handshake);
+	timers_cancel(peer, TIMER_NEW_HANDSHAKE);
 }
 
 /* Should be called after a handshake initiation message is sent. */
 void timers_handshake_initiated(struct wireguard_peer *peer)
 {
-	if (likely(peer->timer_send_keepalive.data))
-		del_timer(&peer->timer_send_keepalive);
-	if (likely(peer->timer_retransmit_handshake.data))
-		mod_timer(&peer->timer_retransmit_handshake, slack_time(jiffies + REKEY_TIMEOUT + prandom_u32_max(REKEY_TIMEOUT_JITTER_MAX)));
+	timers_cancel(peer, TIMER_SEND_KEEPALIVE);
+	timers_arm(peer, TIMER_RETRANSMIT_HANDSHAKE, slack_time(jiffies + REKEY_TIMEOUT + prandom_u32_max(REKEY_TIMEOUT_JITTER_MAX)));
 }
 
 /* Should be called after a handshake response message is received and processed. */
 void timers_handshake_complete(struct wireguard_peer *peer)
 {
-	if (likely(peer->timer_retransmit_handshake.data))
-		del_timer(&peer->timer_retransmit_handshake);
+	timers_cancel(peer, TIMER_RETRANSMIT_HANDSHAKE);
 	peer->timer_handshake_attempts = 0;
 }
 
 /* Should be called after an ephemeral key is created, which is before sending a handshake response or after receiving a handshake response. */
 void timers_ephemeral_key_created(struct wireguard_peer *peer)
 {
-	if (likely(peer->timer_kill_ephemerals.data))
-		mod_timer(&peer->timer_kill_ephemerals, jiffies + (REJECT_AFTER_TIME * 3));
+	timers_arm(peer, TIMER_KILL_EPHEMERALS, jiffies + (REJECT_AFTER_TIME * 3));
 	do_gettimeofday(&peer->walltime_last_handshake);
 }
 
 /* Should be called before an packet with authentication -- data, keepalive, either handshake -- is sent, or after one is received. */
 void timers_any_authenticated_packet_traversal(struct wireguard_peer *peer)
 {
-	if (peer->persistent_keepalive_interval && likely(peer->timer_persistent_keepalive.data))
-		mod_timer(&peer->timer_persistent_keepalive, slack_time(jiffies + peer->persistent_keepalive_interval));
+	if (peer->persistent_keepalive_interval)
+		timers_arm(peer, TIMER_PERSISTENT_KEEPALIVE, slack_time(jiffies + peer->persistent_keepalive_interval));
 }
 
-void timers_init_peer(struct wireguard_peer *peer)
+/* Should be called after all keys have been cleared, since there's then nothing left to kill. */
+void timers_keys_cleared(struct wireguard_peer *peer)
 {
-	init_timer(&peer->timer_retransmit_handshake);
-	peer->timer_retransmit_handshake.function = expired_retransmit_handshake;
-	peer->timer_retransmit_handshake.data = (unsigned long)peer;
+	timers_cancel(peer, TIMER_KILL_EPHEMERALS);
+}
 
-	init_timer(&peer->timer_send_keepalive);
-	peer->timer_send_keepalive.function = expired_send_keepalive;
-	peer->timer_send_keepalive.data = (unsigned long)peer;
+void timers_init_device(struct wireguard_device *wg)
+{
+	struct timer_wheel *wheel = &wg->timer_wheel;
+	unsigned int i;
 
-	init_timer(&peer->timer_new_handshake);
-	peer->timer_new_handshake.function = expired_new_handshake;
-	peer->timer_new_handshake.data = (unsigned long)peer;
+	for (i = 0; i < TIMER_WHEEL_SLOTS; ++i)
+		INIT_HLIST_HEAD(&wheel->slots[i]);
+	wheel->clock = slack_time(jiffies);
+	wheel->scheduled = false;
+	spin_lock_init(&wheel->lock);
+	INIT_DELAYED_WORK(&wheel->work, timer_wheel_run);
+}
 
-	init_timer(&peer->timer_kill_ephemerals);
-	peer->timer_kill_ephemerals.function = expired_kill_ephemerals;
-	peer->timer_kill_ephemerals.data = (unsigned long)peer;
+/* Should be called once there are no more peers, before the device workqueue is destroyed. */
+void timers_uninit_device(struct wireguard_device *wg)
+{
+	cancel_delayed_work_sync(&wg->timer_wheel.work);
+}
 
-	init_timer(&peer->timer_persistent_keepalive);
-	peer->timer_persistent_keepalive.function = expired_send_persistent_keepalive;
-	peer->timer_persistent_keepalive.data = (unsigned long)peer;
+void timers_init_peer(struct wireguard_peer *peer)
+{
+	struct timer_wheel *wheel = &peer->device->timer_wheel;
 
+	spin_lock_bh(&wheel->lock);
+	peer->timers_armed = 0;
+	peer->timers_enabled = true;
+	spin_unlock_bh(&wheel->lock);
 	INIT_WORK(&peer->clear_peer_work, queued_expired_kill_ephemerals);
 }
 
 void timers_uninit_peer(struct wireguard_peer *peer)
 {
-	if (peer->timer_retransmit_handshake.data) {
-		del_timer(&peer->timer_retransmit_handshake);
-		peer->timer_retransmit_handshake.data = 0;
-	}
-	if (peer->timer_send_keepalive.data) {
-		del_timer(&peer->timer_send_keepalive);
-		peer->timer_send_keepalive.data = 0;
-	}
-	if (peer->timer_new_handshake.data) {
-		del_timer(&peer->timer_new_handshake);
-		peer->timer_new_handshake.data = 0;
-	}
-	if (peer->timer_kill_ephemerals.data) {
-		del_timer(&peer->timer_kill_ephemerals);
-		peer->timer_kill_ephemerals.data = 0;
-	}
-	if (peer->timer_persistent_keepalive.data) {
-		del_timer(&peer->timer_persistent_keepalive);
-		peer->timer_persistent_keepalive.data = 0;
-	}
+	struct timer_wheel *wheel = &peer->device->timer_wheel;
+
+	spin_lock_bh(&wheel->lock);
+	peer->timers_enabled = false;
+	if (!hlist_unhashed(&peer->timer_wheel_node))
+		hlist_del_init(&peer->timer_wheel_node);
+	peer->timers_armed = 0;
+	spin_unlock_bh(&wheel->lock);
 }
+
+/* Once this returns, none of the peer's timer functions are running or will run again. */
 void timers_uninit_peer_wait(struct wireguard_peer *peer)
 {
 	timers_uninit_peer(peer);
+	flush_delayed_work(&peer->device->timer_wheel.work);
 	flush_work(&peer->clear_peer_work);
 }
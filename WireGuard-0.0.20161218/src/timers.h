@@ -3,8 +3,35 @@
 #ifndef WGTIMERS_H
 #define WGTIMERS_H
 
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+struct wireguard_device;
 struct wireguard_peer;
 
+enum peer_timer {
+	TIMER_RETRANSMIT_HANDSHAKE,
+	TIMER_SEND_KEEPALIVE,
+	TIMER_NEW_HANDSHAKE,
+	TIMER_KILL_EPHEMERALS,
+	TIMER_PERSISTENT_KEEPALIVE,
+	TIMER_COUNT
+};
+
+enum { TIMER_WHEEL_SLOTS = 512 };
+
+struct timer_wheel {
+	struct hlist_head slots[TIMER_WHEEL_SLOTS];
+	unsigned long clock, next_run;
+	bool scheduled;
+	spinlock_t lock;
+	struct delayed_work work;
+};
+
+void timers_init_device(struct wireguard_device *wg);
+void timers_uninit_device(struct wireguard_device *wg);
+
 void timers_init_peer(struct wireguard_peer *peer);
 void timers_uninit_peer(struct wireguard_peer *peer);
 void timers_uninit_peer_wait(struct wireguard_peer *peer);
@@ -16,5 +43,6 @@ void timers_handshake_initiated(struct wireguard_peer *peer);
 void timers_handshake_complete(struct wireguard_peer *peer);
 void timers_ephemeral_key_created(struct wireguard_peer *peer);
 void timers_any_authenticated_packet_traversal(struct wireguard_peer *peer);
+void timers_keys_cleared(struct wireguard_peer *peer);
 
 #endif
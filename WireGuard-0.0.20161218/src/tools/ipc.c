@@ -419,6 +419,38 @@ out:
 	errno = -ret;
 	return ret;
 }
+
+static int kernel_get_stats(struct wgdevice_stats **stats, const char *interface)
+{
+	int ret;
+	struct ifreq ifreq = { 0 };
+	memcpy(&ifreq.ifr_name, interface, IFNAMSIZ);
+	ifreq.ifr_name[IFNAMSIZ - 1] = 0;
+	*stats = NULL;
+	do {
+		free(*stats);
+		ret = do_ioctl(WG_GET_STATS, &ifreq);
+		if (ret < 0)
+			goto out;
+		*stats = calloc(max((size_t)ret, sizeof(struct wgdevice_stats)), 1);
+		if (!*stats) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		(*stats)->size = max((size_t)ret, sizeof(struct wgdevice_stats));
+		ifreq.ifr_data = (char *)*stats;
+		memcpy(&ifreq.ifr_name, interface, IFNAMSIZ);
+		ifreq.ifr_name[IFNAMSIZ - 1] = 0;
+		ret = do_ioctl(WG_GET_STATS, &ifreq);
+	} while (ret == -EMSGSIZE);
+	if (ret < 0) {
+		free(*stats);
+		*stats = NULL;
+	}
+out:
+	errno = -ret;
+	return ret;
+}
 #endif
 
 /* first\0second\0third\0forth\0last\0\0 */
@@ -462,6 +494,18 @@ int ipc_get_device(struct wgdevice **dev, const char *interface)
 #endif
 }
 
+/* Only the kernel module has statistics, so this fails with EOPNOTSUPP for userspace implementations. */
+int ipc_get_stats(struct wgdevice_stats **stats, const char *interface)
+{
+	*stats = NULL;
+#ifdef __linux__
+	if (!userspace_has_wireguard_interface(interface))
+		return kernel_get_stats(stats, interface);
+#endif
+	errno = EOPNOTSUPP;
+	return -EOPNOTSUPP;
+}
+
 int ipc_set_device(struct wgdevice *dev)
 {
 #ifdef __linux__
@@ -6,9 +6,11 @@
 #include <stdbool.h>
 
 struct wgdevice;
+struct wgdevice_stats;
 
 int ipc_set_device(struct wgdevice *dev);
 int ipc_get_device(struct wgdevice **dev, const char *interface);
+int ipc_get_stats(struct wgdevice_stats **stats, const char *interface);
 char *ipc_list_devices(void);
 bool ipc_has_device(const char *interface);
 
@@ -78,6 +78,39 @@ static void sort_peers(struct wgdevice *device)
 
 static const uint8_t zero[WG_KEY_LEN] = { 0 };
 
+/* Counters that the kernel (or a userspace implementation) doesn't have are shown as zero. */
+static const struct wgdevice_stats no_device_stats;
+static const struct wgpeer_stats no_peer_stats;
+
+static const struct wgdevice_stats *device_stats(const struct wgdevice_stats *stats)
+{
+	static struct wgdevice_stats known;
+
+	if (!stats)
+		return &no_device_stats;
+	memset(&known, 0, sizeof(known));
+	memcpy(&known, stats, stats->device_stats_size < sizeof(known) ? stats->device_stats_size : sizeof(known));
+	return &known;
+}
+
+static const struct wgpeer_stats *peer_stats(const struct wgdevice_stats *stats, const uint8_t public_key[static WG_KEY_LEN])
+{
+	static struct wgpeer_stats known;
+	struct wgpeer_stats *peer;
+	size_t i;
+
+	if (!stats)
+		return &no_peer_stats;
+	for_each_wgpeer_stats(stats, peer, i) {
+		if (memcmp(peer->public_key, public_key, WG_KEY_LEN))
+			continue;
+		memset(&known, 0, sizeof(known));
+		memcpy(&known, peer, stats->peer_stats_size < sizeof(known) ? stats->peer_stats_size : sizeof(known));
+		return &known;
+	}
+	return &no_peer_stats;
+}
+
 static char *key(const unsigned char key[static WG_KEY_LEN])
 {
 	static char b64[b64_len(WG_KEY_LEN)];
@@ -203,13 +236,14 @@ static char *bytes(uint64_t b)
 static const char *COMMAND_NAME = NULL;
 static void show_usage(void)
 {
-	fprintf(stderr, "Usage: %s %s { <interface> | all | interfaces } [public-key | private-key | preshared-key | listen-port | peers | endpoints | allowed-ips | latest-handshakes | bandwidth | persistent-keepalive]\n", PROG_NAME, COMMAND_NAME);
+	fprintf(stderr, "Usage: %s %s { <interface> | all | interfaces } [public-key | private-key | preshared-key | listen-port | peers | endpoints | allowed-ips | latest-handshakes | bandwidth | packets | drops | handshake-attempts | persistent-keepalive | route-cache | ephemeral-pool]\n", PROG_NAME, COMMAND_NAME);
 }
 
-static void pretty_print(struct wgdevice *device)
+static void pretty_print(struct wgdevice *device, const struct wgdevice_stats *stats)
 {
 	size_t i, j;
 	struct wgpeer *peer;
+	const struct wgpeer_stats *pstats;
 	struct wgipmask *ipmask;
 
 	terminal_printf(TERMINAL_RESET);
@@ -227,6 +261,7 @@ static void pretty_print(struct wgdevice *device)
 		terminal_printf("\n");
 	}
 	for_each_wgpeer(device, peer, i) {
+		pstats = peer_stats(stats, peer->public_key);
 		terminal_printf(TERMINAL_FG_YELLOW TERMINAL_BOLD "peer" TERMINAL_RESET ": " TERMINAL_FG_YELLOW "%s" TERMINAL_RESET "\n", key(peer->public_key));
 		if (peer->endpoint.ss_family == AF_INET || peer->endpoint.ss_family == AF_INET6)
 			terminal_printf("  " TERMINAL_BOLD "endpoint" TERMINAL_RESET ": %s\n", endpoint(&peer->endpoint));
@@ -243,6 +278,12 @@ static void pretty_print(struct wgdevice *device)
 			terminal_printf("%s received, ", bytes(peer->rx_bytes));
 			terminal_printf("%s sent\n", bytes(peer->tx_bytes));
 		}
+		if (pstats->rx_packets || pstats->tx_packets)
+			terminal_printf("  " TERMINAL_BOLD "packets" TERMINAL_RESET ": %llu received, %llu sent\n", (unsigned long long)pstats->rx_packets, (unsigned long long)pstats->tx_packets);
+		if (pstats->rx_dropped_length || pstats->rx_dropped_source || pstats->rx_dropped_auth || pstats->rx_replayed || pstats->tx_dropped)
+			terminal_printf("  " TERMINAL_BOLD "drops" TERMINAL_RESET ": %llu malformed, %llu disallowed source, %llu unauthenticated, %llu replayed received, %llu failed sending\n", (unsigned long long)pstats->rx_dropped_length, (unsigned long long)pstats->rx_dropped_source, (unsigned long long)pstats->rx_dropped_auth, (unsigned long long)pstats->rx_replayed, (unsigned long long)pstats->tx_dropped);
+		if (pstats->handshake_initiations)
+			terminal_printf("  " TERMINAL_BOLD "handshake attempts" TERMINAL_RESET ": %llu\n", (unsigned long long)pstats->handshake_initiations);
 		if (peer->persistent_keepalive_interval)
 			terminal_printf("  " TERMINAL_BOLD "persistent keepalive" TERMINAL_RESET ": %s\n", every(peer->persistent_keepalive_interval));
 		if (i + 1 < device->num_peers)
@@ -250,10 +291,11 @@ static void pretty_print(struct wgdevice *device)
 	}
 }
 
-static bool ugly_print(struct wgdevice *device, const char *param, bool with_interface)
+static bool ugly_print(struct wgdevice *device, const struct wgdevice_stats *stats, const char *param, bool with_interface)
 {
 	size_t i, j;
 	struct wgpeer *peer;
+	const struct wgpeer_stats *pstats;
 	struct wgipmask *ipmask;
 	if (!strcmp(param, "public-key")) {
 		if (with_interface)
@@ -304,6 +346,27 @@ static bool ugly_print(struct wgdevice *device, const char *param, bool with_int
 				printf("%s\t", device->interface);
 			printf("%s\t%" PRIu64 "\t%" PRIu64 "\n", key(peer->public_key), (uint64_t)peer->rx_bytes, (uint64_t)peer->tx_bytes);
 		}
+	} else if (!strcmp(param, "packets")) {
+		for_each_wgpeer(device, peer, i) {
+			if (with_interface)
+				printf("%s\t", device->interface);
+			pstats = peer_stats(stats, peer->public_key);
+			printf("%s\t%" PRIu64 "\t%" PRIu64 "\n", key(peer->public_key), (uint64_t)pstats->rx_packets, (uint64_t)pstats->tx_packets);
+		}
+	} else if (!strcmp(param, "drops")) {
+		for_each_wgpeer(device, peer, i) {
+			if (with_interface)
+				printf("%s\t", device->interface);
+			pstats = peer_stats(stats, peer->public_key);
+			printf("%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n", key(peer->public_key), (uint64_t)pstats->rx_dropped_length, (uint64_t)pstats->rx_dropped_source, (uint64_t)pstats->rx_dropped_auth, (uint64_t)pstats->rx_replayed, (uint64_t)pstats->tx_dropped);
+		}
+	} else if (!strcmp(param, "handshake-attempts")) {
+		for_each_wgpeer(device, peer, i) {
+			if (with_interface)
+				printf("%s\t", device->interface);
+			pstats = peer_stats(stats, peer->public_key);
+			printf("%s\t%" PRIu64 "\n", key(peer->public_key), (uint64_t)pstats->handshake_initiations);
+		}
 	} else if (!strcmp(param, "persistent-keepalive")) {
 		for_each_wgpeer(device, peer, i) {
 			if (with_interface)
@@ -313,6 +376,14 @@ static bool ugly_print(struct wgdevice *device, const char *param, bool with_int
 			else
 				printf("%s\toff\n", key(peer->public_key));
 		}
+	} else if (!strcmp(param, "route-cache")) {
+		if (with_interface)
+			printf("%s\t", device->interface);
+		printf("%llu\t%llu\n", (unsigned long long)device_stats(stats)->route_cache_hits, (unsigned long long)device_stats(stats)->route_cache_misses);
+	} else if (!strcmp(param, "ephemeral-pool")) {
+		if (with_interface)
+			printf("%s\t", device->interface);
+		printf("%u\t%llu\t%llu\n", device_stats(stats)->ephemeral_pool_depth, (unsigned long long)device_stats(stats)->ephemeral_pool_hits, (unsigned long long)device_stats(stats)->ephemeral_pool_misses);
 	} else if (!strcmp(param, "peers")) {
 		for_each_wgpeer(device, peer, i) {
 			if (with_interface)
@@ -346,21 +417,25 @@ int show_main(int argc, char *argv[])
 		interface = interfaces;
 		for (size_t len = 0; (len = strlen(interface)); interface += len + 1) {
 			struct wgdevice *device = NULL;
+			struct wgdevice_stats *stats = NULL;
 			if (ipc_get_device(&device, interface) < 0) {
 				perror("Unable to get device");
 				continue;
 			}
+			ipc_get_stats(&stats, interface);
 			if (argc == 3) {
-				if (!ugly_print(device, argv[2], true)) {
+				if (!ugly_print(device, stats, argv[2], true)) {
 					ret = 1;
+					free(stats);
 					free(device);
 					break;
 				}
 			} else {
-				pretty_print(device);
+				pretty_print(device, stats);
 				if (strlen(interface + len + 1))
 					printf("\n");
 			}
+			free(stats);
 			free(device);
 		}
 		free(interfaces);
@@ -383,6 +458,7 @@ int show_main(int argc, char *argv[])
 		show_usage();
 	else {
 		struct wgdevice *device = NULL;
+		struct wgdevice_stats *stats = NULL;
 		if (!ipc_has_device(argv[1])) {
 			fprintf(stderr, "`%s` is not a valid WireGuard interface\n", argv[1]);
 			show_usage();
@@ -393,11 +469,13 @@ int show_main(int argc, char *argv[])
 			show_usage();
 			return 1;
 		}
+		ipc_get_stats(&stats, argv[1]);
 		if (argc == 3) {
-			if (!ugly_print(device, argv[2], false))
+			if (!ugly_print(device, stats, argv[2], false))
 				ret = 1;
 		} else
-			pretty_print(device);
+			pretty_print(device, stats);
+		free(stats);
 		free(device);
 	}
 	return ret;
@@ -57,6 +57,28 @@
  *     If `wgdevice->remove_preshared_key` is true, the pre-shared key is removed.
  *
  *     Returns 0 on success, or -errno if an error occurred.
+ *
+ * ioctl(WG_GET_STATS, { .ifr_name: "wg0", .ifr_data: NULL }):
+ *
+ *     Returns the number of bytes required to hold the statistics of a device and its peers (`ret_size`).
+ *
+ * ioctl(WG_GET_STATS, { .ifr_name: "wg0", .ifr_data: user_pointer }):
+ *
+ *     Retrieves device and peer statistics.
+ *
+ *     `user_pointer` must point to a region of memory of size `ret_size`, containing the structure
+ *     `struct wgdevice_stats { .size: ret_size }`.
+ *
+ *     Writes to `user_pointer` a `struct wgdevice_stats { .num_peers = 3 }` followed by three
+ *     `struct wgpeer_stats`. These are kept apart from `struct wgdevice` and `struct wgpeer`, so that
+ *     new counters never change the layout used by WG_GET_DEVICE and WG_SET_DEVICE. Counters are
+ *     only ever appended, and the kernel fills in `device_stats_size` and `peer_stats_size` with the
+ *     sizes of the structs it was built with. Those say where the first peer starts, how far apart
+ *     the peers are, and which counters are there at all, so userspace built against an older or
+ *     newer version of this header can still read the ones they have in common, as long as it
+ *     steps through the peers with `for_each_wgpeer_stats` below.
+ *
+ *     Returns 0 on success, or -EMSGSIZE or -errno, as for WG_GET_DEVICE.
  */
 
 
@@ -83,6 +105,7 @@ typedef int32_t __s32;
 
 #define WG_GET_DEVICE (SIOCDEVPRIVATE + 0)
 #define WG_SET_DEVICE (SIOCDEVPRIVATE + 1)
+#define WG_GET_STATS (SIOCDEVPRIVATE + 2)
 
 #define WG_KEY_LEN 32
 
@@ -129,6 +152,32 @@ struct wgdevice {
 	};
 };
 
+/* New counters are only ever added to the end of these two. */
+struct wgpeer_stats {
+	__u8 public_key[WG_KEY_LEN]; /* Get */
+
+	__u64 rx_packets, tx_packets; /* Get */
+	__u64 rx_dropped_length; /* Get -- too short or not IP */
+	__u64 rx_dropped_source; /* Get -- source not in allowed IPs */
+	__u64 rx_dropped_auth; /* Get -- failed authentication */
+	__u64 rx_replayed; /* Get -- counter replayed or too old */
+	__u64 tx_dropped; /* Get -- could not be sent on the socket */
+	__u64 handshake_initiations; /* Get */
+};
+
+struct wgdevice_stats {
+	__u64 size; /* Get/Set -- of the whole region at user_pointer */
+	__u32 device_stats_size; /* Get -- sizeof(struct wgdevice_stats) in the kernel */
+	__u32 peer_stats_size; /* Get -- sizeof(struct wgpeer_stats) in the kernel */
+	__u32 num_peers; /* Get */
+
+	__u32 ephemeral_pool_depth; /* Get */
+	__u64 ephemeral_pool_hits; /* Get */
+	__u64 ephemeral_pool_misses; /* Get */
+	__u64 route_cache_hits; /* Get */
+	__u64 route_cache_misses; /* Get */
+};
+
 /* These are simply for convenience in iterating. It allows you to write something like:
  *
  *    for_each_wgpeer(device, peer, i) {
@@ -141,6 +190,10 @@ struct wgdevice {
 						 (__i) < (__dev)->num_peers; \
 						 ++(__i), (__peer) = (struct wgpeer *)((uint8_t *)(__peer) + sizeof(struct wgpeer) + (sizeof(struct wgipmask) * (__peer)->num_ipmasks)))
 
+#define for_each_wgpeer_stats(__stats, __peer, __i) for ((__i) = 0, (__peer) = (struct wgpeer_stats *)((uint8_t *)(__stats) + (__stats)->device_stats_size); \
+						 (__i) < (__stats)->num_peers; \
+						 ++(__i), (__peer) = (struct wgpeer_stats *)((uint8_t *)(__peer) + (__stats)->peer_stats_size))
+
 #define for_each_wgipmask(__peer, __ipmask, __i) for ((__i) = 0, (__ipmask) = (struct wgipmask *)((uint8_t *)(__peer) + sizeof(struct wgpeer)); \
 						 (__i) < (__peer)->num_ipmasks; \
 						 ++(__i), (__ipmask) = (struct wgipmask *)((uint8_t *)(__ipmask) + sizeof(struct wgipmask)))